@@ -0,0 +1,115 @@
+#ifndef ATOMICTEST_PRIVATE_H
+#define ATOMICTEST_PRIVATE_H
+
+#include "atomictest.h"
+
+/*
+ * The atomictest tool's side of the library: benchmarks, soak runs and the
+ * reports, shared by atomictest.c and main.c. None of it is exported from
+ * libatomictest or bound by its ABI.
+ */
+
+#define ATOMICTEST_MAX_BENCH_STEPS 16
+
+/* What the tool runs on top of an instance's struct at_config. */
+struct at_options {
+	/* frames per content and path of the shadow rendering benchmark */
+	uint32_t bench_shadow_frames;
+
+	uint32_t bench_scales[ATOMICTEST_MAX_BENCH_STEPS];
+	uint32_t bench_scale_count;
+
+	/* how long each step of a flipping benchmark runs */
+	double bench_seconds;
+
+	bool bench_backends;
+	bool bench_async;
+	bool bench_vrr;
+
+	bool bench_modes;
+	const char *bench_modes_filter;
+
+	bool bench_planes;
+	bool bench_input;
+	bool bench_cursor;
+
+	/* "all" or a comma separated list of nodes, one instance each */
+	const char *devices;
+	bool bench_devices;
+
+	/* CLOCK_MONOTONIC when main() started, for the startup report */
+	uint64_t start_ns;
+
+	bool writeback;
+	/* raw frames are appended here, NULL only checksums them */
+	const char *writeback_sink;
+
+	/* soak run, until interrupted if soak_seconds is 0 */
+	bool soak;
+	double soak_seconds;
+	double soak_window;
+	/* regression past the first window, in percent, that raises an alert */
+	uint32_t soak_alert_pct;
+
+	/* config.seed was given; otherwise the stress engine picks and prints one */
+	bool seed_set;
+	/* randomized TEST_ONLY commits, or just iteration stress_replay (>= 0) */
+	bool bench_commit;
+	int64_t stress_replay;
+
+	bool bench_rt;
+	/* background load threads, 0 for one per CPU */
+	bool load;
+	uint32_t load_threads;
+
+	/* per frame cycles, cache misses, faults, switches and migrations */
+	bool perf;
+};
+
+void
+at_options_init(struct at_options *options);
+
+/* at_instance_create() with the tool's options, NULL for the defaults. */
+struct at_instance *
+at_instance_create_options(const struct at_config *config,
+			   const struct at_options *options);
+
+/*
+ * Runs the benchmark the options ask for. Returns 1 if one ran, 0 if none
+ * was asked for and the instance is ready for the regular loop, or a
+ * negative errno if config.async can't be honoured.
+ */
+int
+at_instance_bench(struct at_instance *instance);
+
+void
+at_instance_bench_shadow(struct at_instance *instance, uint32_t frames);
+
+/*
+ * Long running flip loop with windowed summaries, resource tracking and
+ * alerts on regressions, see struct at_options.
+ */
+int
+at_instance_soak(struct at_instance *instance);
+
+void
+at_instance_print_memory(struct at_instance *instance);
+
+/* The reports of a regular run that lasted the given time. */
+void
+at_instance_report(struct at_instance *instance, double seconds);
+
+struct at_load;
+
+/* CPU and memory bandwidth hogs at normal priority, 0 for one per CPU. */
+struct at_load *
+at_load_start(uint32_t threads);
+
+void
+at_load_stop(struct at_load *load);
+
+/* Drives options->devices in parallel, an instance and thread each. */
+int
+at_run_devices(const struct at_config *config, const struct at_options *options);
+
+#endif
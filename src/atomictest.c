@@ -0,0 +1,9574 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <libudev.h>
+#include <libinput.h>
+#include <linux/input.h>
+#include <linux/perf_event.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <config.h>
+
+#include "atomictest.h"
+#include "atomictest-private.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+#define TIMESPEC_NSEC(t) ((uint64_t)(t).tv_sec * 1000000000 + (t).tv_nsec)
+
+/* probe traces, only with --verbose */
+#define at_debug(...) \
+	do { if (verbose) printf(__VA_ARGS__); } while (0)
+
+static bool verbose;
+
+#define ATOMICTEST_NUM_FBS 2
+#define ATOMICTEST_HUGEPAGE_SIZE (2u << 20)
+#define ATOMICTEST_CACHELINE 64
+#define ATOMICTEST_CONTENT_RECT_SIZE 256
+#define ATOMICTEST_VIDEO_READAHEAD 4
+#define ATOMICTEST_WRITEBACK_FBS 3
+#define ATOMICTEST_MAX_DEVICES 64
+
+/* soak histograms, see at_histogram_bucket() */
+#define ATOMICTEST_HIST_SUB_BITS 3
+#define ATOMICTEST_HIST_BUCKETS ((64 - ATOMICTEST_HIST_SUB_BITS + 1) << ATOMICTEST_HIST_SUB_BITS)
+
+/* adaptive overlay controller, see at_adaptive_frame() */
+#define ATOMICTEST_ADAPTIVE_WINDOW 60
+#define ATOMICTEST_ADAPTIVE_MAX_MISSES 2
+#define ATOMICTEST_ADAPTIVE_RESTORE_WINDOWS 3
+#define ATOMICTEST_ADAPTIVE_MAX_RESTORE_WINDOWS 48
+
+/* slowest frames kept with their counters, see at_perf_outlier() */
+#define ATOMICTEST_PERF_OUTLIERS 8
+
+struct at_rect {
+	int32_t x1, y1;
+	int32_t x2, y2;
+};
+
+/* What a primary buffer held under the software cursor. */
+struct at_save_under {
+	struct at_rect rect;
+	uint32_t *pixels;
+};
+
+/*
+ * CPU view of a render target. Used for both the mapped dumb buffers and the
+ * cacheable shadow buffer so the content generators don't care which is which.
+ */
+struct at_surface {
+	uint8_t *data;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pitch;
+};
+
+/* Bump allocator over a (huge)page backed anonymous mapping. */
+struct at_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	bool hugetlb;
+};
+
+static const char *const at_content_names[AT_CONTENT_COUNT] = {
+	[AT_CONTENT_FILL] = "fill",
+	[AT_CONTENT_RECT] = "rect",
+	[AT_CONTENT_BLEND] = "blend",
+};
+
+enum at_scene_role {
+	AT_SCENE_PRIMARY,
+	AT_SCENE_OVERLAY,
+	AT_SCENE_CURSOR,
+};
+
+enum at_scene_content {
+	AT_SCENE_SOLID,
+	AT_SCENE_CHECKER,
+	AT_SCENE_GRADIENT,
+	AT_SCENE_PULSE,
+};
+
+enum at_scene_motion {
+	AT_MOTION_STATIC,
+	AT_MOTION_CIRCLE,
+	AT_MOTION_BOUNCE,
+	AT_MOTION_INPUT,
+};
+
+/*
+ * One plane of a scene file with everything the per-frame evaluation needs
+ * already resolved, see at_scene_load() for the file format.
+ */
+struct at_scene_plane {
+	uint8_t role;
+	uint8_t content;
+	uint8_t motion;
+	bool has_zpos;
+	bool has_alpha;
+	int64_t zpos;
+	uint16_t alpha;
+	/* overlay_fbs/overlay_planes slot for overlays */
+	uint16_t index;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+
+	uint32_t color;
+	uint32_t color2;
+	uint32_t cell;
+
+	/* static position, circle center or bounce origin (top-left) */
+	double x, y;
+	double radius;
+	double omega;
+	double phase;
+	double vx, vy;
+
+	int32_t cur_x, cur_y;
+};
+
+struct at_scene {
+	struct at_scene_plane *planes;
+	uint32_t count;
+	uint32_t overlay_count;
+	bool has_cursor;
+	uint64_t start_ns;
+};
+
+enum at_async {
+	AT_ASYNC_NONE,
+	AT_ASYNC_ATOMIC,
+	AT_ASYNC_LEGACY,
+};
+
+static const char *const at_cursor_mode_names[AT_CURSOR_COUNT] = {
+	[AT_CURSOR_PLANE] = "plane",
+	[AT_CURSOR_OVERLAY] = "overlay",
+	[AT_CURSOR_SOFTWARE] = "software",
+};
+
+static const char *const at_backend_names[AT_BACKEND_COUNT] = {
+	[AT_BACKEND_ATOMIC] = "atomic",
+	[AT_BACKEND_LEGACY] = "legacy",
+};
+
+/* Constant-size alternative to at_samples for runs of unbounded length. */
+struct at_histogram {
+	uint64_t buckets[ATOMICTEST_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+struct at_soak_resources {
+	long rss_kib;
+	int fds;
+	uint32_t blobs;
+	uint32_t fbs;
+};
+
+/* Soak state, see at_instance_soak(). */
+struct at_soak {
+	/* the current window */
+	struct at_histogram frame;
+	struct at_histogram commit;
+	/* the first window, what later ones are held against */
+	struct at_histogram baseline_frame;
+	struct at_histogram baseline_commit;
+	struct at_histogram total_frame;
+	struct at_histogram total_commit;
+
+	struct at_soak_resources baseline;
+	struct at_soak_resources peak;
+
+	uint32_t alert_pct;
+	uint32_t windows;
+	uint64_t alerts;
+	uint64_t missed;
+	uint64_t start_ns;
+	uint64_t window_start_ns;
+};
+
+/* Growable array of measurements, summarized with at_samples_percentile(). */
+struct at_samples {
+	uint64_t *values;
+	size_t count;
+	size_t capacity;
+	bool sorted;
+};
+
+const char *
+at_content_name(enum at_content content)
+{
+	return content < AT_CONTENT_COUNT ? at_content_names[content] : NULL;
+}
+
+int
+at_content_from_name(const char *name, enum at_content *content)
+{
+	int i;
+
+	for (i = 0; i < AT_CONTENT_COUNT; i++) {
+		if (!strcmp(name, at_content_names[i])) {
+			*content = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+struct at_drm_prop {
+	uint32_t id;
+	/* empty until the metadata is fetched or the topology cache names it */
+	char name[DRM_PROP_NAME_LEN];
+	drmModePropertyRes *res;
+};
+
+/* Per device, property IDs are global to the DRM file. */
+struct at_drm_prop_cache {
+	int fd;
+	struct at_drm_prop **props;
+	uint32_t count;
+	/* drmModeGetProperty calls made so far */
+	uint32_t fetches;
+};
+
+struct at_drm_properties {
+	drmModeObjectProperties *props;
+	/* entries of the device's property cache, in props order */
+	struct at_drm_prop **prop;
+	struct at_drm_prop_cache *cache;
+};
+
+struct at_drm_connector {
+	uint32_t connector_id;
+	struct at_drm_properties properties;
+};
+
+struct at_drm_crtc {
+	uint32_t crtc_id;
+	uint32_t crtc_idx;
+	struct at_drm_properties properties;
+};
+
+enum at_blend {
+	AT_BLEND_NONE,
+	AT_BLEND_PREMULTI,
+	AT_BLEND_COVERAGE,
+	AT_BLEND_COUNT,
+};
+
+/* as the kernel spells the "pixel blend mode" enum */
+static const char *const at_blend_names[] = {
+	[AT_BLEND_NONE] = "None",
+	[AT_BLEND_PREMULTI] = "Pre-multiplied",
+	[AT_BLEND_COVERAGE] = "Coverage",
+};
+
+struct at_drm_plane {
+	uint32_t plane_id;
+	struct at_drm_properties properties;
+
+	/* optional properties, probed once when the plane is added */
+	bool has_zpos;
+	bool zpos_mutable;
+	int64_t zpos;
+	int64_t zpos_min;
+	int64_t zpos_max;
+	bool has_alpha;
+	uint64_t alpha_max;
+	uint64_t alpha;
+	/* enum value of each AT_BLEND_* mode, -1 if not offered */
+	int64_t blend_modes[AT_BLEND_COUNT];
+	/* the AT_BLEND_* mode the plane came up with, -1 if unknown */
+	int32_t blend;
+	/* DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* bits the plane accepts */
+	uint32_t rotations;
+	uint32_t rotation;
+};
+
+/* Overrides for a plane's optional properties, unset ones aren't added. */
+struct at_plane_state {
+	bool set_zpos;
+	int64_t zpos;
+	/* percent of the plane's alpha range, -1 to leave it alone */
+	int32_t alpha;
+	/* AT_BLEND_*, -1 to leave it alone */
+	int32_t blend;
+	/* DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_*, 0 to leave it alone */
+	uint32_t rotation;
+};
+
+enum at_mem_purpose {
+	AT_MEM_PRIMARY,
+	AT_MEM_CURSOR,
+	AT_MEM_OVERLAY,
+	AT_MEM_VIDEO,
+	AT_MEM_WRITEBACK,
+	AT_MEM_PURPOSE_COUNT,
+};
+
+static const char *const at_mem_purpose_names[] = {
+	[AT_MEM_PRIMARY] = "primary",
+	[AT_MEM_CURSOR] = "cursor",
+	[AT_MEM_OVERLAY] = "overlay",
+	[AT_MEM_VIDEO] = "video",
+	[AT_MEM_WRITEBACK] = "writeback",
+};
+
+/* Every dumb buffer goes through here, see at_dumb_buffer_create(). */
+struct at_mem_stats {
+	/* bytes of scanout memory we may use, 0 for no limit */
+	uint64_t budget;
+	uint64_t current;
+	uint64_t peak;
+	/* bytes the kernel added beyond width * bpp, mostly pitch alignment */
+	uint64_t padding;
+	uint64_t purpose_bytes[AT_MEM_PURPOSE_COUNT];
+	uint64_t purpose_count[AT_MEM_PURPOSE_COUNT];
+	uint64_t rejected;
+	uint64_t failed;
+	/* live buffers, newest first */
+	struct at_dumb_buffer *buffers;
+
+	/* estimated bytes of allocations in flight, see at_dumb_buffer_alloc() */
+	uint64_t pending;
+	/* allocations may run on several threads, see at_dumb_fbs_create() */
+	pthread_mutex_t lock;
+
+	/* wall time spent allocating and mapping buffers */
+	uint64_t alloc_ns;
+	uint64_t map_ns;
+};
+
+struct at_device {
+	int fd;
+
+	drmModeModeInfo mode;
+	uint16_t width;
+	uint16_t height;
+
+	struct at_drm_connector *connector;
+	struct at_drm_crtc *crtc;
+
+	/* possible planes for crtc_id */
+	struct at_drm_plane **planes;
+	uint32_t plane_count;
+
+	/* they point to one of the planes elements */
+	struct at_drm_plane *primary_plane;
+	struct at_drm_plane *cursor_plane;
+	struct at_drm_plane **overlay_planes;
+	uint32_t overlays_count;
+
+	uint32_t blob_id;
+
+	/* every mode the connector offered when last probed */
+	drmModeModeInfo *modes;
+	uint32_t mode_count;
+
+	drmModeCrtc *saved_crtc;
+
+	struct at_mem_stats mem;
+	/* DRM objects we hold, for leak tracking */
+	uint32_t live_blobs;
+	uint32_t live_fbs;
+
+	struct at_drm_prop_cache prop_cache;
+};
+
+struct at_dumb_buffer {
+	enum at_mem_purpose purpose;
+	struct at_dumb_buffer *next;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+
+	uint32_t handle;
+	uint32_t pitch;
+	uint64_t size;
+
+	uint8_t *data;
+};
+
+struct at_dumb_fb {
+	struct at_dumb_buffer *dumb;
+	uint32_t fb_id;
+};
+
+struct at_writeback {
+	struct at_drm_connector connector;
+
+	/* written round-robin, at most one capture is in flight */
+	struct at_dumb_fb *fbs[ATOMICTEST_WRITEBACK_FBS];
+	uint32_t next;
+	int staged;
+	int pending;
+	/* WRITEBACK_OUT_FENCE_PTR points here, the kernel stores an s32 */
+	int32_t fence_fd;
+
+	/* what the planes should composite to, checksummed against the capture */
+	struct at_surface reference;
+	int sink_fd;
+
+	/*
+	 * The geometry of the commit being captured, so the reference doesn't
+	 * pick up input or animation from after it.
+	 */
+	struct {
+		uint32_t fb_idx;
+		int32_t cursor_x;
+		int32_t cursor_y;
+		uint32_t overlays;
+		struct {
+			int32_t x;
+			int32_t y;
+		} *overlay_pos;
+	} committed;
+
+	uint64_t captured;
+	uint64_t verified;
+	uint64_t mismatches;
+	uint64_t unverified;
+	uint64_t skipped;
+	uint64_t sink_bytes;
+	uint64_t wait_ns;
+	uint64_t checksum_ns;
+	uint64_t write_ns;
+};
+
+struct at_video {
+	int fd;
+	uint8_t *map;
+	uint8_t *read_buf;
+	uint64_t file_size;
+	uint64_t frame_size;
+	uint64_t frame_count;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+
+	struct at_dumb_fb *fbs[ATOMICTEST_NUM_FBS];
+	uint32_t cur_fb;
+
+	/* index of the source frame currently in fbs[cur_fb] */
+	int64_t shown;
+	uint64_t start_ns;
+
+	uint64_t frames_copied;
+	uint64_t frames_dropped;
+	uint64_t frames_repeated;
+	uint64_t io_stall_ns;
+	uint64_t copy_ns;
+	uint64_t copy_bytes;
+};
+
+/*
+ * Quality level 0 shows every overlay in full; each level above sheds some
+ * overlay area first and then whole overlays, see at_adaptive_set_level().
+ */
+struct at_adaptive {
+	uint32_t level;
+
+	uint32_t window_frames;
+	uint32_t window_misses;
+	uint32_t window_failures;
+
+	/* consecutive clean windows, and how many are needed to restore */
+	uint32_t good_windows;
+	uint32_t restore_after;
+	/* set after a restore until the following window has been judged */
+	bool probing;
+
+	uint64_t degrades;
+	uint64_t restores;
+};
+
+enum at_perf_counter {
+	AT_PERF_CYCLES,
+	AT_PERF_INSTRUCTIONS,
+	AT_PERF_LLC_MISSES,
+	AT_PERF_PAGE_FAULTS,
+	AT_PERF_CONTEXT_SWITCHES,
+	AT_PERF_MIGRATIONS,
+	AT_PERF_COUNT
+};
+
+struct at_perf_frame {
+	uint64_t frame;
+	uint64_t interval_ns;
+	uint32_t missed;
+	uint64_t values[AT_PERF_COUNT];
+};
+
+/*
+ * Counters of the thread dispatching events, read as one group at every
+ * flip, see at_instance_perf_flip(). Counters that can't be opened are
+ * left out.
+ */
+struct at_perf {
+	bool tried;
+	int fds[AT_PERF_COUNT];
+	int group_fd;
+	/* position in the group read, -1 for a counter that isn't open */
+	int index[AT_PERF_COUNT];
+	uint32_t count;
+	/* perf_event_paranoid only let the counter see user space */
+	bool user_only[AT_PERF_COUNT];
+
+	bool have_last;
+	uint64_t last[AT_PERF_COUNT];
+	uint64_t last_enabled;
+	uint64_t last_running;
+
+	/* per frame interval */
+	struct at_samples values[AT_PERF_COUNT];
+	/* the slowest intervals, slowest first */
+	struct at_perf_frame outliers[ATOMICTEST_PERF_OUTLIERS];
+	uint32_t outlier_count;
+};
+
+/*
+ * On-demand presentation, see at_instance_set_on_demand(): a flip only
+ * leads to another frame when the scene or the input changed, otherwise
+ * the flip chain stops until something does.
+ */
+struct at_idle {
+	bool enabled;
+	/* the chain is stopped; read by the input thread to decide on waking */
+	bool sleeping;
+	/* written by the input thread to wake a stopped loop */
+	int wake_fd;
+	/* scheduled scene updates, next_change_ns is 0 for input only */
+	uint64_t change_interval_ns;
+	uint64_t next_change_ns;
+	/* the submit in progress only moves the cursor */
+	bool cursor_only;
+	/* the next flip is the first after a stop */
+	bool resumed;
+	/* the change that ended the last stop, until its frame flips */
+	uint64_t change_ns;
+
+	/* the stop in progress: when it began and the process CPU time then */
+	uint64_t since_ns;
+	uint64_t since_cpu_ns;
+
+	uint64_t stops;
+	uint64_t idle_ns;
+	uint64_t idle_cpu_ns;
+	uint64_t scene_frames;
+	uint64_t cursor_frames;
+	/* event loop wakeups, in total and while stopped */
+	uint64_t wakeups;
+	uint64_t idle_wakeups;
+	/* at_process_switches() at the last reset */
+	uint64_t switches;
+	struct at_samples wake_latency;
+};
+
+/* A thread's policy and CPUs from before at_instance_set_realtime(). */
+struct at_thread_state {
+	int policy;
+	struct sched_param param;
+	cpu_set_t cpus;
+};
+
+#define ATOMICTEST_CADENCE_MAX_VBLANKS 8
+
+/*
+ * Presentation on chosen vblanks, see at_instance_cadence_schedule(): each
+ * frame stays up for the number of vblanks the configured pattern, or the
+ * target rate against the refresh rate, gives it.
+ */
+struct at_cadence {
+	bool active;
+	/* a vblank event is queued, the next frame is drawn when it arrives */
+	bool queued;
+
+	/* frames since the first flip or the last late one */
+	uint64_t frame;
+	uint64_t base_ns;
+	/* evenly spaced frames would be this far apart */
+	double frame_ns;
+
+	/* the last flip, and the vblank the frame in flight should flip on */
+	uint64_t last_seq;
+	uint64_t last_ns;
+	uint64_t target_seq;
+	uint32_t requested;
+
+	uint64_t frames;
+	uint64_t on_cadence;
+	uint64_t late;
+	/* achieved intervals in vblanks, the last bucket takes longer ones */
+	uint64_t intervals[ATOMICTEST_CADENCE_MAX_VBLANKS + 1];
+	/* |flip interval - requested vblanks|, how well the cadence is kept */
+	struct at_samples error;
+	/* |flip - evenly spaced frame|, the judder the cadence itself costs */
+	struct at_samples judder;
+};
+
+/* What presenting frames cost, reset by at_instance_reset_stats(). */
+struct at_present_stats {
+	uint64_t presents;
+	uint64_t ioctls;
+	uint64_t cpu_ns;
+	uint64_t last_flip_ns;
+	struct at_samples flip_intervals;
+
+	/* from the first input event a frame reflects to that frame's flip */
+	struct at_samples input_latency;
+
+	/* async flips only: estimated scanline at which each flip landed */
+	uint64_t vblank_ref_ns;
+	struct at_samples tear_lines;
+
+	/* when the frame in flight was submitted, and the one before */
+	uint64_t submit_ns;
+	uint64_t last_submit_ns;
+	struct at_samples submit_to_flip;
+	/* |flip interval - submit interval|, how well flips track the content */
+	struct at_samples pace_error;
+	/* wall time of each present's ioctl(s) */
+	struct at_samples commit_latency;
+
+	/* pointer motion taken by frames, and how much of it was coalesced */
+	uint64_t input_events;
+	uint64_t input_frames;
+	uint64_t input_max_per_frame;
+};
+
+/*
+ * Latest pointer state, written by whichever thread dispatches libinput
+ * and read once per frame through a seqlock. Motion is coalesced into
+ * running totals; the reader applies the difference to what it took last.
+ */
+struct at_input_slot {
+	uint32_t seq;
+
+	double total_dx;
+	double total_dy;
+	uint64_t events;
+	/* timestamp of the oldest motion the reader hasn't taken yet */
+	uint64_t pending_ns;
+
+	/* overlay count asked for with the number keys */
+	int32_t overlays;
+	uint32_t overlay_requests;
+
+	/* events the reader has taken, written by the reader only */
+	uint64_t taken;
+};
+
+struct at_instance {
+	struct at_config config;
+	struct at_options options;
+	struct at_device device;
+	struct at_dumb_fb *fbs[ATOMICTEST_NUM_FBS];
+	struct at_dumb_fb *cursor_fb;
+	struct at_dumb_fb **overlay_fbs;
+
+	uint32_t cur_fb;
+	bool run;
+	bool flip_pending;
+	bool crtc_changed;
+
+	struct libinput *li;
+
+	int cursor_x;
+	int cursor_y;
+
+	struct {
+		int32_t x;
+		int32_t y;
+	} *overlay_pos;
+
+	uint64_t frames;
+	uint32_t num_overlays_use;
+	/* overlays not taken by another user (e.g. video), they come first */
+	uint32_t overlays_avail;
+
+	uint32_t last_sequence;
+	uint64_t missed_vblanks;
+
+	/* percentage of each overlay fb shown and overlays left out */
+	uint32_t overlay_scale;
+	uint32_t overlays_shed;
+	struct at_adaptive adaptive;
+	struct at_cadence cadence;
+	struct at_perf perf;
+	struct at_idle idle;
+
+	enum at_backend backend;
+	/* overlays currently enabled through the legacy SetPlane path */
+	uint32_t legacy_overlays_on;
+	struct at_present_stats stats;
+
+	/* CLOCK_MONOTONIC time of the oldest input not yet in a frame */
+	uint64_t input_pending_ns;
+	uint64_t input_inflight_ns;
+
+	/* libinput is dispatched here, on the main loop or on input_thread */
+	struct at_input_slot input;
+	bool input_threaded;
+	pthread_t input_thread;
+	int input_stop_fd;
+
+	/* the real-time controls, on the dispatching and the input thread */
+	bool rt_enabled;
+	bool rt_input;
+	bool rt_mlocked;
+	pthread_t rt_thread;
+	struct at_thread_state rt_saved;
+	struct at_thread_state rt_input_saved;
+	/* the parts of the slot's totals already applied to the cursor */
+	double input_dx_taken;
+	double input_dy_taken;
+	uint32_t overlay_requests_taken;
+
+	enum at_async async;
+
+	/* where the cursor is shown, see at_instance_set_cursor_mode() */
+	enum at_cursor_mode cursor_mode;
+	/* the overlay plane carrying it in AT_CURSOR_OVERLAY mode */
+	struct at_drm_plane *cursor_overlay;
+	/* software cursor: what each primary buffer had under the cursor */
+	struct at_save_under save_under[ATOMICTEST_NUM_FBS];
+	/* cursor image updates, save-under restores and blends, in bytes */
+	uint64_t cursor_bytes;
+	/* the strategy tearing flips replaced with the software cursor */
+	enum at_cursor_mode async_cursor_mode;
+	/* input comes from at_motion_thread(), libinput is left alone */
+	bool input_synthetic;
+	/* the cursor plane is left off, for the stress engine */
+	bool cursor_hidden;
+
+	/* the last atomic request: properties it set and the ioctl's time */
+	uint32_t last_commit_props;
+	uint64_t last_commit_ns;
+
+	bool vrr_capable;
+	bool vrr_enabled;
+	bool vrr_dirty;
+
+	/* connector hotplug, see at_instance_handle_hotplug() */
+	struct udev *udev;
+	struct udev_monitor *udev_monitor;
+	bool hotplug_pending;
+	bool output_lost;
+	uint64_t hotplug_ns;
+	struct at_samples hotplug_latency;
+
+	/* duration of the last ALLOW_MODESET commit issued by apply_mode */
+	uint64_t modeset_ns;
+
+	bool first_flip_seen;
+	/* startup phases, see at_instance_report_startup() */
+	uint64_t probe_ns;
+	uint64_t setup_modeset_ns;
+	uint64_t setup_done_ns;
+
+	/* where the built-in overlays are along their circle */
+	float overlay_angle;
+
+	struct at_scene scene;
+
+	struct at_writeback *writeback;
+
+	/* zpos/alpha/blend/rotation for each overlay plane */
+	struct at_plane_state *overlay_state;
+
+	/* scripted pacing: the next frame may not be submitted before this */
+	uint64_t next_submit_ns;
+	double pace_fps;
+	uint32_t pace_rand;
+
+	/* primary plane content, see at_instance_render_primary() */
+	uint32_t primary_width;
+	uint32_t primary_height;
+	uint64_t render_ns;
+	uint64_t render_bytes;
+	uint32_t content_frame;
+	/* manual present: when the client got the buffer it is drawing */
+	uint64_t acquire_ns;
+	struct at_rect fb_damage[ATOMICTEST_NUM_FBS];
+	/* buffer age bookkeeping: presents so far and when each fb went out */
+	uint64_t fb_presents;
+	uint64_t fb_presented[ATOMICTEST_NUM_FBS];
+
+	/* client rendering in place of the built-in content */
+	at_render_func render_func;
+	void *render_data;
+
+	struct at_arena arena;
+	struct at_surface shadow;
+	struct at_rect shadow_damage;
+
+	struct at_video *video;
+	/* the overlay the video is on, NULL when it replaces the primary */
+	struct at_drm_plane *video_plane;
+
+	/* set while at_instance_soak() runs */
+	struct at_soak *soak;
+
+	/*
+	 * Set by at_instance_interrupt() and the Q key, cleared as a loop
+	 * starts. stop points at stop_flag, or at the flag a multi-device
+	 * run shares between its instances.
+	 */
+	volatile sig_atomic_t stop_flag;
+	volatile sig_atomic_t *stop;
+};
+
+/* sticky: an interrupted process doesn't start another loop */
+static volatile sig_atomic_t at_interrupted;
+
+void
+at_interrupt(void)
+{
+	at_interrupted = true;
+}
+
+void
+at_instance_interrupt(struct at_instance *instance)
+{
+	*instance->stop = true;
+}
+
+bool
+at_instance_interrupted(struct at_instance *instance)
+{
+	return at_interrupted || *instance->stop;
+}
+
+void
+at_set_verbose(bool enable)
+{
+	verbose = enable;
+}
+
+static uint64_t
+at_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return TIMESPEC_NSEC(ts);
+}
+
+/*
+ * Time since the process was exec'd, from the start time in /proc (clock
+ * ticks since boot, so only 1/CLK_TCK resolution). 0 if unavailable.
+ */
+static uint64_t
+at_since_exec_ns(void)
+{
+	unsigned long long start_ticks;
+	struct timespec now;
+	char buf[1024], *p;
+	ssize_t len;
+	int fd, i;
+
+	fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* starttime is field 22, the comm before it may contain spaces */
+	p = strrchr(buf, ')');
+	for (i = 2; p && i < 22; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, " %llu", &start_ticks) != 1)
+		return 0;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+
+	return TIMESPEC_NSEC(now) - start_ticks * 1000000000ull / sysconf(_SC_CLK_TCK);
+}
+
+static uint64_t
+at_thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return TIMESPEC_NSEC(ts);
+}
+
+static uint64_t
+at_process_cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+	       (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
+
+/* Voluntary context switches of every thread, i.e. how often they slept. */
+static uint64_t
+at_process_switches(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_nvcsw;
+}
+
+static void
+at_samples_add(struct at_samples *samples, uint64_t value)
+{
+	if (samples->count == samples->capacity) {
+		size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		uint64_t *values = realloc(samples->values,
+					   capacity * sizeof(*values));
+		if (!values)
+			return;
+
+		samples->values = values;
+		samples->capacity = capacity;
+	}
+
+	samples->values[samples->count++] = value;
+	samples->sorted = false;
+}
+
+static void
+at_samples_reset(struct at_samples *samples)
+{
+	samples->count = 0;
+	samples->sorted = false;
+}
+
+static void
+at_samples_free(struct at_samples *samples)
+{
+	free(samples->values);
+	memset(samples, 0, sizeof(*samples));
+}
+
+static int
+at_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile, p in [0, 100]. */
+static uint64_t
+at_samples_percentile(struct at_samples *samples, double p)
+{
+	size_t idx;
+
+	if (!samples->count)
+		return 0;
+
+	if (!samples->sorted) {
+		qsort(samples->values, samples->count, sizeof(*samples->values),
+		      at_u64_cmp);
+		samples->sorted = true;
+	}
+
+	idx = p / 100.0 * samples->count;
+	if (idx >= samples->count)
+		idx = samples->count - 1;
+
+	return samples->values[idx];
+}
+
+static double
+at_samples_mean(const struct at_samples *samples)
+{
+	size_t i;
+	double sum = 0.0;
+
+	if (!samples->count)
+		return 0.0;
+
+	for (i = 0; i < samples->count; i++)
+		sum += samples->values[i];
+
+	return sum / samples->count;
+}
+
+static double
+at_samples_stddev(const struct at_samples *samples)
+{
+	size_t i;
+	double mean = at_samples_mean(samples);
+	double sum = 0.0;
+
+	if (samples->count < 2)
+		return 0.0;
+
+	for (i = 0; i < samples->count; i++)
+		sum += (samples->values[i] - mean) * (samples->values[i] - mean);
+
+	return sqrt(sum / (samples->count - 1));
+}
+
+/* One line summary of nanosecond samples, printed in milliseconds. */
+static void
+at_samples_print_ms(const char *label, struct at_samples *samples)
+{
+	printf("%s: n=%zu mean=%.3f sd=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f ms\n",
+	       label, samples->count,
+	       at_samples_mean(samples) / 1000000.0,
+	       at_samples_stddev(samples) / 1000000.0,
+	       at_samples_percentile(samples, 50) / 1000000.0,
+	       at_samples_percentile(samples, 90) / 1000000.0,
+	       at_samples_percentile(samples, 99) / 1000000.0,
+	       at_samples_percentile(samples, 100) / 1000000.0);
+}
+
+/*
+ * Log-linear histogram of nanosecond values: 8 buckets per power of two, so
+ * any value is kept to within 12.5% in the same few KiB however long the
+ * run goes.
+ */
+static uint32_t
+at_histogram_bucket(uint64_t value)
+{
+	uint32_t exp;
+
+	if (value < (1u << ATOMICTEST_HIST_SUB_BITS))
+		return value;
+
+	exp = 63 - __builtin_clzll(value);
+
+	return (exp - ATOMICTEST_HIST_SUB_BITS + 1) << ATOMICTEST_HIST_SUB_BITS |
+	       ((value >> (exp - ATOMICTEST_HIST_SUB_BITS)) &
+		((1u << ATOMICTEST_HIST_SUB_BITS) - 1));
+}
+
+/* Middle of the bucket's range. */
+static uint64_t
+at_histogram_value(uint32_t bucket)
+{
+	uint32_t exp = bucket >> ATOMICTEST_HIST_SUB_BITS;
+	uint64_t low;
+
+	if (!exp)
+		return bucket;
+
+	low = (uint64_t)((1u << ATOMICTEST_HIST_SUB_BITS) |
+			 (bucket & ((1u << ATOMICTEST_HIST_SUB_BITS) - 1))) << (exp - 1);
+
+	return low + ((1ull << (exp - 1)) >> 1);
+}
+
+static void
+at_histogram_add(struct at_histogram *hist, uint64_t value)
+{
+	hist->buckets[at_histogram_bucket(value)]++;
+	hist->count++;
+	hist->sum += value;
+	hist->max = MAX(hist->max, value);
+}
+
+static void
+at_histogram_merge(struct at_histogram *dst, const struct at_histogram *src)
+{
+	int i;
+
+	for (i = 0; i < ATOMICTEST_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->max = MAX(dst->max, src->max);
+}
+
+static uint64_t
+at_histogram_percentile(const struct at_histogram *hist, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = ceil(p / 100.0 * hist->count);
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < ATOMICTEST_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return MIN(at_histogram_value(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+static struct at_drm_prop *
+at_drm_prop_cache_get(struct at_drm_prop_cache *cache, uint32_t id)
+{
+	struct at_drm_prop **props;
+	uint32_t i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (cache->props[i]->id == id)
+			return cache->props[i];
+	}
+
+	props = realloc(cache->props, (cache->count + 1) * sizeof(*props));
+	if (!props)
+		return NULL;
+	cache->props = props;
+
+	props[cache->count] = calloc(1, sizeof(**props));
+	if (!props[cache->count])
+		return NULL;
+
+	props[cache->count]->id = id;
+
+	return props[cache->count++];
+}
+
+static void
+at_drm_prop_cache_free(struct at_drm_prop_cache *cache)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (cache->props[i]->res)
+			drmModeFreeProperty(cache->props[i]->res);
+		free(cache->props[i]);
+	}
+
+	free(cache->props);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* Full metadata of prop, fetched from the kernel the first time it's needed. */
+static drmModePropertyRes *
+at_drm_prop_res(struct at_drm_prop_cache *cache, struct at_drm_prop *prop)
+{
+	if (prop->res)
+		return prop->res;
+
+	prop->res = drmModeGetProperty(cache->fd, prop->id);
+	cache->fetches++;
+
+	if (prop->res && !prop->name[0])
+		snprintf(prop->name, sizeof(prop->name), "%s", prop->res->name);
+
+	return prop->res;
+}
+
+/*
+ * Only the IDs and current values are read here. Names and metadata come
+ * from the device's property cache, which every object with the same
+ * property shares and which fetches each of them once, when first used.
+ */
+static int
+at_drm_properties_init(struct at_device *device, struct at_drm_properties *properties,
+		       uint32_t object_id, uint32_t object_type)
+{
+	int i;
+	drmModeObjectProperties *props;
+
+	props = drmModeObjectGetProperties(device->fd, object_id, object_type);
+	if (!props)
+		return false;
+
+	properties->prop = calloc(props->count_props, sizeof(*properties->prop));
+	if (!properties->prop)
+		goto err_free_obj_props;
+
+	for (i = 0; i < props->count_props; i++) {
+		properties->prop[i] = at_drm_prop_cache_get(&device->prop_cache,
+							    props->props[i]);
+		if (!properties->prop[i])
+			goto err_free_props;
+	}
+
+	properties->props = props;
+	properties->cache = &device->prop_cache;
+
+	return true;
+
+err_free_props:
+	free(properties->prop);
+
+err_free_obj_props:
+	drmModeFreeObjectProperties(props);
+
+	return false;
+}
+
+
+static int
+at_drm_properties_free(struct at_drm_properties *properties)
+{
+	drmModeFreeObjectProperties(properties->props);
+
+	free(properties->prop);
+}
+
+/* Index of the property called name on the object, or -1. */
+static int
+at_drm_properties_find(struct at_drm_properties *properties, const char *name)
+{
+	int i;
+
+	for (i = 0; i < properties->props->count_props; i++) {
+		struct at_drm_prop *prop = properties->prop[i];
+
+		if (!prop->name[0])
+			at_drm_prop_res(properties->cache, prop);
+
+		if (!strcmp(name, prop->name))
+			return i;
+	}
+
+	return -1;
+}
+
+static int
+at_drm_properties_add_property(drmModeAtomicReq *req, uint32_t object_id,
+			       struct at_drm_properties *properties,
+			       const char *name, uint64_t value)
+{
+	int i = at_drm_properties_find(properties, name);
+
+	if (i < 0)
+		return -EINVAL;
+
+	return drmModeAtomicAddProperty(req, object_id, properties->prop[i]->id,
+					value);
+}
+
+static int
+at_drm_properties_get_property(struct at_drm_properties *properties,
+			       const char *name, uint64_t *value)
+{
+	int i = at_drm_properties_find(properties, name);
+
+	if (i < 0)
+		return -EINVAL;
+
+	if (value)
+		*value = properties->props->prop_values[i];
+
+	return 0;
+}
+
+/* Whether name exists on the object and can be set from an atomic commit. */
+static bool
+at_drm_properties_writable(struct at_drm_properties *properties,
+			   const char *name)
+{
+	int i = at_drm_properties_find(properties, name);
+	drmModePropertyRes *res;
+
+	if (i < 0)
+		return false;
+
+	res = at_drm_prop_res(properties->cache, properties->prop[i]);
+
+	return res && !(res->flags & DRM_MODE_PROP_IMMUTABLE);
+}
+
+static drmModePropertyRes *
+at_drm_properties_lookup(struct at_drm_properties *properties,
+			 const char *name, uint64_t *value)
+{
+	int i = at_drm_properties_find(properties, name);
+
+	if (i < 0)
+		return NULL;
+
+	if (value)
+		*value = properties->props->prop_values[i];
+
+	return at_drm_prop_res(properties->cache, properties->prop[i]);
+}
+
+/* Reads the ranges and enums of zpos, alpha, pixel blend mode and rotation. */
+static void
+at_drm_plane_probe(struct at_drm_plane *plane)
+{
+	drmModePropertyRes *prop;
+	uint64_t value;
+	int i, j;
+
+	prop = at_drm_properties_lookup(&plane->properties, "zpos", &value);
+	if (prop && prop->count_values == 2) {
+		plane->has_zpos = true;
+		plane->zpos_mutable = !(prop->flags & DRM_MODE_PROP_IMMUTABLE);
+		plane->zpos = (int64_t)value;
+		plane->zpos_min = (int64_t)prop->values[0];
+		plane->zpos_max = (int64_t)prop->values[1];
+	}
+
+	prop = at_drm_properties_lookup(&plane->properties, "alpha", &value);
+	if (prop && prop->count_values == 2) {
+		plane->has_alpha = true;
+		plane->alpha_max = prop->values[1];
+		plane->alpha = value;
+	}
+
+	for (i = 0; i < AT_BLEND_COUNT; i++)
+		plane->blend_modes[i] = -1;
+	plane->blend = -1;
+
+	prop = at_drm_properties_lookup(&plane->properties, "pixel blend mode",
+					&value);
+	for (i = 0; prop && i < prop->count_enums; i++) {
+		for (j = 0; j < AT_BLEND_COUNT; j++) {
+			if (strcmp(prop->enums[i].name, at_blend_names[j]))
+				continue;
+			plane->blend_modes[j] = prop->enums[i].value;
+			if (prop->enums[i].value == value)
+				plane->blend = j;
+		}
+	}
+
+	/* a bitmask property, each enum value is a bit number */
+	prop = at_drm_properties_lookup(&plane->properties, "rotation", &value);
+	for (i = 0; prop && i < prop->count_enums; i++)
+		plane->rotations |= 1u << prop->enums[i].value;
+	if (prop)
+		plane->rotation = value & plane->rotations;
+}
+
+static void
+at_drm_plane_print_caps(const char *type, struct at_drm_plane *plane)
+{
+	static const char *const rotation_names[] = {
+		"0", "90", "180", "270", "reflect-x", "reflect-y",
+	};
+	const char *sep = ", blend ";
+	int i;
+
+	printf("  %s plane %d:", type, plane->plane_id);
+
+	if (plane->has_zpos)
+		printf(" zpos %" PRId64 " [%" PRId64 "..%" PRId64 "]%s",
+		       plane->zpos, plane->zpos_min, plane->zpos_max,
+		       plane->zpos_mutable ? "" : " immutable");
+	if (plane->has_alpha)
+		printf(", alpha 0..%" PRIu64, plane->alpha_max);
+
+	for (i = 0; i < AT_BLEND_COUNT; i++) {
+		if (plane->blend_modes[i] >= 0) {
+			printf("%s%s", sep, at_blend_names[i]);
+			sep = "/";
+		}
+	}
+
+	if (plane->rotations & ~DRM_MODE_ROTATE_0) {
+		printf(", rotation");
+		for (i = 0; i < 6; i++) {
+			if (plane->rotations & (1u << i))
+				printf(" %s", rotation_names[i]);
+		}
+	}
+
+	printf("\n");
+}
+
+/*
+ * Adds the overrides in state to req, which may be NULL to only check
+ * them. Returns -1 without touching req when the plane lacks one of the
+ * properties or the value is out of range, so callers can tell
+ * "unsupported" apart from a configuration the driver rejects.
+ */
+static int
+at_drm_plane_set_state(drmModeAtomicReq *req, struct at_drm_plane *plane,
+		       const struct at_plane_state *state)
+{
+	struct at_drm_properties *props = &plane->properties;
+
+	if ((state->set_zpos && (!plane->has_zpos || !plane->zpos_mutable ||
+				 state->zpos < plane->zpos_min ||
+				 state->zpos > plane->zpos_max)) ||
+	    (state->alpha >= 0 && !plane->has_alpha) ||
+	    (state->blend >= 0 && plane->blend_modes[state->blend] < 0) ||
+	    (state->rotation & ~plane->rotations))
+		return -1;
+
+	if (!req)
+		return 0;
+
+	if (state->set_zpos)
+		at_drm_properties_add_property(req, plane->plane_id, props,
+					       "zpos", state->zpos);
+	if (state->alpha >= 0)
+		at_drm_properties_add_property(req, plane->plane_id, props, "alpha",
+					       plane->alpha_max * state->alpha / 100);
+	if (state->blend >= 0)
+		at_drm_properties_add_property(req, plane->plane_id, props,
+					       "pixel blend mode",
+					       plane->blend_modes[state->blend]);
+	if (state->rotation)
+		at_drm_properties_add_property(req, plane->plane_id, props,
+					       "rotation", state->rotation);
+
+	return 0;
+}
+
+static void
+at_plane_state_reset(struct at_plane_state *state)
+{
+	memset(state, 0, sizeof(*state));
+	state->alpha = -1;
+	state->blend = -1;
+}
+
+/* Sets every optional property the plane has back to its probed value. */
+static void
+at_plane_state_defaults(struct at_plane_state *state, struct at_drm_plane *plane)
+{
+	at_plane_state_reset(state);
+
+	if (plane->has_zpos && plane->zpos_mutable) {
+		state->set_zpos = true;
+		state->zpos = plane->zpos;
+	}
+	if (plane->has_alpha && plane->alpha_max)
+		state->alpha = plane->alpha * 100 / plane->alpha_max;
+	state->blend = plane->blend;
+	state->rotation = plane->rotation;
+}
+
+static int
+at_drm_plane_set_properties(drmModeAtomicReq *req, struct at_drm_plane *plane,
+			    uint32_t crtc_id, uint32_t fb_id,
+			    int32_t crtc_x, int32_t crtc_y,
+			    uint32_t crtc_w, uint32_t crtc_h,
+			    uint32_t src_x, uint32_t src_y,
+			    uint32_t src_w, uint32_t src_h)
+{
+	uint32_t plane_id = plane->plane_id;
+	struct at_drm_properties *props = &plane->properties;
+
+	at_drm_properties_add_property(req, plane_id, props, "SRC_X", src_x);
+	at_drm_properties_add_property(req, plane_id, props, "SRC_Y", src_y);
+	at_drm_properties_add_property(req, plane_id, props, "SRC_W", src_w);
+	at_drm_properties_add_property(req, plane_id, props, "SRC_H", src_h);
+	at_drm_properties_add_property(req, plane_id, props, "CRTC_X", crtc_x);
+	at_drm_properties_add_property(req, plane_id, props, "CRTC_Y", crtc_y);
+	at_drm_properties_add_property(req, plane_id, props, "CRTC_W", crtc_w);
+	at_drm_properties_add_property(req, plane_id, props, "CRTC_H", crtc_h);
+	at_drm_properties_add_property(req, plane_id, props, "FB_ID", fb_id);
+	at_drm_properties_add_property(req, plane_id, props, "CRTC_ID", crtc_id);
+}
+
+static bool
+setup_connector(struct at_device *device, drmModeConnector *connector)
+{
+	device->connector = calloc(1, sizeof(*device->connector));
+	if (!device->connector)
+		return false;
+
+	if (!at_drm_properties_init(device, &device->connector->properties,
+				    connector->connector_id,
+				    DRM_MODE_OBJECT_CONNECTOR)) {
+		free(device->connector);
+		device->connector = NULL;
+		return false;
+	}
+
+	device->connector->connector_id = connector->connector_id;
+
+	return true;
+}
+
+static bool
+setup_crtc(struct at_device *device, drmModeCrtc *crtc, uint32_t crtc_idx)
+{
+	device->crtc = calloc(1, sizeof(*device->crtc));
+	if (!device->crtc)
+		return false;
+
+	if (!at_drm_properties_init(device, &device->crtc->properties,
+				    crtc->crtc_id, DRM_MODE_OBJECT_CRTC)) {
+		free(device->crtc);
+		device->crtc = NULL;
+		return false;
+	}
+
+	device->crtc->crtc_id = crtc->crtc_id;
+	device->crtc->crtc_idx = crtc_idx;
+
+	return true;
+}
+
+static bool
+add_plane(struct at_device *device, uint32_t plane_id)
+{
+	uint64_t plane_type;
+	uint32_t cnt = device->plane_count;
+
+	device->planes = realloc(device->planes, sizeof(*device->planes) * (cnt + 1));
+	if (!device->planes)
+		return false;
+
+	device->planes[cnt] = calloc(1, sizeof(*device->planes[cnt]));
+	if (!device->planes[cnt])
+		return false;
+
+	if (!at_drm_properties_init(device, &device->planes[cnt]->properties,
+				    plane_id, DRM_MODE_OBJECT_PLANE)) {
+		free(device->planes[cnt]);
+		return false;
+	}
+
+	at_drm_properties_get_property(&device->planes[cnt]->properties,
+				       "type", &plane_type);
+
+	if (plane_type == DRM_PLANE_TYPE_PRIMARY) {
+		if (!device->primary_plane)
+			device->primary_plane = device->planes[cnt];
+	} else if (plane_type == DRM_PLANE_TYPE_CURSOR) {
+		if (!device->cursor_plane)
+			device->cursor_plane = device->planes[cnt];
+	} else if (plane_type == DRM_PLANE_TYPE_OVERLAY) {
+		device->overlay_planes = realloc(device->overlay_planes,
+						 sizeof(*device->overlay_planes) *
+						(device->overlays_count + 1));
+		if (!device->overlay_planes)
+			return false;
+
+		device->overlay_planes[device->overlays_count] = device->planes[cnt];
+		device->overlays_count++;
+	}
+
+	device->planes[cnt]->plane_id = plane_id;
+	at_drm_plane_probe(device->planes[cnt]);
+	device->plane_count++;
+
+	return true;
+}
+
+static void
+at_device_print_planes(struct at_device *device);
+
+static void
+setup_planes(struct at_device *device, drmModePlaneRes *plane_res)
+{
+	int i;
+
+	device->planes = NULL;
+	device->plane_count = 0;
+	device->primary_plane = NULL;
+	device->cursor_plane = NULL;
+	device->overlay_planes = NULL;
+	device->overlays_count = 0;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		drmModePlane *plane = drmModeGetPlane(device->fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (plane->possible_crtcs & (1 << device->crtc->crtc_idx))
+			add_plane(device, plane->plane_id);
+
+		drmModeFreePlane(plane);
+	}
+
+	at_device_print_planes(device);
+}
+
+static void
+at_device_print_planes(struct at_device *device)
+{
+	int i;
+
+	printf("Number of total planes for the CRTC: %d\n", device->plane_count);
+	printf("Number of overlay planes for the CRTC: %d\n", device->overlays_count);
+
+	if (!verbose)
+		return;
+
+	if (device->primary_plane)
+		at_drm_plane_print_caps("primary", device->primary_plane);
+	for (i = 0; i < device->overlays_count; i++)
+		at_drm_plane_print_caps("overlay", device->overlay_planes[i]);
+	if (device->cursor_plane)
+		at_drm_plane_print_caps("cursor", device->cursor_plane);
+}
+
+static int
+probe_connector(struct at_device *device, drmModeRes *resources,
+	     drmModeConnector *connector)
+{
+	int i;
+	drmModeEncoder *encoder;
+	drmModeCrtc *crtc = NULL;
+
+	if (connector->encoder_id) {
+		at_debug("  there's a connected encoder (id %d)\n",
+			connector->encoder_id);
+		encoder = drmModeGetEncoder(device->fd, connector->encoder_id);
+	} else {
+		encoder = NULL;
+	}
+
+	if (encoder) {
+		if (encoder->crtc_id) {
+			at_debug("  the encoder is connected to the CRTC %d\n",
+				encoder->crtc_id);
+
+			crtc = drmModeGetCrtc(device->fd, encoder->crtc_id);
+		}
+	}
+
+	if (!crtc) {
+		for (i = 0; i < connector->count_encoders; i++) {
+			int j;
+
+			encoder = drmModeGetEncoder(device->fd, connector->encoders[i]);
+			if (!encoder)
+				continue;
+
+			for (j = 0; j < resources->count_crtcs; j++) {
+				if (!(encoder->possible_crtcs & (1 << j)))
+					continue;
+
+				at_debug("  crtc %d is available to this encoder\n", j);
+
+				crtc = drmModeGetCrtc(device->fd, resources->crtcs[j]);
+				if (crtc)
+					break;
+			}
+		}
+
+		if (!crtc)
+			return -1;
+	}
+
+	for (i = 0; i < resources->count_crtcs; i++) {
+		if (resources->crtcs[i] == crtc->crtc_id)
+			break;
+	}
+
+	setup_crtc(device, crtc, i);
+
+	drmModeFreeEncoder(encoder);
+
+	return 0;
+}
+
+static void
+at_device_copy_modes(struct at_device *device, drmModeConnector *connector)
+{
+	drmModeModeInfo *modes;
+
+	modes = malloc(connector->count_modes * sizeof(*modes));
+	if (!modes)
+		return;
+
+	memcpy(modes, connector->modes, connector->count_modes * sizeof(*modes));
+
+	free(device->modes);
+	device->modes = modes;
+	device->mode_count = connector->count_modes;
+}
+
+/*
+ * Identifies what a topology cache was written for: the driver, its
+ * version and the object counts. Anything different means a cold probe.
+ */
+static int
+at_topology_key(int fd, drmModeRes *resources, char *key, size_t size)
+{
+	drmVersion *version = drmGetVersion(fd);
+
+	if (!version)
+		return -1;
+
+	snprintf(key, size, "%s %d.%d.%d %s %d/%d/%d/%d", version->name,
+		 version->version_major, version->version_minor,
+		 version->version_patchlevel, version->date,
+		 resources->count_crtcs, resources->count_connectors,
+		 resources->count_encoders, resources->count_fbs);
+
+	drmFreeVersion(version);
+
+	return 0;
+}
+
+static void
+at_device_finish(struct at_device *device, drmModeConnector *connector)
+{
+	memcpy(&device->mode, &connector->modes[0], sizeof(device->mode));
+	device->width = connector->modes[0].hdisplay;
+	device->height = connector->modes[0].vdisplay;
+
+	at_device_copy_modes(device, connector);
+
+	if (!drmModeCreatePropertyBlob(device->fd, &device->mode,
+				       sizeof(device->mode), &device->blob_id))
+		device->live_blobs++;
+
+	device->saved_crtc = NULL;
+}
+
+/*
+ * Writes what the cold probe found: the connector, CRTC and planes we use
+ * and the name of every property those objects have.
+ */
+static void
+at_topology_save(struct at_device *device, drmModeRes *resources,
+		 const char *path)
+{
+	struct at_drm_prop_cache *cache = &device->prop_cache;
+	char key[256];
+	FILE *file;
+	uint32_t i;
+
+	if (at_topology_key(device->fd, resources, key, sizeof(key)) < 0)
+		return;
+
+	file = fopen(path, "w");
+	if (!file) {
+		perror("Could not write the topology cache");
+		return;
+	}
+
+	fprintf(file, "atomictest-topology 1\n");
+	fprintf(file, "key %s\n", key);
+	fprintf(file, "connector %u\n", device->connector->connector_id);
+	fprintf(file, "crtc %u %u\n", device->crtc->crtc_id, device->crtc->crtc_idx);
+
+	for (i = 0; i < device->plane_count; i++)
+		fprintf(file, "plane %u\n", device->planes[i]->plane_id);
+
+	for (i = 0; i < cache->count; i++) {
+		if (!cache->props[i]->name[0])
+			at_drm_prop_res(cache, cache->props[i]);
+		if (cache->props[i]->name[0])
+			fprintf(file, "prop %u %s\n", cache->props[i]->id,
+				cache->props[i]->name);
+	}
+
+	fclose(file);
+}
+
+/* Drops the connector, CRTC and planes set up by a probe or the cache. */
+static void
+at_device_free_topology(struct at_device *device)
+{
+	int i;
+
+	for (i = 0; i < device->plane_count; i++) {
+		at_drm_properties_free(&device->planes[i]->properties);
+		free(device->planes[i]);
+	}
+	free(device->planes);
+	free(device->overlay_planes);
+	device->planes = NULL;
+	device->plane_count = 0;
+	device->overlay_planes = NULL;
+	device->overlays_count = 0;
+	device->primary_plane = NULL;
+	device->cursor_plane = NULL;
+
+	if (device->crtc) {
+		at_drm_properties_free(&device->crtc->properties);
+		free(device->crtc);
+		device->crtc = NULL;
+	}
+
+	if (device->connector) {
+		at_drm_properties_free(&device->connector->properties);
+		free(device->connector);
+		device->connector = NULL;
+	}
+}
+
+/*
+ * Whether a cached plane still exists and can still be used on the CRTC;
+ * a cache from another boot or edited by hand may name anything.
+ */
+static bool
+at_topology_plane_valid(struct at_device *device, uint32_t plane_id,
+			uint32_t crtc_idx)
+{
+	drmModePlane *plane = drmModeGetPlane(device->fd, plane_id);
+	bool valid;
+
+	if (!plane)
+		return false;
+
+	valid = plane->possible_crtcs & (1 << crtc_idx);
+	drmModeFreePlane(plane);
+
+	return valid;
+}
+
+/*
+ * Warm start: takes the connector, CRTC and planes from the cache without
+ * walking encoders and planes or forcing a connector probe, and seeds the
+ * property cache with names. Returns -1, with nothing set up, whenever
+ * the cache doesn't apply and the caller has to probe.
+ */
+static int
+at_topology_load(struct at_device *device, drmModeRes *resources,
+		 const char *path)
+{
+	char key[256], line[256], cached_key[256] = "";
+	uint32_t connector_id = 0, crtc_id = 0, crtc_idx = 0;
+	uint32_t *plane_ids = NULL, plane_count = 0;
+	drmModeConnector *connector = NULL;
+	drmModeCrtc crtc;
+	FILE *file;
+	uint32_t i;
+	int ret = -1;
+
+	if (at_topology_key(device->fd, resources, key, sizeof(key)) < 0)
+		return -1;
+
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	if (!fgets(line, sizeof(line), file) ||
+	    strcmp(line, "atomictest-topology 1\n"))
+		goto out;
+
+	while (fgets(line, sizeof(line), file)) {
+		uint32_t id, *ids;
+		char name[DRM_PROP_NAME_LEN + 1];
+
+		line[strcspn(line, "\n")] = '\0';
+
+		if (!strncmp(line, "key ", 4)) {
+			snprintf(cached_key, sizeof(cached_key), "%s", line + 4);
+			if (strcmp(cached_key, key))
+				goto out;
+		} else if (sscanf(line, "connector %u", &id) == 1) {
+			connector_id = id;
+		} else if (sscanf(line, "crtc %u %u", &crtc_id, &crtc_idx) == 2) {
+			continue;
+		} else if (sscanf(line, "plane %u", &id) == 1) {
+			ids = realloc(plane_ids, (plane_count + 1) * sizeof(*ids));
+			if (!ids)
+				goto out;
+			plane_ids = ids;
+			plane_ids[plane_count++] = id;
+		} else if (sscanf(line, "prop %u %32[^\n]", &id, name) == 2) {
+			struct at_drm_prop *prop =
+				at_drm_prop_cache_get(&device->prop_cache, id);
+
+			if (prop && !prop->name[0])
+				snprintf(prop->name, sizeof(prop->name), "%s", name);
+		}
+	}
+
+	if (!cached_key[0] || !connector_id || !crtc_id || !plane_count)
+		goto out;
+
+	if (crtc_idx >= resources->count_crtcs ||
+	    resources->crtcs[crtc_idx] != crtc_id)
+		goto out;
+
+	for (i = 0; i < plane_count; i++) {
+		if (!at_topology_plane_valid(device, plane_ids[i], crtc_idx))
+			goto out;
+	}
+
+	/* the current state only, a forced probe is what we're avoiding */
+	connector = drmModeGetConnectorCurrent(device->fd, connector_id);
+	if (!connector || connector->connection != DRM_MODE_CONNECTED ||
+	    !connector->count_modes)
+		goto out;
+
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = crtc_id;
+	if (!setup_crtc(device, &crtc, crtc_idx) ||
+	    !setup_connector(device, connector))
+		goto err_free_topology;
+
+	for (i = 0; i < plane_count; i++) {
+		if (!add_plane(device, plane_ids[i]))
+			goto err_free_topology;
+	}
+
+	if (!device->primary_plane)
+		goto err_free_topology;
+
+	at_device_print_planes(device);
+	at_device_finish(device, connector);
+
+	ret = 0;
+	goto out;
+
+err_free_topology:
+	at_device_free_topology(device);
+
+out:
+	if (connector)
+		drmModeFreeConnector(connector);
+	free(plane_ids);
+	fclose(file);
+
+	return ret;
+}
+
+static int
+at_device_open(struct at_device *device, const char *node, const char *topology)
+{
+	int i;
+	int fd;
+	int ret;
+	uint64_t cap_dumb;
+	drmModeRes *resources;
+	drmModePlaneRes *plane_res;
+
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Could not open input file");
+		return -1;
+	}
+
+	ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &cap_dumb);
+	if (ret < 0 || !cap_dumb) {
+		fprintf(stderr, "Error: device doesn't support dumb buffers.\n");
+		close(fd);
+		return -1;
+	}
+
+	resources = drmModeGetResources(fd);
+	if (!resources) {
+		fprintf(stderr, "Error: can't get mode resources.\n");
+		close(fd);
+		return -1;
+	}
+
+	device->fd = fd;
+	device->prop_cache.fd = fd;
+
+	ret = drmSetClientCap(device->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+	if (ret < 0) {
+		fprintf(stderr, "Error: the device doesn't support atomic.\n");
+		drmModeFreeResources(resources);
+		close(fd);
+		return -1;
+	}
+
+	/* the warm start returns right away, so before either probe */
+	pthread_mutex_init(&device->mem.lock, NULL);
+
+	if (topology && at_topology_load(device, resources, topology) == 0) {
+		printf("Topology from %s, %u properties fetched\n", topology,
+		       device->prop_cache.fetches);
+		drmModeFreeResources(resources);
+		return 0;
+	}
+
+	at_debug("Device fbs: %d\n", resources->count_fbs);
+	at_debug("Device crtcs: %d\n", resources->count_crtcs);
+	at_debug("Device encoders: %d\n", resources->count_encoders);
+	at_debug("Device connectors: %d\n", resources->count_connectors);
+
+	plane_res = drmModeGetPlaneResources(device->fd);
+
+	/*
+	 * Get the first connected connector.
+	 */
+	for (i = resources->count_connectors - 1; i >= 0; i--) {
+		drmModeConnector *connector;
+
+		at_debug("\nTrying connector %d...\n", i);
+
+		connector = drmModeGetConnector(fd, resources->connectors[i]);
+		if (!connector) {
+			at_debug("  can't get connector info %d\n",
+				 resources->connectors[i]);
+			continue;
+		}
+
+		at_debug("  connector type: %d\n", connector->connector_type);
+
+		if (connector->connection != DRM_MODE_CONNECTED) {
+			at_debug("  not connected, skipping...\n");
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		if (connector->count_modes == 0) {
+			at_debug("  this connector doesn't have any valid modes\n");
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		at_debug("  %d modes, using the first one\n", connector->count_modes);
+
+		drmModeModeInfo *mode_info = &connector->modes[0];
+		at_debug("    Mode %d\n", 0);
+		at_debug("      clock: %d\n", mode_info->clock);
+		at_debug("      hdisplay: %d\n", mode_info->hdisplay);
+		at_debug("      vdisplay: %d\n", mode_info->vdisplay);
+		at_debug("      vrefresh: %d\n", mode_info->vrefresh);
+		at_debug("      flags: 0x%08X\n", mode_info->flags);
+		at_debug("      type: 0x%08X\n", mode_info->type);
+		at_debug("      name: %s\n", mode_info->name);
+
+		if (probe_connector(device, resources, connector) < 0) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		setup_connector(device, connector);
+
+		setup_planes(device, plane_res);
+
+		at_device_finish(device, connector);
+
+		if (topology)
+			at_topology_save(device, resources, topology);
+
+		at_debug("Probe fetched %u properties\n", device->prop_cache.fetches);
+
+		drmModeFreePlaneResources(plane_res);
+		drmModeFreeConnector(connector);
+		drmModeFreeResources(resources);
+
+		return 0;
+	}
+
+	drmModeFreePlaneResources(plane_res);
+	drmModeFreeResources(resources);
+	pthread_mutex_destroy(&device->mem.lock);
+	close(fd);
+
+	return -1;
+}
+
+static int
+at_device_close(struct at_device *device)
+{
+	if (device->blob_id) {
+		drmModeDestroyPropertyBlob(device->fd, device->blob_id);
+		device->live_blobs--;
+	}
+
+	free(device->modes);
+
+	at_device_free_topology(device);
+
+	at_drm_prop_cache_free(&device->prop_cache);
+
+	pthread_mutex_destroy(&device->mem.lock);
+
+	close(device->fd);
+
+	return 0;
+}
+
+static uint32_t
+at_format_bpp(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+		return 16;
+	case DRM_FORMAT_NV12:
+		return 8;
+	default:
+		return 32;
+	}
+}
+
+/* Rows to allocate so that every plane of the format fits in one dumb bo. */
+static uint32_t
+at_format_alloc_height(uint32_t format, uint32_t height)
+{
+	if (format == DRM_FORMAT_NV12)
+		return height + (height + 1) / 2;
+
+	return height;
+}
+
+/*
+ * Makes mode the one the next modeset commit programs. The old blob is only
+ * destroyed once the new one exists.
+ */
+static int
+at_device_set_mode(struct at_device *device, const drmModeModeInfo *mode)
+{
+	uint32_t blob_id;
+
+	if (drmModeCreatePropertyBlob(device->fd, mode, sizeof(*mode), &blob_id))
+		return -1;
+
+	drmModeDestroyPropertyBlob(device->fd, device->blob_id);
+
+	memcpy(&device->mode, mode, sizeof(device->mode));
+	device->width = mode->hdisplay;
+	device->height = mode->vdisplay;
+	device->blob_id = blob_id;
+
+	return 0;
+}
+
+/*
+ * Re-reads the connector after a hotplug. On return *connected tells whether
+ * it can be lit up, and if so mode holds the current mode when it's still
+ * offered, else the preferred (or first) one.
+ */
+static int
+at_device_probe_connector(struct at_device *device, bool *connected,
+			  drmModeModeInfo *mode)
+{
+	int i;
+	drmModeConnector *connector;
+	drmModeModeInfo *pick = NULL;
+
+	connector = drmModeGetConnector(device->fd,
+					device->connector->connector_id);
+	if (!connector)
+		return -1;
+
+	*connected = connector->connection == DRM_MODE_CONNECTED &&
+		     connector->count_modes > 0;
+
+	for (i = 0; *connected && i < connector->count_modes; i++) {
+		if (!memcmp(&connector->modes[i], &device->mode, sizeof(*mode))) {
+			pick = &connector->modes[i];
+			break;
+		}
+
+		if (!pick && (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED))
+			pick = &connector->modes[i];
+	}
+
+	if (*connected) {
+		memcpy(mode, pick ? pick : &connector->modes[0], sizeof(*mode));
+		at_device_copy_modes(device, connector);
+	}
+
+	drmModeFreeConnector(connector);
+
+	return 0;
+}
+
+/* Bytes a dumb buffer is expected to take, assuming 64 byte pitch alignment. */
+static uint64_t
+at_mem_estimate(uint32_t width, uint32_t height, uint32_t format)
+{
+	return (uint64_t)ALIGN(width * at_format_bpp(format) / 8, 64) *
+	       at_format_alloc_height(format, height);
+}
+
+/* Whether count such buffers fit in the budget with reserved bytes set aside. */
+static bool
+at_mem_fits(struct at_device *device, uint32_t width, uint32_t height,
+	    uint32_t format, uint32_t count, uint64_t reserved)
+{
+	struct at_mem_stats *mem = &device->mem;
+
+	return !mem->budget ||
+	       mem->current + mem->pending + reserved +
+	       count * at_mem_estimate(width, height, format) <= mem->budget;
+}
+
+static void
+at_mem_track(struct at_device *device, struct at_dumb_buffer *dumb)
+{
+	struct at_mem_stats *mem = &device->mem;
+
+	dumb->next = mem->buffers;
+	mem->buffers = dumb;
+
+	mem->current += dumb->size;
+	mem->peak = MAX(mem->peak, mem->current);
+	mem->padding += dumb->size - (uint64_t)dumb->width *
+			at_format_bpp(dumb->format) / 8 *
+			at_format_alloc_height(dumb->format, dumb->height);
+	mem->purpose_bytes[dumb->purpose] += dumb->size;
+	mem->purpose_count[dumb->purpose]++;
+}
+
+static void
+at_mem_untrack(struct at_device *device, struct at_dumb_buffer *dumb)
+{
+	struct at_mem_stats *mem = &device->mem;
+	struct at_dumb_buffer **link;
+
+	for (link = &mem->buffers; *link; link = &(*link)->next) {
+		if (*link == dumb) {
+			*link = dumb->next;
+			break;
+		}
+	}
+
+	mem->current -= dumb->size;
+	mem->padding -= dumb->size - (uint64_t)dumb->width *
+			at_format_bpp(dumb->format) / 8 *
+			at_format_alloc_height(dumb->format, dumb->height);
+	mem->purpose_bytes[dumb->purpose] -= dumb->size;
+	mem->purpose_count[dumb->purpose]--;
+}
+
+/* Every live scanout buffer, then the totals by purpose. */
+static void
+at_mem_report(struct at_device *device)
+{
+	struct at_mem_stats *mem = &device->mem;
+	struct at_dumb_buffer *dumb;
+	int i;
+
+	printf("\nScanout memory:\n");
+	printf("  %-10s %11s %-6s %7s %10s %9s\n", "purpose", "size", "format",
+	       "pitch", "KiB", "pad KiB");
+
+	for (dumb = mem->buffers; dumb; dumb = dumb->next) {
+		uint64_t used = (uint64_t)dumb->width * at_format_bpp(dumb->format) / 8 *
+				at_format_alloc_height(dumb->format, dumb->height);
+		/* fourcc codes are little endian whatever the host is */
+		char fourcc[5] = {
+			dumb->format & 0xFF, (dumb->format >> 8) & 0xFF,
+			(dumb->format >> 16) & 0xFF, (dumb->format >> 24) & 0xFF,
+		};
+
+		printf("  %-10s %5ux%-5u %-4s   %7u %10.1f %9.1f\n",
+		       at_mem_purpose_names[dumb->purpose], dumb->width,
+		       dumb->height, fourcc, dumb->pitch,
+		       dumb->size / 1024.0, (dumb->size - used) / 1024.0);
+	}
+
+	for (i = 0; i < AT_MEM_PURPOSE_COUNT; i++) {
+		if (mem->purpose_count[i])
+			printf("  %-10s %" PRIu64 " buffers, %.2f MiB\n",
+			       at_mem_purpose_names[i], mem->purpose_count[i],
+			       mem->purpose_bytes[i] / (1024.0 * 1024.0));
+	}
+
+	printf("  total %.2f MiB (%.2f MiB pitch padding), peak %.2f MiB",
+	       mem->current / (1024.0 * 1024.0), mem->padding / (1024.0 * 1024.0),
+	       mem->peak / (1024.0 * 1024.0));
+	if (mem->budget)
+		printf(", budget %.2f MiB", mem->budget / (1024.0 * 1024.0));
+	printf("\n");
+
+	if (mem->rejected || mem->failed)
+		printf("  %" PRIu64 " allocations refused by the budget, %" PRIu64
+		       " failed in the kernel\n", mem->rejected, mem->failed);
+}
+
+/*
+ * Allocates a dumb buffer, unmapped. Allocations that would take the device
+ * over its scanout budget are refused up front with ENOSPC; the estimate
+ * stays reserved while the kernel allocates, so parallel allocations can't
+ * overshoot it together.
+ */
+static struct at_dumb_buffer *
+at_dumb_buffer_alloc(struct at_device *device, uint16_t width,
+		     uint16_t height, uint32_t format,
+		     enum at_mem_purpose purpose)
+{
+	int ret;
+	struct at_dumb_buffer *dumb;
+	struct drm_mode_create_dumb create_dumb;
+	uint64_t estimate = at_mem_estimate(width, height, format);
+
+	pthread_mutex_lock(&device->mem.lock);
+	if (!at_mem_fits(device, width, height, format, 1, 0)) {
+		fprintf(stderr, "Scanout budget: refusing %s buffer %ux%u "
+			"(%.1f KiB, %.2f of %.2f MiB in use)\n",
+			at_mem_purpose_names[purpose], width, height,
+			estimate / 1024.0,
+			device->mem.current / (1024.0 * 1024.0),
+			device->mem.budget / (1024.0 * 1024.0));
+		device->mem.rejected++;
+		pthread_mutex_unlock(&device->mem.lock);
+		errno = ENOSPC;
+		return NULL;
+	}
+	device->mem.pending += estimate;
+	pthread_mutex_unlock(&device->mem.lock);
+
+	dumb = malloc(sizeof(*dumb));
+	if (!dumb)
+		goto err_unreserve;
+
+	dumb->purpose = purpose;
+	dumb->width = width;
+	dumb->height = height;
+	dumb->format = format;
+	dumb->data = NULL;
+
+	memset(&create_dumb, 0, sizeof(create_dumb));
+	create_dumb.width = width;
+	create_dumb.height = at_format_alloc_height(format, height);
+	create_dumb.bpp = at_format_bpp(format);
+
+	ret = drmIoctl(device->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
+	if (ret < 0) {
+		fprintf(stderr, "CREATE_DUMB for a %s buffer %ux%u failed: %s "
+			"(%.2f MiB of scanout memory allocated)\n",
+			at_mem_purpose_names[purpose], width, height,
+			strerror(errno), device->mem.current / (1024.0 * 1024.0));
+		goto err_create;
+	}
+
+	dumb->handle = create_dumb.handle;
+	dumb->pitch = create_dumb.pitch;
+	dumb->size = create_dumb.size;
+
+	pthread_mutex_lock(&device->mem.lock);
+	device->mem.pending -= estimate;
+	at_mem_track(device, dumb);
+	pthread_mutex_unlock(&device->mem.lock);
+
+	return dumb;
+
+err_create:
+	free(dumb);
+	pthread_mutex_lock(&device->mem.lock);
+	device->mem.failed++;
+	pthread_mutex_unlock(&device->mem.lock);
+err_unreserve:
+	pthread_mutex_lock(&device->mem.lock);
+	device->mem.pending -= estimate;
+	pthread_mutex_unlock(&device->mem.lock);
+
+	return NULL;
+}
+
+/*
+ * Maps a dumb buffer and faults every page in here rather than in the
+ * first frame. MAP_POPULATE does that during the mmap() for shmem backed
+ * buffers, but skips the VM_PFNMAP/VM_IO mappings many drivers hand out,
+ * so a write per page follows; it costs nothing where the pages are in
+ * already. There is no memset(): the kernel hands dumb buffers out cleared.
+ */
+static int
+at_dumb_buffer_map(struct at_device *device, struct at_dumb_buffer *dumb)
+{
+	struct drm_mode_map_dumb map_dumb;
+	long page = sysconf(_SC_PAGESIZE);
+	int flags = MAP_SHARED;
+	uint64_t offset;
+	void *data;
+
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+
+	memset(&map_dumb, 0, sizeof(map_dumb));
+	map_dumb.handle = dumb->handle;
+
+	if (drmIoctl(device->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb) < 0)
+		return -errno;
+
+	data = mmap(NULL, dumb->size, PROT_READ | PROT_WRITE, flags,
+		    device->fd, map_dumb.offset);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	/* zero over zero, only the fault matters */
+	for (offset = 0; offset < dumb->size; offset += page)
+		((volatile uint8_t *)data)[offset] = 0;
+
+	dumb->data = data;
+
+	return 0;
+}
+
+static void
+at_dumb_buffer_free(struct at_device *device, struct at_dumb_buffer *dumb)
+{
+	struct drm_mode_destroy_dumb destroy_dumb;
+
+	pthread_mutex_lock(&device->mem.lock);
+	at_mem_untrack(device, dumb);
+	pthread_mutex_unlock(&device->mem.lock);
+
+	if (dumb->data)
+		munmap(dumb->data, dumb->size);
+
+	memset(&destroy_dumb, 0, sizeof(destroy_dumb));
+	destroy_dumb.handle = dumb->handle;
+	drmIoctl(device->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
+
+	free(dumb);
+}
+
+static struct at_dumb_buffer *
+at_dumb_buffer_create(struct at_device *device, uint16_t width,
+		      uint16_t height, uint32_t format,
+		      enum at_mem_purpose purpose)
+{
+	struct at_dumb_buffer *dumb;
+	uint64_t start = at_now_ns(), allocated;
+	int ret;
+
+	dumb = at_dumb_buffer_alloc(device, width, height, format, purpose);
+	if (!dumb)
+		return NULL;
+
+	allocated = at_now_ns();
+	device->mem.alloc_ns += allocated - start;
+
+	ret = at_dumb_buffer_map(device, dumb);
+	device->mem.map_ns += at_now_ns() - allocated;
+	if (ret < 0) {
+		at_dumb_buffer_free(device, dumb);
+		return NULL;
+	}
+
+	return dumb;
+}
+
+static void
+at_dumb_buffer_fill(struct at_dumb_buffer *dumb, uint32_t color)
+{
+	int i, j;
+
+	if (dumb->format == DRM_FORMAT_RGB565) {
+		uint16_t rgb565 = (color >> 8 & 0xF800) | (color >> 5 & 0x07E0) |
+				  (color >> 3 & 0x001F);
+
+		for (i = 0; i < dumb->height; i++) {
+			uint16_t *pixel = (uint16_t *)(dumb->data + i * dumb->pitch);
+			for (j = 0; j < dumb->width; j++)
+				pixel[j] = rgb565;
+		}
+		return;
+	}
+
+	for (i = 0; i < dumb->height; i++) {
+		uint32_t *pixel = (uint32_t *)(dumb->data + i * dumb->pitch);
+		for (j = 0; j < dumb->width; j++)
+			pixel[j] = color;
+	}
+}
+
+static void
+at_dumb_buffer_surface(struct at_dumb_buffer *dumb, struct at_surface *surface)
+{
+	surface->data = dumb->data;
+	surface->width = dumb->width;
+	surface->height = dumb->height;
+	surface->pitch = dumb->pitch;
+}
+
+static inline bool
+at_rect_empty(const struct at_rect *rect)
+{
+	return rect->x2 <= rect->x1 || rect->y2 <= rect->y1;
+}
+
+static inline void
+at_rect_set(struct at_rect *rect, int32_t x, int32_t y, uint32_t w, uint32_t h)
+{
+	rect->x1 = x;
+	rect->y1 = y;
+	rect->x2 = x + w;
+	rect->y2 = y + h;
+}
+
+static void
+at_rect_union(struct at_rect *dst, const struct at_rect *src)
+{
+	if (at_rect_empty(src))
+		return;
+
+	if (at_rect_empty(dst)) {
+		*dst = *src;
+		return;
+	}
+
+	dst->x1 = MIN(dst->x1, src->x1);
+	dst->y1 = MIN(dst->y1, src->y1);
+	dst->x2 = MAX(dst->x2, src->x2);
+	dst->y2 = MAX(dst->y2, src->y2);
+}
+
+static bool
+at_rect_intersect(struct at_rect *dst, const struct at_rect *a,
+		  const struct at_rect *b)
+{
+	dst->x1 = MAX(a->x1, b->x1);
+	dst->y1 = MAX(a->y1, b->y1);
+	dst->x2 = MIN(a->x2, b->x2);
+	dst->y2 = MIN(a->y2, b->y2);
+
+	return !at_rect_empty(dst);
+}
+
+static uint64_t
+at_rect_area(const struct at_rect *rect)
+{
+	if (at_rect_empty(rect))
+		return 0;
+
+	return (uint64_t)(rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+}
+
+static void
+at_surface_fill_rect(struct at_surface *surface, const struct at_rect *rect,
+		     uint32_t color)
+{
+	int32_t x, y;
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		uint32_t *pixel = (uint32_t *)(surface->data + y * surface->pitch);
+		for (x = rect->x1; x < rect->x2; x++)
+			pixel[x] = color;
+	}
+}
+
+/*
+ * Blends a constant ARGB color over the destination. This has to read back
+ * every pixel it touches, which is what makes it so slow on uncached memory.
+ */
+static void
+at_surface_blend_rect(struct at_surface *surface, const struct at_rect *rect,
+		      uint32_t argb)
+{
+	int32_t x, y;
+	uint32_t a = argb >> 24;
+	uint32_t ia = 256 - a;
+	uint32_t src_rb = (argb & 0x00FF00FF) * a;
+	uint32_t src_g = (argb & 0x0000FF00) * a;
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		uint32_t *pixel = (uint32_t *)(surface->data + y * surface->pitch);
+		for (x = rect->x1; x < rect->x2; x++) {
+			uint32_t dst = pixel[x];
+			uint32_t rb = ((dst & 0x00FF00FF) * ia + src_rb) >> 8;
+			uint32_t g = ((dst & 0x0000FF00) * ia + src_g) >> 8;
+
+			pixel[x] = 0xFF000000 | (rb & 0x00FF00FF) | (g & 0x0000FF00);
+		}
+	}
+}
+
+/*
+ * Copies into write-combined memory with full-width non-temporal stores so
+ * every cacheline leaves the WC buffers in one burst. Callers must issue
+ * at_copy_stream_fence() once they're done with a batch of copies.
+ */
+static void
+at_copy_stream(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef __SSE2__
+	while (len && ((uintptr_t)dst & 15)) {
+		*dst++ = *src++;
+		len--;
+	}
+
+	for (; len >= 64; len -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src + 0);
+		__m128i b = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i c = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i d = _mm_loadu_si128((const __m128i *)src + 3);
+
+		_mm_stream_si128((__m128i *)dst + 0, a);
+		_mm_stream_si128((__m128i *)dst + 1, b);
+		_mm_stream_si128((__m128i *)dst + 2, c);
+		_mm_stream_si128((__m128i *)dst + 3, d);
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+static inline void
+at_copy_stream_fence(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+static void
+at_surface_copy_rect(struct at_surface *dst, const struct at_surface *src,
+		     const struct at_rect *rect)
+{
+	int32_t y;
+	size_t len = (rect->x2 - rect->x1) * 4;
+
+	if (at_rect_empty(rect))
+		return;
+
+	for (y = rect->y1; y < rect->y2; y++)
+		at_copy_stream(dst->data + y * dst->pitch + rect->x1 * 4,
+			       src->data + y * src->pitch + rect->x1 * 4, len);
+
+	at_copy_stream_fence();
+}
+
+/* Copies or blends (premultiplied ARGB) src with its top-left at x, y. */
+static void
+at_surface_compose(struct at_surface *dst, struct at_dumb_buffer *src,
+		   int32_t x, int32_t y, bool blend)
+{
+	struct at_rect rect, bounds;
+	uint32_t row, col;
+
+	at_rect_set(&bounds, 0, 0, dst->width, dst->height);
+	at_rect_set(&rect, x, y, src->width, src->height);
+	if (!at_rect_intersect(&rect, &rect, &bounds))
+		return;
+
+	for (row = rect.y1; row < rect.y2; row++) {
+		uint32_t *out = (uint32_t *)(dst->data + row * dst->pitch);
+		const uint32_t *in = (const uint32_t *)(src->data +
+							(row - y) * src->pitch) - x;
+
+		if (!blend) {
+			memcpy(out + rect.x1, in + rect.x1, (rect.x2 - rect.x1) * 4);
+			continue;
+		}
+
+		for (col = rect.x1; col < rect.x2; col++) {
+			uint32_t a = in[col] >> 24;
+			uint32_t inv = 0xFF - a;
+			uint32_t d = out[col];
+			uint32_t rb = ((d & 0x00FF00FF) * inv / 0xFF) & 0x00FF00FF;
+			uint32_t g = ((d & 0x0000FF00) * inv / 0xFF) & 0x0000FF00;
+
+			if (a == 0xFF)
+				out[col] = in[col];
+			else if (a)
+				out[col] = (in[col] & 0x00FFFFFF) + rb + g;
+		}
+	}
+}
+
+static int
+at_arena_init(struct at_arena *arena, size_t size)
+{
+	uint8_t *map;
+	size_t map_size, head;
+
+	size = ALIGN(size, ATOMICTEST_HUGEPAGE_SIZE);
+
+	arena->used = 0;
+	arena->size = size;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map != MAP_FAILED) {
+		arena->base = map;
+		arena->hugetlb = true;
+		return 0;
+	}
+
+	/*
+	 * No hugetlbfs pages reserved, fall back to a hugepage aligned
+	 * mapping and let THP back it.
+	 */
+	map_size = size + ATOMICTEST_HUGEPAGE_SIZE;
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	head = ALIGN((uintptr_t)map, ATOMICTEST_HUGEPAGE_SIZE) - (uintptr_t)map;
+	if (head)
+		munmap(map, head);
+	munmap(map + head + size, map_size - head - size);
+
+	arena->base = map + head;
+	arena->hugetlb = false;
+#ifdef MADV_HUGEPAGE
+	madvise(arena->base, size, MADV_HUGEPAGE);
+#endif
+
+	return 0;
+}
+
+static void *
+at_arena_alloc(struct at_arena *arena, size_t size)
+{
+	void *ptr;
+	size_t offset = ALIGN(arena->used, ATOMICTEST_CACHELINE);
+
+	if (offset + size > arena->size)
+		return NULL;
+
+	ptr = arena->base + offset;
+	arena->used = offset + size;
+
+	return ptr;
+}
+
+static void
+at_arena_free(struct at_arena *arena)
+{
+	if (arena->base)
+		munmap(arena->base, arena->size);
+
+	memset(arena, 0, sizeof(*arena));
+}
+
+static int
+at_shadow_init(struct at_arena *arena, struct at_surface *shadow,
+	       uint32_t width, uint32_t height)
+{
+	uint32_t pitch = ALIGN(width * 4, ATOMICTEST_CACHELINE);
+
+	if (at_arena_init(arena, (size_t)pitch * height) < 0)
+		return -1;
+
+	shadow->data = at_arena_alloc(arena, (size_t)pitch * height);
+	shadow->width = width;
+	shadow->height = height;
+	shadow->pitch = pitch;
+
+	return 0;
+}
+
+static void
+at_content_rect(uint32_t frame, uint32_t width, uint32_t height,
+		struct at_rect *rect)
+{
+	uint32_t size = ATOMICTEST_CONTENT_RECT_SIZE;
+	uint32_t range_x = width > size ? width - size : 1;
+	uint32_t range_y = height > size ? height - size : 1;
+	uint32_t x = (frame * 8) % (2 * range_x);
+	uint32_t y = (frame * 5) % (2 * range_y);
+
+	if (x >= range_x)
+		x = 2 * range_x - x;
+	if (y >= range_y)
+		y = 2 * range_y - y;
+
+	at_rect_set(rect, x, y, MIN(size, width), MIN(size, height));
+}
+
+/*
+ * Region of the primary plane that changes between frame - 1 and frame.
+ */
+static void
+at_content_damage(enum at_content content, uint32_t frame,
+		  uint32_t width, uint32_t height, struct at_rect *damage)
+{
+	struct at_rect prev;
+
+	if (content == AT_CONTENT_FILL || frame == 0) {
+		at_rect_set(damage, 0, 0, width, height);
+		return;
+	}
+
+	at_content_rect(frame - 1, width, height, &prev);
+	at_content_rect(frame, width, height, damage);
+	at_rect_union(damage, &prev);
+}
+
+/*
+ * Renders the part of the given frame that lies inside clip.
+ */
+static void
+at_content_render(struct at_surface *surface, enum at_content content,
+		  uint32_t frame, const struct at_rect *clip)
+{
+	uint32_t component;
+	struct at_rect rect, area;
+
+	if (at_rect_empty(clip))
+		return;
+
+	switch (content) {
+	case AT_CONTENT_FILL:
+		component = (0xFFlu - abs(frame % (2 * 0xFFlu) - 0xFFlu));
+		at_surface_fill_rect(surface, clip,
+				     0xFF000000 | component | component << 16);
+		break;
+	case AT_CONTENT_RECT:
+	case AT_CONTENT_BLEND:
+		at_surface_fill_rect(surface, clip, 0xFF203040);
+
+		at_content_rect(frame, surface->width, surface->height, &rect);
+		if (!at_rect_intersect(&area, &rect, clip))
+			break;
+
+		if (content == AT_CONTENT_RECT)
+			at_surface_fill_rect(surface, &area, 0xFFFFFF00);
+		else
+			at_surface_blend_rect(surface, &area, 0x80FFFFFF);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Makes a framebuffer of a dumb buffer, which is freed if that fails. */
+static struct at_dumb_fb *
+at_dumb_fb_wrap(struct at_device *device, struct at_dumb_buffer *dumb)
+{
+	int ret;
+	struct at_dumb_fb *fb;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+
+	fb = malloc(sizeof(*fb));
+	if (!fb) {
+		at_dumb_buffer_free(device, dumb);
+		return NULL;
+	}
+
+	fb->dumb = dumb;
+
+	handles[0] = dumb->handle;
+	pitches[0] = dumb->pitch;
+	offsets[0] = 0;
+
+	if (dumb->format == DRM_FORMAT_NV12) {
+		handles[1] = dumb->handle;
+		pitches[1] = dumb->pitch;
+		offsets[1] = dumb->pitch * dumb->height;
+	}
+	ret = drmModeAddFB2(device->fd, dumb->width, dumb->height, dumb->format,
+			    handles, pitches, offsets, &fb->fb_id, 0);
+	if (ret) {
+		at_dumb_buffer_free(device, dumb);
+		free(fb);
+		return NULL;
+	}
+
+	return fb;
+}
+
+static struct at_dumb_fb *
+at_dumb_fb_create(struct at_device *device, uint16_t width,
+		      uint16_t height, uint32_t format,
+		      enum at_mem_purpose purpose)
+{
+	struct at_dumb_buffer *dumb;
+	struct at_dumb_fb *fb;
+
+	dumb = at_dumb_buffer_create(device, width, height, format, purpose);
+	if (!dumb)
+		return NULL;
+
+	fb = at_dumb_fb_wrap(device, dumb);
+	if (fb)
+		device->live_fbs++;
+
+	return fb;
+}
+
+static void
+at_dumb_fb_free(struct at_device *device, struct at_dumb_fb *fb)
+{
+	drmModeRmFB(device->fd, fb->fb_id);
+	device->live_fbs--;
+	at_dumb_buffer_free(device, fb->dumb);
+	free(fb);
+}
+
+struct at_fb_job {
+	struct at_device *device;
+	uint16_t width;
+	uint16_t height;
+	uint32_t format;
+	enum at_mem_purpose purpose;
+
+	struct at_dumb_fb *fb;
+	int ret;
+
+	pthread_t thread;
+	bool threaded;
+};
+
+static void *
+at_fb_job_alloc(void *data)
+{
+	struct at_fb_job *job = data;
+	struct at_dumb_buffer *dumb;
+
+	dumb = at_dumb_buffer_alloc(job->device, job->width, job->height,
+				    job->format, job->purpose);
+	if (dumb)
+		job->fb = at_dumb_fb_wrap(job->device, dumb);
+
+	return NULL;
+}
+
+static void *
+at_fb_job_map(void *data)
+{
+	struct at_fb_job *job = data;
+
+	job->ret = at_dumb_buffer_map(job->device, job->fb->dumb);
+
+	return NULL;
+}
+
+/* A thread per job, or right here for a job whose thread didn't start. */
+static void
+at_fb_jobs_run(struct at_fb_job *jobs, uint32_t count, void *(*func)(void *))
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].threaded = !pthread_create(&jobs[i].thread, NULL, func,
+						   &jobs[i]);
+		if (!jobs[i].threaded)
+			func(&jobs[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+	}
+}
+
+/*
+ * Creates count framebuffers alike, all or none. The allocations and then
+ * the mappings run on a thread per buffer, so the kernel clears and faults
+ * in the pages of a 4K swapchain in parallel rather than a buffer at a time.
+ */
+static int
+at_dumb_fbs_create(struct at_device *device, struct at_dumb_fb **fbs,
+		   uint32_t count, uint16_t width, uint16_t height,
+		   uint32_t format, enum at_mem_purpose purpose)
+{
+	struct at_fb_job *jobs;
+	uint64_t start, allocated;
+	bool failed = false;
+	uint32_t i;
+
+	jobs = calloc(count, sizeof(*jobs));
+	if (!jobs)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		jobs[i].device = device;
+		jobs[i].width = width;
+		jobs[i].height = height;
+		jobs[i].format = format;
+		jobs[i].purpose = purpose;
+	}
+
+	start = at_now_ns();
+	at_fb_jobs_run(jobs, count, at_fb_job_alloc);
+	allocated = at_now_ns();
+	device->mem.alloc_ns += allocated - start;
+
+	for (i = 0; i < count; i++)
+		failed |= !jobs[i].fb;
+
+	if (!failed) {
+		at_fb_jobs_run(jobs, count, at_fb_job_map);
+		device->mem.map_ns += at_now_ns() - allocated;
+
+		for (i = 0; i < count; i++)
+			failed |= jobs[i].ret < 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!jobs[i].fb)
+			continue;
+
+		device->live_fbs++;
+		if (failed)
+			at_dumb_fb_free(device, jobs[i].fb);
+		else
+			fbs[i] = jobs[i].fb;
+	}
+
+	free(jobs);
+
+	return failed ? -1 : 0;
+}
+
+static uint64_t
+at_video_frame_size(uint32_t format, uint32_t width, uint32_t height)
+{
+	return (uint64_t)width * at_format_alloc_height(format, height) *
+	       at_format_bpp(format) / 8;
+}
+
+static void
+at_video_prefetch(struct at_video *video, uint64_t frame);
+
+static struct at_video *
+at_video_open(struct at_device *device, const struct at_config *config)
+{
+	int i;
+	struct stat st;
+	struct at_video *video;
+
+	video = calloc(1, sizeof(*video));
+	if (!video)
+		return NULL;
+
+	video->width = config->video_width;
+	video->height = config->video_height;
+	video->format = config->video_format;
+
+	/* the UV plane is subsampled 2x2, an odd size has no whole chroma row */
+	if (video->format == DRM_FORMAT_NV12 &&
+	    ((video->width | video->height) & 1)) {
+		fprintf(stderr, "NV12 video needs an even width and height, not %ux%u.\n",
+			video->width, video->height);
+		goto err_free;
+	}
+
+	video->frame_size = at_video_frame_size(video->format, video->width,
+						video->height);
+	video->shown = -1;
+
+	video->fd = open(config->video_path, O_RDONLY | O_CLOEXEC);
+	if (video->fd < 0) {
+		perror("Could not open video file");
+		goto err_free;
+	}
+
+	if (fstat(video->fd, &st) < 0)
+		goto err_close;
+
+	video->file_size = st.st_size;
+	video->frame_count = video->file_size / video->frame_size;
+	if (!video->frame_count) {
+		fprintf(stderr, "Video file is smaller than one %ux%u frame.\n",
+			video->width, video->height);
+		goto err_close;
+	}
+
+	posix_fadvise(video->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (config->video_read) {
+		video->read_buf = aligned_alloc(ATOMICTEST_CACHELINE,
+						ALIGN(video->frame_size,
+						      ATOMICTEST_CACHELINE));
+		if (!video->read_buf)
+			goto err_close;
+	} else {
+		video->map = mmap(NULL, video->file_size, PROT_READ, MAP_SHARED,
+				  video->fd, 0);
+		if (video->map == MAP_FAILED) {
+			perror("Could not map video file");
+			goto err_close;
+		}
+
+		madvise(video->map, video->file_size, MADV_SEQUENTIAL);
+	}
+
+	if (at_dumb_fbs_create(device, video->fbs, ATOMICTEST_NUM_FBS,
+			       video->width, video->height, video->format,
+			       AT_MEM_VIDEO) < 0) {
+		fprintf(stderr, "Couldn't create video fb.\n");
+		goto err_unmap;
+	}
+
+	for (i = 0; i < ATOMICTEST_VIDEO_READAHEAD; i++)
+		at_video_prefetch(video, i);
+
+	printf("Video: %s, %ux%u, %" PRIu64 " frames of %" PRIu64 " bytes (%s)\n",
+	       config->video_path, video->width, video->height,
+	       video->frame_count, video->frame_size,
+	       video->map ? "mmap" : "read");
+
+	return video;
+
+err_unmap:
+	if (video->map)
+		munmap(video->map, video->file_size);
+	free(video->read_buf);
+err_close:
+	close(video->fd);
+err_free:
+	free(video);
+
+	return NULL;
+}
+
+static void
+at_video_close(struct at_device *device, struct at_video *video)
+{
+	int i;
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+		at_dumb_fb_free(device, video->fbs[i]);
+
+	if (video->map)
+		munmap(video->map, video->file_size);
+	free(video->read_buf);
+	close(video->fd);
+	free(video);
+}
+
+/*
+ * Kicks off asynchronous readahead for a frame we'll need soon, so the page
+ * cache is warm by the time it's copied.
+ */
+static void
+at_video_prefetch(struct at_video *video, uint64_t frame)
+{
+	uint64_t offset = (frame % video->frame_count) * video->frame_size;
+
+	if (video->map)
+		madvise(video->map + (offset & ~(uint64_t)(getpagesize() - 1)),
+			video->frame_size + (offset & (getpagesize() - 1)),
+			MADV_WILLNEED);
+	else
+		posix_fadvise(video->fd, offset, video->frame_size,
+			      POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Returns a pointer to the source frame, blocking on I/O if it isn't
+ * resident. For mmap the pages are touched up front so the fault time is
+ * accounted as I/O stall instead of copy time.
+ */
+static const uint8_t *
+at_video_fetch(struct at_video *video, uint64_t frame)
+{
+	uint64_t start = at_now_ns();
+	uint64_t offset = (frame % video->frame_count) * video->frame_size;
+	const uint8_t *src;
+
+	if (video->map) {
+		volatile const uint8_t *p = video->map + offset;
+		uint64_t i;
+		long page = getpagesize();
+
+		for (i = 0; i < video->frame_size; i += page)
+			(void)p[i];
+		src = video->map + offset;
+	} else {
+		ssize_t ret = pread(video->fd, video->read_buf,
+				    video->frame_size, offset);
+		if (ret != video->frame_size)
+			src = NULL;
+		else
+			src = video->read_buf;
+	}
+
+	video->io_stall_ns += at_now_ns() - start;
+
+	return src;
+}
+
+static void
+at_video_copy(struct at_video *video, struct at_dumb_buffer *dumb,
+	      const uint8_t *src)
+{
+	uint32_t y;
+	uint64_t start = at_now_ns();
+	uint32_t stride = video->width * at_format_bpp(video->format) / 8;
+	uint32_t rows = at_format_alloc_height(video->format, video->height);
+
+	for (y = 0; y < rows; y++)
+		at_copy_stream(dumb->data + y * dumb->pitch, src + y * stride,
+			       stride);
+	at_copy_stream_fence();
+
+	video->copy_ns += at_now_ns() - start;
+	video->copy_bytes += (uint64_t)stride * rows;
+}
+
+/*
+ * Picks the source frame due for the next vblank and uploads it into the back
+ * buffer. Without a fixed rate every flip shows the next frame.
+ */
+static void
+at_video_update(struct at_video *video, double fps)
+{
+	uint64_t frame;
+	uint32_t next_fb;
+	const uint8_t *src;
+
+	if (!video->start_ns)
+		video->start_ns = at_now_ns();
+
+	if (fps > 0)
+		frame = (at_now_ns() - video->start_ns) * fps / 1000000000.0;
+	else
+		frame = video->shown + 1;
+
+	if ((int64_t)frame <= video->shown) {
+		video->frames_repeated++;
+		return;
+	}
+
+	if (video->shown >= 0)
+		video->frames_dropped += frame - video->shown - 1;
+
+	src = at_video_fetch(video, frame);
+	if (!src)
+		return;
+
+	next_fb = (video->cur_fb + 1) % ATOMICTEST_NUM_FBS;
+	at_video_copy(video, video->fbs[next_fb]->dumb, src);
+
+	at_video_prefetch(video, frame + ATOMICTEST_VIDEO_READAHEAD);
+
+	video->cur_fb = next_fb;
+	video->shown = frame;
+	video->frames_copied++;
+}
+
+static void
+at_video_report(struct at_video *video, uint64_t missed_vblanks, double fps)
+{
+	printf("Video: %" PRIu64 " frames copied, %" PRIu64 " dropped, "
+	       "%" PRIu64 " repeated\n",
+	       video->frames_copied,
+	       fps > 0 ? video->frames_dropped : missed_vblanks,
+	       video->frames_repeated);
+
+	if (!video->frames_copied)
+		return;
+
+	printf("Video: I/O stall %.3f ms total, %.3f ms/frame\n",
+	       video->io_stall_ns / 1000000.0,
+	       video->io_stall_ns / 1000000.0 / video->frames_copied);
+	printf("Video: copy %.3f ms/frame, %.1f MB/s\n",
+	       video->copy_ns / 1000000.0 / video->frames_copied,
+	       video->copy_ns ? video->copy_bytes * 1000.0 / video->copy_ns : 0.0);
+}
+
+static int
+at_device_modeset_restore(struct at_device *device, bool restore_crtc)
+{
+	int i;
+	int ret = 0;
+
+	if (!device->saved_crtc)
+		return -1;
+
+	drmModeSetCursor(device->fd, device->crtc->crtc_id, 0, 0, 0);
+
+	for (i = 0; i < device->overlays_count; i++)
+		drmModeSetPlane(device->fd, device->overlay_planes[i]->plane_id,
+				device->crtc->crtc_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	if (restore_crtc)
+		ret = drmModeSetCrtc(device->fd, device->saved_crtc->crtc_id,
+				     device->saved_crtc->buffer_id,
+				     device->saved_crtc->x, device->saved_crtc->y,
+				     &device->connector->connector_id, 1,
+				     &device->saved_crtc->mode);
+
+	drmModeFreeCrtc(device->saved_crtc);
+
+	device->saved_crtc = NULL;
+
+	return ret;
+}
+
+static int
+at_device_modeset_save(struct at_device *device)
+{
+	int ret;
+
+	if (device->saved_crtc) {
+		ret = at_device_modeset_restore(device, true);
+		if (ret < 0)
+			return ret;
+	}
+
+	device->saved_crtc = drmModeGetCrtc(device->fd, device->crtc->crtc_id);
+
+	return 0;
+}
+
+static void
+at_input_write_begin(struct at_input_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+at_input_write_end(struct at_input_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Seqlock read: retries while the writer is inside a write section. */
+static void
+at_input_read(struct at_input_slot *slot, struct at_input_slot *copy)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		copy->total_dx = slot->total_dx;
+		copy->total_dy = slot->total_dy;
+		copy->events = slot->events;
+		copy->pending_ns = slot->pending_ns;
+		copy->overlays = slot->overlays;
+		copy->overlay_requests = slot->overlay_requests;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+}
+
+static int
+at_libinput_if_open_restricted(const char *path, int flags, void *user_data)
+{
+	return open(path, flags);
+}
+
+static void
+at_libinput_if_close_restricted(int fd, void *user_data)
+{
+	close(fd);
+}
+
+static const struct libinput_interface at_libinput_if = {
+	.open_restricted = at_libinput_if_open_restricted,
+	.close_restricted = at_libinput_if_close_restricted
+};
+
+static void
+at_instance_li_handle_key_event(struct at_instance *instance, struct libinput_event *ev)
+{
+	uint32_t key;
+	struct libinput_event_keyboard *kev =
+		libinput_event_get_keyboard_event(ev);
+	if (!kev)
+		return;
+
+	key = libinput_event_keyboard_get_key(kev);
+
+	switch (key) {
+	case KEY_Q:
+		at_instance_interrupt(instance);
+		break;
+	case KEY_0:
+		instance->input.overlays = 0;
+		instance->input.overlay_requests++;
+		break;
+	case KEY_1 ... KEY_9:
+		instance->input.overlays = (key - KEY_1) + 1;
+		instance->input.overlay_requests++;
+		break;
+	}
+}
+
+static void
+at_instance_li_handle_pointer_motion(struct at_instance *instance, struct libinput_event *ev)
+{
+	double dx, dy;
+	struct libinput_event_pointer *pev =
+		libinput_event_get_pointer_event(ev);
+	if (!pev)
+		return;
+
+	dx = libinput_event_pointer_get_dx(pev);
+	dy = libinput_event_pointer_get_dy(pev);
+
+	if (instance->input.events ==
+	    __atomic_load_n(&instance->input.taken, __ATOMIC_RELAXED))
+		instance->input.pending_ns =
+			libinput_event_pointer_get_time_usec(pev) * 1000;
+
+	instance->input.total_dx += dx;
+	instance->input.total_dy += dy;
+	instance->input.events++;
+}
+
+/*
+ * Wakes a stopped on-demand loop for input published off its thread. The
+ * fence pairs with the one in at_instance_idle_flip().
+ */
+static void
+at_instance_idle_wake(struct at_instance *instance)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&instance->idle.sleeping, __ATOMIC_RELAXED))
+		return;
+
+	if (write(instance->idle.wake_fd, &one, sizeof(one)) != sizeof(one))
+		at_debug("on demand: wake failed: %s\n", strerror(errno));
+}
+
+/*
+ * Drains libinput into the input slot. The whole batch is one write
+ * section, so a frame sees either none or all of it.
+ */
+static int
+at_instance_libinput_handle_events(struct at_instance *instance)
+{
+	struct libinput_event *ev;
+
+	libinput_dispatch(instance->li);
+
+	at_input_write_begin(&instance->input);
+
+	while ((ev = libinput_get_event(instance->li))) {
+		switch (libinput_event_get_type(ev)) {
+		case LIBINPUT_EVENT_KEYBOARD_KEY:
+			at_instance_li_handle_key_event(instance, ev);
+			break;
+		case LIBINPUT_EVENT_POINTER_MOTION:
+			at_instance_li_handle_pointer_motion(instance, ev);
+			break;
+		}
+
+		libinput_event_destroy(ev);
+	}
+
+	at_input_write_end(&instance->input);
+
+	if (instance->input_threaded)
+		at_instance_idle_wake(instance);
+
+	return 0;
+}
+
+/*
+ * Applies the motion published since the last frame to the cursor. Called
+ * once per frame on the main thread, whichever thread produces the input.
+ */
+static void
+at_instance_input_take(struct at_instance *instance)
+{
+	struct at_input_slot snapshot;
+	struct at_present_stats *stats = &instance->stats;
+	uint64_t events;
+	double dx, dy;
+
+	at_input_read(&instance->input, &snapshot);
+
+	if (snapshot.overlay_requests != instance->overlay_requests_taken) {
+		instance->overlay_requests_taken = snapshot.overlay_requests;
+		at_instance_set_num_overlays_use(instance, snapshot.overlays);
+	}
+
+	events = snapshot.events - instance->input.taken;
+	if (!events)
+		return;
+
+	__atomic_store_n(&instance->input.taken, snapshot.events, __ATOMIC_RELAXED);
+
+	stats->input_events += events;
+	stats->input_frames++;
+	stats->input_max_per_frame = MAX(stats->input_max_per_frame, events);
+
+	if (!instance->input_pending_ns)
+		instance->input_pending_ns = snapshot.pending_ns;
+
+	/* whole pixels only, the fractions carry over to the next frame */
+	dx = floor(snapshot.total_dx - instance->input_dx_taken);
+	dy = floor(snapshot.total_dy - instance->input_dy_taken);
+	instance->input_dx_taken += dx;
+	instance->input_dy_taken += dy;
+
+	instance->cursor_x = MIN(MAX(instance->cursor_x + (int)dx, 0),
+				 instance->device.width - 1);
+	instance->cursor_y = MIN(MAX(instance->cursor_y + (int)dy, 0),
+				 instance->device.height - 1);
+}
+
+static void *
+at_input_thread(void *data)
+{
+	struct at_instance *instance = data;
+	struct pollfd pfds[2];
+
+	pfds[0].fd = libinput_get_fd(instance->li);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = instance->input_stop_fd;
+	pfds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfds[1].revents)
+			break;
+
+		if (pfds[0].revents & POLLIN)
+			at_instance_libinput_handle_events(instance);
+	}
+
+	return NULL;
+}
+
+/* Parses CPU lists like "2" or "0,2-3". */
+static int
+at_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(cpus);
+
+	while (*list) {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE || (*end && *end != ','))
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+
+		list = *end ? end + 1 : end;
+	}
+
+	return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+static void
+at_thread_state_save(pthread_t thread, struct at_thread_state *state)
+{
+	pthread_getschedparam(thread, &state->policy, &state->param);
+	pthread_getaffinity_np(thread, sizeof(state->cpus), &state->cpus);
+}
+
+static void
+at_thread_state_restore(pthread_t thread, const struct at_thread_state *state)
+{
+	pthread_setschedparam(thread, state->policy, &state->param);
+	pthread_setaffinity_np(thread, sizeof(state->cpus), &state->cpus);
+}
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+/* the kernel's struct sched_attr, glibc only wraps sched_setattr() lately */
+struct at_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+/*
+ * Pins a thread to the given CPUs and applies the configured policy. Only
+ * the calling thread can take SCHED_DEADLINE, with a period of period_ns;
+ * other threads (period_ns 0) run SCHED_FIFO then. A deadline thread
+ * can't create threads unless its children fall back to SCHED_OTHER, so
+ * they do.
+ */
+static int
+at_thread_set_realtime(pthread_t thread, const struct at_config *config,
+		       const char *cpus, uint64_t period_ns)
+{
+	struct sched_param param = { .sched_priority = config->sched_priority };
+	struct at_sched_attr attr;
+	cpu_set_t set;
+	int ret;
+
+	if (cpus) {
+		ret = at_parse_cpus(cpus, &set);
+		if (ret < 0)
+			return ret;
+
+		ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+		if (ret)
+			return -ret;
+	}
+
+	if (config->sched == AT_SCHED_OTHER)
+		return 0;
+
+	if (config->sched == AT_SCHED_FIFO || !period_ns)
+		return -pthread_setschedparam(thread, SCHED_FIFO, &param);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+	attr.sched_runtime = config->sched_runtime_ns ?
+			     MIN(config->sched_runtime_ns, period_ns) : period_ns / 4;
+	attr.sched_deadline = period_ns;
+	attr.sched_period = period_ns;
+
+	if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void
+at_instance_rt_input(struct at_instance *instance)
+{
+	int ret;
+
+	at_thread_state_save(instance->input_thread, &instance->rt_input_saved);
+
+	ret = at_thread_set_realtime(instance->input_thread, &instance->config,
+				     instance->config.input_cpus, 0);
+	if (ret < 0)
+		fprintf(stderr, "Couldn't apply the real-time controls to the "
+			"input thread: %s\n", strerror(-ret));
+
+	instance->rt_input = true;
+}
+
+/* Moves libinput dispatch off (or back onto) the main event loop. */
+static int
+at_instance_set_input_threaded(struct at_instance *instance, bool threaded)
+{
+	uint64_t one = 1;
+	int ret;
+
+	if (threaded == instance->input_threaded)
+		return 0;
+
+	if (!threaded) {
+		if (write(instance->input_stop_fd, &one, sizeof(one)) != sizeof(one))
+			return -errno;
+		pthread_join(instance->input_thread, NULL);
+		close(instance->input_stop_fd);
+		instance->input_threaded = false;
+		instance->rt_input = false;
+		return 0;
+	}
+
+	instance->input_stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (instance->input_stop_fd < 0)
+		return -errno;
+
+	ret = pthread_create(&instance->input_thread, NULL, at_input_thread,
+			     instance);
+	if (ret) {
+		close(instance->input_stop_fd);
+		return -ret;
+	}
+
+	instance->input_threaded = true;
+
+	if (instance->rt_enabled)
+		at_instance_rt_input(instance);
+
+	return 0;
+}
+
+static int
+at_instance_libinput_init(struct at_instance *instance)
+{
+	struct libinput *li;
+	struct udev *udev = udev_new();
+
+	if (!udev) {
+		fprintf(stderr, "Failed to initialize udev\n");
+		return -1;
+	}
+
+	li = libinput_udev_create_context(&at_libinput_if, instance, udev);
+	if (!li) {
+		fprintf(stderr, "Failed to initialize context from udev\n");
+		goto err_li_udev;
+	}
+
+	if (libinput_udev_assign_seat(li, "seat0")) {
+		fprintf(stderr, "Failed to set seat\n");
+		goto err_li_seat;
+	}
+
+	instance->li = li;
+
+	at_instance_libinput_handle_events(instance);
+
+	udev_unref(udev);
+	return 0;
+
+err_li_seat:
+	libinput_unref(li);
+err_li_udev:
+	udev_unref(udev);
+	return -1;
+}
+
+static int
+at_instance_libinput_close(struct at_instance *instance)
+{
+	if (!instance->li)
+		return 0;
+
+	at_instance_set_input_threaded(instance, false);
+
+	return libinput_unref(instance->li) == NULL;
+}
+
+/*
+ * Finds a writeback connector that can be routed to our CRTC. Writeback
+ * connectors are only listed once the client cap is set, so the resources
+ * are queried again after enabling it.
+ */
+static struct at_writeback *
+at_writeback_open(struct at_device *device, const char *sink)
+{
+	int i, j;
+	drmModeRes *resources;
+	struct at_writeback *writeback;
+
+	if (drmSetClientCap(device->fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1) < 0) {
+		fprintf(stderr, "Error: the device doesn't support writeback connectors.\n");
+		return NULL;
+	}
+
+	resources = drmModeGetResources(device->fd);
+	if (!resources)
+		return NULL;
+
+	writeback = calloc(1, sizeof(*writeback));
+	if (!writeback)
+		goto err_free_resources;
+
+	writeback->staged = -1;
+	writeback->pending = -1;
+	writeback->fence_fd = -1;
+	writeback->sink_fd = -1;
+
+	for (i = 0; i < resources->count_connectors && !writeback->connector.connector_id; i++) {
+		drmModeConnector *connector;
+
+		connector = drmModeGetConnector(device->fd, resources->connectors[i]);
+		if (!connector)
+			continue;
+
+		for (j = 0; connector->connector_type == DRM_MODE_CONNECTOR_WRITEBACK &&
+			    j < connector->count_encoders; j++) {
+			drmModeEncoder *encoder;
+			bool usable;
+
+			encoder = drmModeGetEncoder(device->fd, connector->encoders[j]);
+			if (!encoder)
+				continue;
+
+			usable = encoder->possible_crtcs & (1 << device->crtc->crtc_idx);
+			drmModeFreeEncoder(encoder);
+
+			if (usable) {
+				writeback->connector.connector_id = connector->connector_id;
+				break;
+			}
+		}
+
+		drmModeFreeConnector(connector);
+	}
+
+	if (!writeback->connector.connector_id) {
+		fprintf(stderr, "Error: no writeback connector for CRTC %d.\n",
+			device->crtc->crtc_id);
+		goto err_free_writeback;
+	}
+
+	at_drm_properties_init(device, &writeback->connector.properties,
+			       writeback->connector.connector_id,
+			       DRM_MODE_OBJECT_CONNECTOR);
+
+	if (sink) {
+		writeback->sink_fd = open(sink, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					  0644);
+		if (writeback->sink_fd < 0) {
+			perror("Could not open the writeback sink");
+			goto err_free_properties;
+		}
+	}
+
+	printf("Writeback: connector %d, %s\n", writeback->connector.connector_id,
+	       sink ? sink : "checksum only");
+
+	drmModeFreeResources(resources);
+
+	return writeback;
+
+err_free_properties:
+	at_drm_properties_free(&writeback->connector.properties);
+err_free_writeback:
+	free(writeback);
+err_free_resources:
+	drmModeFreeResources(resources);
+
+	return NULL;
+}
+
+static void
+at_writeback_free_fbs(struct at_device *device, struct at_writeback *writeback)
+{
+	int i;
+
+	for (i = 0; i < ATOMICTEST_WRITEBACK_FBS; i++) {
+		if (writeback->fbs[i])
+			at_dumb_fb_free(device, writeback->fbs[i]);
+		writeback->fbs[i] = NULL;
+	}
+
+	free(writeback->reference.data);
+	memset(&writeback->reference, 0, sizeof(writeback->reference));
+}
+
+static void
+at_writeback_close(struct at_device *device, struct at_writeback *writeback)
+{
+	if (writeback->fence_fd >= 0)
+		close(writeback->fence_fd);
+	if (writeback->sink_fd >= 0)
+		close(writeback->sink_fd);
+
+	at_writeback_free_fbs(device, writeback);
+	at_drm_properties_free(&writeback->connector.properties);
+	free(writeback->committed.overlay_pos);
+	free(writeback);
+}
+
+/* (Re)creates the capture pool and reference when the mode size changed. */
+static int
+at_writeback_alloc_fbs(struct at_device *device, struct at_writeback *writeback)
+{
+	if (writeback->fbs[0] && writeback->fbs[0]->dumb->width == device->width &&
+	    writeback->fbs[0]->dumb->height == device->height)
+		return 0;
+
+	at_writeback_free_fbs(device, writeback);
+
+	if (at_dumb_fbs_create(device, writeback->fbs, ATOMICTEST_WRITEBACK_FBS,
+			       device->width, device->height,
+			       DRM_FORMAT_XRGB8888, AT_MEM_WRITEBACK) < 0)
+		goto err_free;
+
+	writeback->reference.width = device->width;
+	writeback->reference.height = device->height;
+	writeback->reference.pitch = device->width * 4;
+	writeback->reference.data = malloc(writeback->reference.pitch *
+					   writeback->reference.height);
+	if (!writeback->reference.data)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	at_writeback_free_fbs(device, writeback);
+
+	return -1;
+}
+
+static const char *const at_scene_role_names[] = {
+	[AT_SCENE_PRIMARY] = "primary",
+	[AT_SCENE_OVERLAY] = "overlay",
+	[AT_SCENE_CURSOR] = "cursor",
+};
+
+static const char *const at_scene_content_names[] = {
+	[AT_SCENE_SOLID] = "solid",
+	[AT_SCENE_CHECKER] = "checker",
+	[AT_SCENE_GRADIENT] = "gradient",
+	[AT_SCENE_PULSE] = "pulse",
+};
+
+static const char *const at_scene_motion_names[] = {
+	[AT_MOTION_STATIC] = "static",
+	[AT_MOTION_CIRCLE] = "circle",
+	[AT_MOTION_BOUNCE] = "bounce",
+	[AT_MOTION_INPUT] = "input",
+};
+
+static int
+at_lookup(const char *const *names, int count, const char *name)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (names[i] && !strcmp(names[i], name))
+			return i;
+	}
+
+	return -1;
+}
+
+#define AT_LOOKUP(names, name) \
+	at_lookup(names, sizeof(names) / sizeof(names[0]), name)
+
+/* Keys the primary plane has no use for: it's always mode sized and still. */
+static const char *const at_scene_primary_ignored[] = {
+	"size", "format", "color", "color2", "cell", "motion", "x", "y",
+	"radius", "period", "phase", "speed",
+};
+
+/* The cursor follows the cursor caps and is always ARGB. */
+static const char *const at_scene_cursor_ignored[] = {
+	"size", "format",
+};
+
+static void
+at_scene_warn_ignored(const char *path, int lineno, const char *role,
+		      const char *const *names, uint32_t mask)
+{
+	int i;
+
+	for (i = 0; mask; i++, mask >>= 1) {
+		if (mask & 1)
+			fprintf(stderr, "%s:%d: %s is ignored on the %s plane\n",
+				path, lineno, names[i], role);
+	}
+}
+
+/* A finite number and nothing else. */
+static int
+at_scene_parse_double(const char *value, double *out)
+{
+	char *end;
+
+	*out = strtod(value, &end);
+
+	return end == value || *end || !isfinite(*out) ? -1 : 0;
+}
+
+/* An unsigned 32-bit number in the given base and nothing else. */
+static int
+at_scene_parse_u32(const char *value, int base, uint32_t *out)
+{
+	unsigned long long n;
+	char *end;
+
+	if (*value == '-')
+		return -1;
+
+	n = strtoull(value, &end, base);
+	if (end == value || *end || n > UINT32_MAX)
+		return -1;
+
+	*out = n;
+
+	return 0;
+}
+
+static int
+at_scene_parse_key(struct at_scene_plane *plane, const char *key,
+		   const char *value, enum at_content *primary_content)
+{
+	int ret;
+
+	if (!strcmp(key, "role")) {
+		ret = AT_LOOKUP(at_scene_role_names, value);
+		plane->role = ret;
+	} else if (!strcmp(key, "size")) {
+		ret = sscanf(value, "%ux%u", &plane->width, &plane->height) == 2 ? 0 : -1;
+	} else if (!strcmp(key, "format")) {
+		if (!strcmp(value, "argb8888"))
+			plane->format = DRM_FORMAT_ARGB8888;
+		else if (!strcmp(value, "xrgb8888"))
+			plane->format = DRM_FORMAT_XRGB8888;
+		else
+			return -1;
+		ret = 0;
+	} else if (!strcmp(key, "zpos")) {
+		char *end;
+
+		plane->zpos = strtoll(value, &end, 10);
+		if (end == value || *end)
+			return -1;
+		plane->has_zpos = true;
+		ret = 0;
+	} else if (!strcmp(key, "alpha")) {
+		char *end;
+		double alpha = strtod(value, &end);
+
+		if (end == value || *end || !(alpha >= 0.0 && alpha <= 1.0))
+			return -1;
+		plane->alpha = alpha * 0xFFFF;
+		plane->has_alpha = true;
+		ret = 0;
+	} else if (!strcmp(key, "content")) {
+		ret = AT_LOOKUP(at_scene_content_names, value);
+		if (ret >= 0)
+			plane->content = ret;
+		else
+			ret = at_content_from_name(value, primary_content);
+	} else if (!strcmp(key, "color")) {
+		ret = at_scene_parse_u32(value, 16, &plane->color);
+	} else if (!strcmp(key, "color2")) {
+		ret = at_scene_parse_u32(value, 16, &plane->color2);
+	} else if (!strcmp(key, "cell")) {
+		ret = at_scene_parse_u32(value, 10, &plane->cell);
+		if (!ret && !plane->cell)
+			ret = -1;
+	} else if (!strcmp(key, "motion")) {
+		ret = AT_LOOKUP(at_scene_motion_names, value);
+		plane->motion = ret;
+	} else if (!strcmp(key, "x")) {
+		ret = at_scene_parse_double(value, &plane->x);
+	} else if (!strcmp(key, "y")) {
+		ret = at_scene_parse_double(value, &plane->y);
+	} else if (!strcmp(key, "radius")) {
+		ret = at_scene_parse_double(value, &plane->radius);
+		if (!ret && plane->radius < 0)
+			ret = -1;
+	} else if (!strcmp(key, "period")) {
+		double period;
+
+		ret = at_scene_parse_double(value, &period);
+		if (!ret && period <= 0)
+			ret = -1;
+		if (!ret)
+			plane->omega = 2 * M_PI / period;
+	} else if (!strcmp(key, "phase")) {
+		ret = at_scene_parse_double(value, &plane->phase);
+		plane->phase *= M_PI / 180.0;
+	} else if (!strcmp(key, "speed")) {
+		ret = sscanf(value, "%lf,%lf", &plane->vx, &plane->vy) == 2 ? 0 : -1;
+	} else {
+		ret = -1;
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Loads a scene file: one plane per line as whitespace separated key=value
+ * pairs, '#' starts a comment. For example
+ *
+ *   role=primary content=blend
+ *   role=overlay size=256x256 format=argb8888 zpos=3 alpha=0.75 \
+ *       content=checker color=ff2060c0 color2=ffffffff cell=32 \
+ *       motion=circle radius=300 period=4 phase=90
+ *   role=cursor content=solid color=ffff0000 motion=input
+ *
+ * (without the line continuations). Keys:
+ *
+ *   role     primary, overlay or cursor (required)
+ *   size     WxH; primary is always the mode size, cursor the cursor caps
+ *   format   xrgb8888 (default) or argb8888
+ *   zpos     value for the plane's zpos property, within its range
+ *   alpha    0.0-1.0, scaled to the range of the plane's alpha property
+ *   content  solid, checker, gradient or pulse; fill, rect or blend for
+ *            the primary plane
+ *   color, color2, cell
+ *            ARGB colors in hex and the checker cell size (at least 1)
+ *   motion   static (at x,y), circle (around x,y, default the screen
+ *            center, with radius, period in seconds and phase in
+ *            degrees), bounce (from x,y with speed=VX,VY px/s) or input
+ *            (follows the pointer)
+ *
+ * Everything is resolved into a flat array here; at_scene_update() only
+ * evaluates it, so nothing is allocated or parsed while flipping.
+ */
+static int
+at_scene_load(struct at_scene *scene, const char *path,
+	      const struct at_device *device, enum at_content *primary_content)
+{
+	FILE *file;
+	char line[512];
+	int lineno = 0;
+
+	memset(scene, 0, sizeof(*scene));
+
+	file = fopen(path, "r");
+	if (!file) {
+		perror("Could not open scene file");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		struct at_scene_plane plane, *planes;
+		char *save, *token, *comment;
+		bool has_keys = false, has_role = false, has_content = false;
+		enum at_content content = AT_CONTENT_COUNT;
+		uint32_t primary_ignored = 0, cursor_ignored = 0;
+		int ret;
+
+		lineno++;
+
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		memset(&plane, 0, sizeof(plane));
+		plane.format = DRM_FORMAT_XRGB8888;
+		plane.color = 0xFFFFFFFF;
+		plane.color2 = 0xFF000000;
+		plane.cell = 16;
+		plane.x = NAN;
+		plane.y = NAN;
+		plane.width = 128;
+		plane.height = 128;
+
+		for (token = strtok_r(line, " \t\r\n", &save); token;
+		     token = strtok_r(NULL, " \t\r\n", &save)) {
+			char *value = strchr(token, '=');
+
+			if (!value)
+				goto err_syntax;
+			*value++ = '\0';
+			has_keys = true;
+
+			if (at_scene_parse_key(&plane, token, value,
+					       &content) < 0)
+				goto err_syntax;
+
+			if (!strcmp(token, "role"))
+				has_role = true;
+			else if (!strcmp(token, "content"))
+				has_content = true;
+
+			ret = AT_LOOKUP(at_scene_primary_ignored, token);
+			if (ret >= 0)
+				primary_ignored |= 1u << ret;
+			ret = AT_LOOKUP(at_scene_cursor_ignored, token);
+			if (ret >= 0)
+				cursor_ignored |= 1u << ret;
+		}
+
+		/* blank or only a comment */
+		if (!has_keys)
+			continue;
+
+		if (!has_role) {
+			fprintf(stderr, "%s:%d: missing role\n", path, lineno);
+			goto err_free;
+		}
+
+		if (content != AT_CONTENT_COUNT) {
+			if (plane.role != AT_SCENE_PRIMARY) {
+				fprintf(stderr, "%s:%d: content %s is only valid for the primary plane\n",
+					path, lineno, at_content_names[content]);
+				goto err_free;
+			}
+			*primary_content = content;
+		}
+
+		if (plane.role == AT_SCENE_PRIMARY) {
+			at_scene_warn_ignored(path, lineno, "primary",
+					      at_scene_primary_ignored,
+					      primary_ignored);
+			if (has_content && content == AT_CONTENT_COUNT)
+				fprintf(stderr, "%s:%d: content %s is ignored on the primary plane, "
+					"it takes fill, rect or blend\n", path, lineno,
+					at_scene_content_names[plane.content]);
+			plane.width = device->width;
+			plane.height = device->height;
+		} else if (plane.role == AT_SCENE_OVERLAY) {
+			plane.index = scene->overlay_count++;
+		} else if (plane.role == AT_SCENE_CURSOR) {
+			if (scene->has_cursor) {
+				fprintf(stderr, "%s:%d: only one cursor plane\n",
+					path, lineno);
+				goto err_free;
+			}
+			scene->has_cursor = true;
+			at_scene_warn_ignored(path, lineno, "cursor",
+					      at_scene_cursor_ignored,
+					      cursor_ignored);
+		}
+
+		if (plane.motion == AT_MOTION_CIRCLE) {
+			if (isnan(plane.x))
+				plane.x = device->width / 2.0;
+			if (isnan(plane.y))
+				plane.y = device->height / 2.0;
+		} else {
+			if (isnan(plane.x))
+				plane.x = 0;
+			if (isnan(plane.y))
+				plane.y = 0;
+		}
+
+		planes = realloc(scene->planes, (scene->count + 1) * sizeof(*planes));
+		if (!planes)
+			goto err_free;
+
+		scene->planes = planes;
+		scene->planes[scene->count++] = plane;
+		continue;
+
+err_syntax:
+		fprintf(stderr, "%s:%d: invalid entry '%s'\n", path, lineno, token);
+		goto err_free;
+	}
+
+	fclose(file);
+
+	printf("Scene: %u planes (%u overlays) from %s\n", scene->count,
+	       scene->overlay_count, path);
+
+	return 0;
+
+err_free:
+	fclose(file);
+	free(scene->planes);
+	memset(scene, 0, sizeof(*scene));
+
+	return -1;
+}
+
+static void
+at_scene_free(struct at_scene *scene)
+{
+	free(scene->planes);
+	memset(scene, 0, sizeof(*scene));
+}
+
+static const struct at_scene_plane *
+at_scene_overlay(const struct at_scene *scene, uint32_t index)
+{
+	uint32_t i;
+
+	for (i = 0; i < scene->count; i++) {
+		if (scene->planes[i].role == AT_SCENE_OVERLAY &&
+		    scene->planes[i].index == index)
+			return &scene->planes[i];
+	}
+
+	return NULL;
+}
+
+static uint32_t
+at_color_lerp(uint32_t a, uint32_t b, uint32_t t)
+{
+	uint32_t rb = (((a & 0x00FF00FF) * (256 - t) + (b & 0x00FF00FF) * t) >> 8) & 0x00FF00FF;
+	uint32_t ag = ((((a >> 8) & 0x00FF00FF) * (256 - t) +
+		       ((b >> 8) & 0x00FF00FF) * t) >> 8) & 0x00FF00FF;
+
+	return rb | ag << 8;
+}
+
+/* Renders the static content of a plane, pulse is redrawn every frame. */
+static void
+at_scene_render(const struct at_scene_plane *plane, struct at_dumb_buffer *dumb,
+		uint32_t frame)
+{
+	uint32_t x, y;
+	uint32_t pulse;
+
+	switch (plane->content) {
+	case AT_SCENE_SOLID:
+		at_dumb_buffer_fill(dumb, plane->color);
+		break;
+	case AT_SCENE_PULSE:
+		pulse = 0xFF - abs((int)(frame % 510) - 0xFF);
+		at_dumb_buffer_fill(dumb, at_color_lerp(plane->color2, plane->color,
+							pulse));
+		break;
+	case AT_SCENE_CHECKER:
+	case AT_SCENE_GRADIENT:
+		for (y = 0; y < dumb->height; y++) {
+			uint32_t *pixel = (uint32_t *)(dumb->data + y * dumb->pitch);
+
+			for (x = 0; x < dumb->width; x++) {
+				if (plane->content == AT_SCENE_CHECKER)
+					pixel[x] = ((x / plane->cell) ^ (y / plane->cell)) & 1 ?
+						   plane->color2 : plane->color;
+				else
+					pixel[x] = at_color_lerp(plane->color, plane->color2,
+								 x * 256 / dumb->width);
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * The plane showing the cursor: the cursor plane, the spare overlay it was
+ * moved to, or NULL when it's drawn into the primary plane.
+ */
+static struct at_drm_plane *
+at_instance_cursor_plane(struct at_instance *instance)
+{
+	switch (instance->cursor_mode) {
+	case AT_CURSOR_PLANE:
+		return instance->device.cursor_plane;
+	case AT_CURSOR_OVERLAY:
+		return instance->cursor_overlay;
+	default:
+		return NULL;
+	}
+}
+
+/* Cursor rectangle in primary buffer coordinates, clipped to the buffer. */
+static bool
+at_instance_sw_cursor_rect(struct at_instance *instance, struct at_rect *rect)
+{
+	struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+	struct at_rect bounds;
+
+	at_rect_set(&bounds, 0, 0, instance->primary_width, instance->primary_height);
+	at_rect_set(rect,
+		    (int64_t)instance->cursor_x * instance->primary_width /
+		    instance->device.width,
+		    (int64_t)instance->cursor_y * instance->primary_height /
+		    instance->device.height,
+		    cursor->width, cursor->height);
+
+	return at_rect_intersect(rect, rect, &bounds);
+}
+
+/*
+ * Puts back what the software cursor covered when fbs[fb_idx] was drawn,
+ * clipped to the buffer in case it was reallocated smaller since.
+ */
+static void
+at_instance_sw_cursor_restore(struct at_instance *instance, uint32_t fb_idx)
+{
+	struct at_save_under *save = &instance->save_under[fb_idx];
+	struct at_dumb_buffer *dumb = instance->fbs[fb_idx]->dumb;
+	uint32_t width = save->rect.x2 - save->rect.x1;
+	struct at_surface target;
+	struct at_rect bounds, rect;
+	int32_t y;
+
+	at_rect_set(&bounds, 0, 0, dumb->width, dumb->height);
+	if (!at_rect_intersect(&rect, &save->rect, &bounds)) {
+		memset(&save->rect, 0, sizeof(save->rect));
+		return;
+	}
+
+	at_dumb_buffer_surface(dumb, &target);
+
+	for (y = rect.y1; y < rect.y2; y++)
+		memcpy(target.data + y * target.pitch + rect.x1 * 4,
+		       save->pixels + (y - save->rect.y1) * width +
+		       (rect.x1 - save->rect.x1),
+		       (rect.x2 - rect.x1) * 4);
+
+	instance->cursor_bytes += at_rect_area(&rect) * 4;
+	memset(&save->rect, 0, sizeof(save->rect));
+}
+
+/*
+ * Saves what lies under the cursor in fbs[fb_idx] and blends the cursor
+ * image over it. Nothing outside that rectangle is touched, and the
+ * save-under goes back in before the buffer is drawn to again, so the
+ * content underneath never needs re-rendering for the cursor's sake.
+ */
+static void
+at_instance_sw_cursor_draw(struct at_instance *instance, uint32_t fb_idx)
+{
+	struct at_save_under *save = &instance->save_under[fb_idx];
+	struct at_surface target;
+	struct at_rect rect;
+	uint32_t width;
+	int32_t y;
+
+	if (!at_instance_sw_cursor_rect(instance, &rect))
+		return;
+
+	at_dumb_buffer_surface(instance->fbs[fb_idx]->dumb, &target);
+	width = rect.x2 - rect.x1;
+
+	for (y = rect.y1; y < rect.y2; y++)
+		memcpy(save->pixels + (y - rect.y1) * width,
+		       target.data + y * target.pitch + rect.x1 * 4, width * 4);
+
+	at_surface_compose(&target, instance->cursor_fb->dumb, rect.x1, rect.y1,
+			   true);
+
+	save->rect = rect;
+	instance->cursor_bytes += at_rect_area(&rect) * 4;
+}
+
+/*
+ * Switches the cursor strategy without committing anything. The overlay
+ * strategy takes the last overlay plane nobody else uses; the software one
+ * needs a save-under per primary buffer. Leaving the software cursor puts
+ * the save-unders back so no buffer keeps a stale cursor.
+ */
+static int
+at_instance_cursor_prepare(struct at_instance *instance, enum at_cursor_mode mode)
+{
+	struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+	int i;
+
+	if (mode == instance->cursor_mode)
+		return 0;
+
+	if (mode == AT_CURSOR_PLANE && !instance->device.cursor_plane)
+		return -ENODEV;
+
+	if (mode == AT_CURSOR_OVERLAY &&
+	    (!instance->overlays_avail ||
+	     instance->scene.overlay_count >= instance->overlays_avail))
+		return -ENOSPC;
+
+	if (mode == AT_CURSOR_SOFTWARE) {
+		for (i = 0; i < ATOMICTEST_NUM_FBS; i++) {
+			struct at_save_under *save = &instance->save_under[i];
+
+			if (save->pixels)
+				continue;
+			save->pixels = malloc(cursor->width * cursor->height * 4);
+			if (!save->pixels)
+				return -ENOMEM;
+		}
+	}
+
+	if (instance->cursor_mode == AT_CURSOR_SOFTWARE) {
+		for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+			at_instance_sw_cursor_restore(instance, i);
+	} else if (instance->cursor_mode == AT_CURSOR_OVERLAY) {
+		instance->overlays_avail++;
+		instance->cursor_overlay = NULL;
+	}
+
+	if (mode == AT_CURSOR_OVERLAY) {
+		instance->overlays_avail--;
+		instance->cursor_overlay =
+			instance->device.overlay_planes[instance->overlays_avail];
+		instance->num_overlays_use = MIN(instance->num_overlays_use,
+						 instance->overlays_avail);
+	}
+
+	instance->cursor_mode = mode;
+
+	return 0;
+}
+
+static void
+at_instance_reset_damage(struct at_instance *instance)
+{
+	int i;
+
+	/* the buffers are redrawn in full, nothing is left under a cursor */
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++) {
+		at_rect_set(&instance->fb_damage[i], 0, 0,
+			    instance->primary_width, instance->primary_height);
+		instance->fb_presented[i] = 0;
+		memset(&instance->save_under[i].rect, 0,
+		       sizeof(instance->save_under[i].rect));
+	}
+
+	at_rect_set(&instance->shadow_damage, 0, 0,
+		    instance->primary_width, instance->primary_height);
+
+	instance->content_frame = 0;
+}
+
+static void
+at_instance_pace_reset(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+
+	instance->pace_rand = config->seed;
+	instance->pace_fps = (config->pace_min_fps + config->pace_max_fps) / 2;
+	instance->next_submit_ns = 0;
+}
+
+static inline uint32_t
+at_scale(uint32_t size, uint32_t percent)
+{
+	/* even, and never 0 for the smallest scales */
+	return MAX(2, (size * percent / 100) & ~1u);
+}
+
+static int
+at_instance_create_primary_fbs(struct at_instance *instance, uint32_t percent)
+{
+	instance->primary_width = at_scale(instance->device.width, percent);
+	instance->primary_height = at_scale(instance->device.height, percent);
+
+	if (at_dumb_fbs_create(&instance->device, instance->fbs,
+			       ATOMICTEST_NUM_FBS, instance->primary_width,
+			       instance->primary_height, DRM_FORMAT_XRGB8888,
+			       AT_MEM_PRIMARY) < 0) {
+		fprintf(stderr, "Couldn't create dumb buffer.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+at_instance_free_primary_fbs(struct at_instance *instance)
+{
+	int i;
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++) {
+		if (instance->fbs[i])
+			at_dumb_fb_free(&instance->device, instance->fbs[i]);
+		instance->fbs[i] = NULL;
+	}
+}
+
+/*
+ * Listens for DRM uevents. Not having a monitor only means hotplugs go
+ * unnoticed, so failures are not fatal.
+ */
+static int
+at_instance_hotplug_init(struct at_instance *instance)
+{
+	instance->udev = udev_new();
+	if (!instance->udev)
+		return -1;
+
+	instance->udev_monitor = udev_monitor_new_from_netlink(instance->udev, "udev");
+	if (!instance->udev_monitor)
+		goto err_udev;
+
+	udev_monitor_filter_add_match_subsystem_devtype(instance->udev_monitor,
+							"drm", "drm_minor");
+
+	if (udev_monitor_enable_receiving(instance->udev_monitor) < 0)
+		goto err_monitor;
+
+	return 0;
+
+err_monitor:
+	udev_monitor_unref(instance->udev_monitor);
+	instance->udev_monitor = NULL;
+err_udev:
+	udev_unref(instance->udev);
+	instance->udev = NULL;
+
+	return -1;
+}
+
+static void
+at_instance_hotplug_close(struct at_instance *instance)
+{
+	if (instance->udev_monitor)
+		udev_monitor_unref(instance->udev_monitor);
+	if (instance->udev)
+		udev_unref(instance->udev);
+
+	at_samples_free(&instance->hotplug_latency);
+}
+
+/*
+ * Holds the scene's zpos values against the ranges of the planes they
+ * landed on. Planes without a mutable zpos keep the driver's stacking, as
+ * at_scene_set_properties() leaves them alone.
+ */
+static int
+at_scene_check_zpos(struct at_instance *instance)
+{
+	uint32_t i;
+
+	for (i = 0; i < instance->scene.count; i++) {
+		const struct at_scene_plane *plane = &instance->scene.planes[i];
+		struct at_drm_plane *drm_plane;
+
+		if (!plane->has_zpos)
+			continue;
+
+		if (plane->role == AT_SCENE_PRIMARY)
+			drm_plane = instance->device.primary_plane;
+		else if (plane->role == AT_SCENE_CURSOR)
+			drm_plane = at_instance_cursor_plane(instance);
+		else
+			drm_plane = instance->device.overlay_planes[plane->index];
+
+		if (!drm_plane || !drm_plane->has_zpos || !drm_plane->zpos_mutable)
+			continue;
+
+		if (plane->zpos < drm_plane->zpos_min ||
+		    plane->zpos > drm_plane->zpos_max) {
+			fprintf(stderr, "Scene zpos %" PRId64 " of the %s plane is "
+				"outside plane %u's %" PRId64 "..%" PRId64 ".\n",
+				plane->zpos, at_scene_role_names[plane->role],
+				drm_plane->plane_id, drm_plane->zpos_min,
+				drm_plane->zpos_max);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+void
+at_config_init(struct at_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->size = sizeof(*config);
+	config->node = "/dev/dri/card0";
+	config->num_overlays = -1;
+	config->content = AT_CONTENT_FILL;
+	config->video_format = DRM_FORMAT_XRGB8888;
+	config->scale = 100;
+	config->pace_min_fps = 40.0;
+	config->pace_max_fps = 60.0;
+	config->pace_period = 2.0;
+	config->seed = 1;
+	config->sched_priority = 50;
+}
+
+void
+at_options_init(struct at_options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->bench_seconds = 5.0;
+	options->stress_replay = -1;
+	options->soak_window = 60.0;
+	options->soak_alert_pct = 20;
+}
+
+/*
+ * Takes the part of a caller's configuration its header knew about, the
+ * defaults for the rest. Fails for one that didn't go through
+ * at_config_init(). The layout up to change_interval is the first release,
+ * only fields appended after it may be missing.
+ */
+static int
+at_config_copy(struct at_config *dst, const struct at_config *src)
+{
+	if (src->size < offsetof(struct at_config, change_interval) +
+			sizeof(src->change_interval)) {
+		fprintf(stderr, "Configuration not set up with at_config_init().\n");
+		return -EINVAL;
+	}
+
+	at_config_init(dst);
+	memcpy(dst, src, MIN(src->size, sizeof(*dst)));
+	dst->size = sizeof(*dst);
+
+	return 0;
+}
+
+struct at_instance *
+at_instance_create(const struct at_config *config)
+{
+	return at_instance_create_options(config, NULL);
+}
+
+struct at_instance *
+at_instance_create_options(const struct at_config *config,
+			   const struct at_options *options)
+{
+	const char *node = config->node;
+	int j, k, ret;
+	struct at_instance *instance;
+	uint64_t cursor_width, cursor_height;
+	uint64_t reserved = 0;
+	uint32_t scale;
+	uint64_t vrr_capable;
+	uint64_t start;
+
+	instance = malloc(sizeof(*instance));
+	if (!instance)
+		return NULL;
+
+	memset(instance, 0, sizeof(*instance));
+
+	if (at_config_copy(&instance->config, config) < 0) {
+		free(instance);
+		return NULL;
+	}
+	config = &instance->config;
+
+	if (options)
+		instance->options = *options;
+	else
+		at_options_init(&instance->options);
+	options = &instance->options;
+
+	instance->stop = &instance->stop_flag;
+
+	start = at_now_ns();
+	if (at_device_open(&instance->device, node, config->topology_cache) < 0) {
+		fprintf(stderr, "Couldn't initialize %s.\n", node);
+		goto err_open;
+	}
+	instance->probe_ns = at_now_ns() - start;
+
+	instance->device.mem.budget = config->mem_budget;
+
+	drmGetCap(instance->device.fd, DRM_CAP_CURSOR_WIDTH, &cursor_width);
+	drmGetCap(instance->device.fd, DRM_CAP_CURSOR_HEIGHT, &cursor_height);
+
+	instance->cursor_fb = at_dumb_fb_create(&instance->device, cursor_width,
+						cursor_height, DRM_FORMAT_ARGB8888,
+						AT_MEM_CURSOR);
+	if (!instance->cursor_fb) {
+		fprintf(stderr, "Couldn't create the cursor fb.\n");
+		goto err_cursor_buf_create;
+	}
+
+	at_dumb_buffer_fill(instance->cursor_fb->dumb, 0xFFFF0000);
+
+	if (config->scene_path) {
+		if (at_scene_load(&instance->scene, config->scene_path,
+				  &instance->device, &instance->config.content) < 0)
+			goto err_free_cursor;
+
+		if (instance->scene.overlay_count > instance->device.overlays_count) {
+			fprintf(stderr, "Scene needs %u overlays, %s only has %d.\n",
+				instance->scene.overlay_count, node,
+				instance->device.overlays_count);
+			goto err_free_scene;
+		}
+	}
+
+	/*
+	 * The video frames and the writeback captures can't be traded down,
+	 * keep room for the buffers they allocate.
+	 */
+	if (config->video_path)
+		reserved += ATOMICTEST_NUM_FBS *
+			    at_mem_estimate(config->video_width, config->video_height,
+					    config->video_format);
+	if (options->writeback)
+		reserved += ATOMICTEST_WRITEBACK_FBS *
+			    at_mem_estimate(instance->device.width,
+					    instance->device.height,
+					    DRM_FORMAT_XRGB8888);
+
+	/* under a budget, a smaller primary that the plane scales up comes first */
+	scale = config->scale;
+	while (scale > 25 &&
+	       !at_mem_fits(&instance->device,
+			    at_scale(instance->device.width, scale),
+			    at_scale(instance->device.height, scale),
+			    DRM_FORMAT_XRGB8888, ATOMICTEST_NUM_FBS, reserved))
+		scale = MAX(scale - 25, 25);
+
+	if (scale != config->scale) {
+		printf("Scanout budget: primary swapchain at %u%% instead of %u%%\n",
+		       scale, config->scale);
+		instance->config.scale = scale;
+	}
+
+	if (at_instance_create_primary_fbs(instance, scale) < 0)
+		goto err_free_scene;
+
+	instance->overlay_fbs = calloc(instance->device.overlays_count,
+				       sizeof(*instance->overlay_fbs));
+	if (!instance->overlay_fbs)
+		goto err_free_fbs;
+
+	/* then RGB565 overlays, then fewer overlays */
+	for (j = 0; j < instance->device.overlays_count; j++) {
+		const struct at_scene_plane *plane = at_scene_overlay(&instance->scene, j);
+		uint32_t width = plane ? plane->width : 128;
+		uint32_t height = plane ? plane->height : 128;
+		uint32_t format = plane ? plane->format : DRM_FORMAT_XRGB8888;
+
+		if (!plane && !at_mem_fits(&instance->device, width, height, format,
+					   1, reserved))
+			format = DRM_FORMAT_RGB565;
+
+		if (!at_mem_fits(&instance->device, width, height, format, 1, reserved)) {
+			printf("Scanout budget: using %d of %d overlays\n", j,
+			       instance->device.overlays_count);
+			instance->device.overlays_count = j;
+			break;
+		}
+
+		instance->overlay_fbs[j] = at_dumb_fb_create(&instance->device,
+							     width, height, format,
+							     AT_MEM_OVERLAY);
+		if (!instance->overlay_fbs[j]) {
+			fprintf(stderr, "Couldn't create dumb buffer.\n");
+			goto err_free_overlays;
+		}
+
+		if (plane)
+			at_scene_render(plane, instance->overlay_fbs[j]->dumb, 0);
+	}
+
+	if (instance->scene.has_cursor) {
+		for (k = 0; k < instance->scene.count; k++) {
+			if (instance->scene.planes[k].role == AT_SCENE_CURSOR)
+				at_scene_render(&instance->scene.planes[k],
+						instance->cursor_fb->dumb, 0);
+		}
+	}
+
+	instance->overlay_pos = calloc(instance->device.overlays_count,
+				       sizeof(*instance->overlay_pos));
+	if (!instance->overlay_pos)
+		goto err_free_overlays;
+
+	instance->overlay_state = calloc(instance->device.overlays_count,
+					 sizeof(*instance->overlay_state));
+	if (!instance->overlay_state)
+		goto err_free_overlay_pos;
+
+	for (k = 0; k < instance->device.overlays_count; k++)
+		at_plane_state_reset(&instance->overlay_state[k]);
+
+	instance->overlays_avail = instance->device.overlays_count;
+
+	if (config->video_path) {
+		if (config->video_overlay) {
+			if (!instance->overlays_avail) {
+				fprintf(stderr, "No overlay plane left for the video.\n");
+				goto err_free_overlay_pos;
+			}
+			instance->overlays_avail--;
+			instance->video_plane =
+				instance->device.overlay_planes[instance->overlays_avail];
+		}
+
+		instance->video = at_video_open(&instance->device, config);
+		if (!instance->video)
+			goto err_free_overlay_pos;
+	}
+
+	if (config->shadow || options->bench_shadow_frames) {
+		if (at_shadow_init(&instance->arena, &instance->shadow,
+				   instance->device.width,
+				   instance->device.height) < 0) {
+			fprintf(stderr, "Couldn't create the shadow buffer.\n");
+			goto err_free_video;
+		}
+
+		instance->shadow.width = instance->primary_width;
+		instance->shadow.height = instance->primary_height;
+
+		printf("Shadow buffer: %ux%u, pitch %u, %s pages\n",
+		       instance->shadow.width, instance->shadow.height,
+		       instance->shadow.pitch,
+		       instance->arena.hugetlb ? "hugetlb" : "THP");
+	}
+
+	if (options->writeback) {
+		if (config->backend != AT_BACKEND_ATOMIC || options->bench_backends) {
+			fprintf(stderr, "Writeback needs the atomic backend.\n");
+			goto err_free_arena;
+		}
+
+		instance->writeback = at_writeback_open(&instance->device,
+							options->writeback_sink);
+		if (!instance->writeback)
+			goto err_free_arena;
+	}
+
+	instance->num_overlays_use = instance->overlays_avail;
+	if (!instance->device.cursor_plane && config->cursor == AT_CURSOR_PLANE) {
+		printf("No cursor plane, drawing the cursor into the primary plane.\n");
+		ret = at_instance_cursor_prepare(instance, AT_CURSOR_SOFTWARE);
+	} else {
+		ret = at_instance_cursor_prepare(instance, config->cursor);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Can't show the cursor %s: %s\n",
+			config->cursor == AT_CURSOR_OVERLAY ? "on an overlay" :
+			"in software", strerror(-ret));
+		goto err_free_writeback;
+	}
+
+	/* the planes are settled now, the cursor's included */
+	if (at_scene_check_zpos(instance) < 0)
+		goto err_free_save_under;
+
+	if (!config->no_input && at_instance_libinput_init(instance) < 0)
+		goto err_free_save_under;
+
+	if (instance->li && config->input_thread &&
+	    at_instance_set_input_threaded(instance, true) < 0)
+		fprintf(stderr, "Couldn't start the input thread, dispatching input on the main loop.\n");
+
+	if (at_instance_hotplug_init(instance) < 0)
+		fprintf(stderr, "Couldn't create a udev monitor, hotplug won't be handled.\n");
+
+	instance->cur_fb = 0;
+	instance->run = true;
+	instance->flip_pending = false;
+	instance->crtc_changed = false;
+	instance->cursor_x = instance->device.width / 2;
+	instance->cursor_y = instance->device.height / 2;
+	instance->frames = 0;
+	instance->num_overlays_use = instance->overlays_avail;
+	if (config->scene_path)
+		instance->num_overlays_use = MIN(instance->scene.overlay_count,
+						 instance->overlays_avail);
+	instance->overlay_scale = 100;
+	instance->backend = config->backend;
+	instance->vrr_capable =
+		at_drm_properties_get_property(&instance->device.connector->properties,
+					       "vrr_capable", &vrr_capable) == 0 &&
+		vrr_capable &&
+		at_drm_properties_get_property(&instance->device.crtc->properties,
+					       "VRR_ENABLED", NULL) == 0;
+	instance->vrr_enabled = config->vrr && instance->vrr_capable;
+	at_instance_pace_reset(instance);
+	instance->cadence.active = config->target_fps > 0 || config->cadence_count;
+	instance->adaptive.restore_after = ATOMICTEST_ADAPTIVE_RESTORE_WINDOWS;
+	at_instance_reset_damage(instance);
+
+	return instance;
+
+err_free_save_under:
+	for (k = 0; k < ATOMICTEST_NUM_FBS; k++)
+		free(instance->save_under[k].pixels);
+err_free_writeback:
+	if (instance->writeback)
+		at_writeback_close(&instance->device, instance->writeback);
+err_free_arena:
+	at_arena_free(&instance->arena);
+err_free_video:
+	if (instance->video)
+		at_video_close(&instance->device, instance->video);
+err_free_overlay_pos:
+	free(instance->overlay_state);
+	free(instance->overlay_pos);
+err_free_overlays:
+	for (k = 0; k < j; k++)
+		at_dumb_fb_free(&instance->device, instance->overlay_fbs[k]);
+err_free_fbs:
+	at_instance_free_primary_fbs(instance);
+err_free_scene:
+	at_scene_free(&instance->scene);
+err_free_cursor:
+	at_dumb_fb_free(&instance->device, instance->cursor_fb);
+err_cursor_buf_create:
+	at_device_close(&instance->device);
+err_open:
+	free(instance);
+
+	return NULL;
+}
+
+uint64_t
+at_instance_get_frames(struct at_instance *instance)
+{
+	return instance->frames;
+}
+
+void
+at_instance_set_num_overlays_use(struct at_instance *instance, int num)
+{
+	if (num < 0)
+		instance->num_overlays_use = instance->overlays_avail;
+	else
+		instance->num_overlays_use = MIN(num, instance->overlays_avail);
+}
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	/* a slow frame needs this much over the median to be blamed on it */
+	uint64_t floor;
+	const char *cause;
+} at_perf_events[] = {
+	[AT_PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE,
+			     PERF_COUNT_HW_CPU_CYCLES, 100000, NULL },
+	[AT_PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE,
+				   PERF_COUNT_HW_INSTRUCTIONS, 100000,
+				   "more work" },
+	[AT_PERF_LLC_MISSES] = { "LLC misses", PERF_TYPE_HARDWARE,
+				 PERF_COUNT_HW_CACHE_MISSES, 1000,
+				 "cache misses" },
+	[AT_PERF_PAGE_FAULTS] = { "page faults", PERF_TYPE_SOFTWARE,
+				  PERF_COUNT_SW_PAGE_FAULTS, 1, "page faults" },
+	[AT_PERF_CONTEXT_SWITCHES] = { "ctx switches", PERF_TYPE_SOFTWARE,
+				       PERF_COUNT_SW_CONTEXT_SWITCHES, 1,
+				       "context switches" },
+	[AT_PERF_MIGRATIONS] = { "migrations", PERF_TYPE_SOFTWARE,
+				 PERF_COUNT_SW_CPU_MIGRATIONS, 1,
+				 "CPU migration" },
+};
+
+static int
+at_perf_paranoid(void)
+{
+	FILE *f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+	int level = -2;
+
+	if (f) {
+		if (fscanf(f, "%d", &level) != 1)
+			level = -2;
+		fclose(f);
+	}
+
+	return level;
+}
+
+/*
+ * Opens the counters for the calling thread. Where perf_event_paranoid
+ * keeps the kernel out of reach a counter falls back to user space only;
+ * where even that is refused, or there is no PMU as in many VMs, it is
+ * left out. With none left only the timing is reported.
+ */
+static void
+at_perf_open(struct at_perf *perf)
+{
+	struct perf_event_attr attr;
+	int i, fd;
+
+	perf->tried = true;
+	perf->group_fd = -1;
+
+	for (i = 0; i < AT_PERF_COUNT; i++) {
+		perf->fds[i] = -1;
+		perf->index[i] = -1;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = at_perf_events[i].type;
+		attr.config = at_perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP |
+				   PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_hv = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf->group_fd,
+			     PERF_FLAG_FD_CLOEXEC);
+		if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+			attr.exclude_kernel = 1;
+			fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+				     perf->group_fd, PERF_FLAG_FD_CLOEXEC);
+			perf->user_only[i] = fd >= 0;
+		}
+		if (fd < 0) {
+			at_debug("perf: no %s: %s\n", at_perf_events[i].name,
+				 strerror(errno));
+			continue;
+		}
+
+		if (perf->group_fd < 0)
+			perf->group_fd = fd;
+		perf->fds[i] = fd;
+		perf->index[i] = perf->count++;
+	}
+
+	if (!perf->count) {
+		printf("Perf counters unavailable (perf_event_paranoid %d), "
+		       "timing only.\n", at_perf_paranoid());
+		return;
+	}
+
+	printf("Perf counters:");
+	for (i = 0; i < AT_PERF_COUNT; i++) {
+		if (perf->index[i] >= 0)
+			printf(" %s%s", at_perf_events[i].name,
+			       perf->user_only[i] ? " (user)" : "");
+	}
+	if (perf->count < AT_PERF_COUNT) {
+		printf("; unavailable:");
+		for (i = 0; i < AT_PERF_COUNT; i++) {
+			if (perf->index[i] < 0)
+				printf(" %s", at_perf_events[i].name);
+		}
+	}
+	printf("\n");
+}
+
+static void
+at_perf_close(struct at_perf *perf)
+{
+	int i;
+
+	if (!perf->tried)
+		return;
+
+	/* the group leader last */
+	for (i = AT_PERF_COUNT - 1; i >= 0; i--) {
+		if (perf->fds[i] >= 0)
+			close(perf->fds[i]);
+		at_samples_free(&perf->values[i]);
+	}
+}
+
+/* The next flip is a new baseline. */
+static void
+at_perf_reset(struct at_perf *perf)
+{
+	int i;
+
+	perf->have_last = false;
+	perf->outlier_count = 0;
+	for (i = 0; i < AT_PERF_COUNT; i++)
+		at_samples_reset(&perf->values[i]);
+}
+
+/* Keeps the ATOMICTEST_PERF_OUTLIERS slowest intervals, slowest first. */
+static void
+at_perf_outlier(struct at_perf *perf, const struct at_perf_frame *frame)
+{
+	uint32_t i = MIN(perf->outlier_count, ATOMICTEST_PERF_OUTLIERS - 1);
+
+	if (perf->outlier_count == ATOMICTEST_PERF_OUTLIERS &&
+	    frame->interval_ns <= perf->outliers[i].interval_ns)
+		return;
+
+	for (; i > 0 && perf->outliers[i - 1].interval_ns < frame->interval_ns; i--)
+		perf->outliers[i] = perf->outliers[i - 1];
+	perf->outliers[i] = *frame;
+
+	if (perf->outlier_count < ATOMICTEST_PERF_OUTLIERS)
+		perf->outlier_count++;
+}
+
+/*
+ * Reads the counters at a flip and books how far they moved since the
+ * previous one against that frame interval. When the kernel had to
+ * multiplex the group the values are scaled up by enabled/running time.
+ */
+static void
+at_instance_perf_flip(struct at_instance *instance, uint64_t interval_ns,
+		      uint32_t missed)
+{
+	struct at_perf *perf = &instance->perf;
+	uint64_t buf[3 + AT_PERF_COUNT];
+	struct at_perf_frame frame;
+	double scale = 1.0;
+	ssize_t len;
+	int i;
+
+	if (!perf->tried)
+		at_perf_open(perf);
+	if (!perf->count)
+		return;
+
+	len = read(perf->group_fd, buf, sizeof(buf));
+	if (len < (ssize_t)((3 + perf->count) * sizeof(uint64_t)))
+		return;
+
+	if (perf->have_last && interval_ns) {
+		if (buf[2] > perf->last_running)
+			scale = (double)(buf[1] - perf->last_enabled) /
+				(buf[2] - perf->last_running);
+
+		memset(&frame, 0, sizeof(frame));
+		frame.frame = instance->frames;
+		frame.interval_ns = interval_ns;
+		frame.missed = missed;
+
+		for (i = 0; i < AT_PERF_COUNT; i++) {
+			if (perf->index[i] < 0)
+				continue;
+			frame.values[i] = (buf[3 + perf->index[i]] - perf->last[i]) *
+					  scale;
+			at_samples_add(&perf->values[i], frame.values[i]);
+		}
+
+		at_perf_outlier(perf, &frame);
+	}
+
+	for (i = 0; i < AT_PERF_COUNT; i++) {
+		if (perf->index[i] >= 0)
+			perf->last[i] = buf[3 + perf->index[i]];
+	}
+	perf->last_enabled = buf[1];
+	perf->last_running = buf[2];
+	perf->have_last = true;
+}
+
+/*
+ * The counter that stands out most over its median in a slow frame. If
+ * only cycles do, the thread ran slower rather than did more; if not even
+ * cycles do, the time went elsewhere: blocked in the kernel, waiting for
+ * scanout or for other threads.
+ */
+static const char *
+at_perf_cause(struct at_perf *perf, const struct at_perf_frame *frame)
+{
+	const char *cause = NULL;
+	double score, best = 1.0;
+	uint64_t p50;
+	int i;
+
+	for (i = AT_PERF_INSTRUCTIONS; i < AT_PERF_COUNT; i++) {
+		if (perf->index[i] < 0)
+			continue;
+
+		p50 = at_samples_percentile(&perf->values[i], 50);
+		score = ((double)frame->values[i] - p50) /
+			MAX(p50, at_perf_events[i].floor);
+		if (score > best) {
+			best = score;
+			cause = at_perf_events[i].cause;
+		}
+	}
+
+	if (cause)
+		return cause;
+
+	if (perf->index[AT_PERF_CYCLES] < 0)
+		return "unknown";
+
+	p50 = at_samples_percentile(&perf->values[AT_PERF_CYCLES], 50);
+	if (frame->values[AT_PERF_CYCLES] >
+	    2 * MAX(p50, at_perf_events[AT_PERF_CYCLES].floor))
+		return "stalls or CPU frequency";
+
+	return "outside this thread";
+}
+
+static void
+at_instance_print_perf(struct at_instance *instance)
+{
+	struct at_perf *perf = &instance->perf;
+	struct at_samples *cycles = &perf->values[AT_PERF_CYCLES];
+	struct at_samples *instructions = &perf->values[AT_PERF_INSTRUCTIONS];
+	uint32_t i, j;
+
+	if (!perf->count || !perf->outlier_count)
+		return;
+
+	printf("Perf counters per frame interval (event thread):\n");
+	for (i = 0; i < AT_PERF_COUNT; i++) {
+		if (perf->index[i] < 0)
+			continue;
+		printf("  %-18s p50 %12" PRIu64 " p99 %12" PRIu64 " max %12" PRIu64 "\n",
+		       at_perf_events[i].name,
+		       at_samples_percentile(&perf->values[i], 50),
+		       at_samples_percentile(&perf->values[i], 99),
+		       at_samples_percentile(&perf->values[i], 100));
+	}
+	if (perf->index[AT_PERF_CYCLES] >= 0 &&
+	    perf->index[AT_PERF_INSTRUCTIONS] >= 0 && at_samples_mean(cycles) > 0)
+		printf("  %-18s %.2f\n", "instructions/cycle",
+		       at_samples_mean(instructions) / at_samples_mean(cycles));
+
+	printf("Slowest frame intervals:\n");
+	printf("  %8s %9s %6s", "frame", "ms", "missed");
+	for (j = 0; j < AT_PERF_COUNT; j++) {
+		if (perf->index[j] >= 0)
+			printf(" %12s", at_perf_events[j].name);
+	}
+	printf("  likely cause\n");
+
+	for (i = 0; i < perf->outlier_count; i++) {
+		const struct at_perf_frame *frame = &perf->outliers[i];
+
+		printf("  %8" PRIu64 " %9.3f %6u", frame->frame,
+		       frame->interval_ns / 1000000.0, frame->missed);
+		for (j = 0; j < AT_PERF_COUNT; j++) {
+			if (perf->index[j] >= 0)
+				printf(" %12" PRIu64, frame->values[j]);
+		}
+		printf("  %s\n", at_perf_cause(perf, frame));
+	}
+}
+
+int
+at_instance_destroy(struct at_instance *instance)
+{
+	int i;
+
+	/* drops this instance's share of the process-wide memory lock */
+	at_instance_set_realtime(instance, false);
+	at_instance_libinput_close(instance);
+	at_instance_hotplug_close(instance);
+
+	at_arena_free(&instance->arena);
+
+	if (instance->writeback)
+		at_writeback_close(&instance->device, instance->writeback);
+
+	if (instance->video)
+		at_video_close(&instance->device, instance->video);
+
+	at_samples_free(&instance->stats.flip_intervals);
+	at_samples_free(&instance->stats.input_latency);
+	at_samples_free(&instance->stats.tear_lines);
+	at_samples_free(&instance->stats.submit_to_flip);
+	at_samples_free(&instance->stats.pace_error);
+	at_samples_free(&instance->stats.commit_latency);
+	at_samples_free(&instance->cadence.error);
+	at_samples_free(&instance->cadence.judder);
+	at_perf_close(&instance->perf);
+	at_instance_set_on_demand(instance, false);
+	at_samples_free(&instance->idle.wake_latency);
+
+	free(instance->overlay_state);
+	free(instance->overlay_pos);
+
+	for (i = 0; i < instance->device.overlays_count; i++)
+		at_dumb_fb_free(&instance->device, instance->overlay_fbs[i]);
+
+	at_instance_free_primary_fbs(instance);
+
+	at_dumb_fb_free(&instance->device, instance->cursor_fb);
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+		free(instance->save_under[i].pixels);
+
+	at_scene_free(&instance->scene);
+
+	at_device_close(&instance->device);
+}
+
+static void
+at_page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		     unsigned int tv_usec, void *user_data);
+
+static void
+at_sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data);
+
+static int
+at_instance_atomic_commit(struct at_instance *instance, uint32_t fb_idx,
+			  uint32_t flags, void *data);
+
+
+static int
+at_instance_handle_hotplug(struct at_instance *instance);
+
+static void
+at_instance_idle_check(struct at_instance *instance);
+
+static uint64_t
+at_instance_flip_for(struct at_instance *instance, double seconds,
+		     double *elapsed);
+
+static void
+at_instance_udev_handle_event(struct at_instance *instance)
+{
+	struct stat st;
+	struct udev_device *dev;
+	const char *hotplug, *connector;
+
+	dev = udev_monitor_receive_device(instance->udev_monitor);
+	if (!dev)
+		return;
+
+	hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+	connector = udev_device_get_property_value(dev, "CONNECTOR");
+
+	if (!hotplug || strcmp(hotplug, "1") ||
+	    fstat(instance->device.fd, &st) < 0 ||
+	    udev_device_get_devnum(dev) != st.st_rdev)
+		goto out;
+
+	/* events naming a single connector are only interesting if it's ours */
+	if (connector &&
+	    strtoul(connector, NULL, 10) != instance->device.connector->connector_id)
+		goto out;
+
+	instance->hotplug_ns = at_now_ns();
+
+	/* let the flip in flight land first, the flip handler picks it up */
+	if (instance->flip_pending)
+		instance->hotplug_pending = true;
+	else
+		at_instance_handle_hotplug(instance);
+
+out:
+	udev_device_unref(dev);
+}
+
+/* Submits a paced frame once its time has come. */
+static void
+at_instance_pace_check(struct at_instance *instance)
+{
+	if (!instance->next_submit_ns || at_now_ns() < instance->next_submit_ns)
+		return;
+
+	instance->next_submit_ns = 0;
+
+	if (instance->run)
+		at_instance_draw_frame(instance);
+}
+
+int
+at_instance_process_events(struct at_instance *instance)
+{
+	int ret;
+	drmEventContext evctx;
+	struct pollfd pfds[4];
+	struct timespec timeout, *ptimeout = NULL;
+	uint64_t deadline = instance->next_submit_ns;
+
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = 4;
+	evctx.page_flip_handler = at_page_flip_handler;
+	evctx.sequence_handler = at_sequence_handler;
+
+	memset(pfds, 0, sizeof(pfds));
+	pfds[0].fd = instance->device.fd;
+	pfds[0].events = POLLIN;
+
+	pfds[1].fd = instance->input_threaded || instance->input_synthetic ||
+		     !instance->li ? -1 : libinput_get_fd(instance->li);
+	pfds[1].events = POLLIN;
+
+	pfds[2].fd = instance->udev_monitor ?
+		     udev_monitor_get_fd(instance->udev_monitor) : -1;
+	pfds[2].events = POLLIN;
+
+	pfds[3].fd = instance->idle.enabled ? instance->idle.wake_fd : -1;
+	pfds[3].events = POLLIN;
+
+	/* a stopped on-demand loop still has the scene updates to keep */
+	if (instance->idle.since_ns && instance->idle.next_change_ns)
+		deadline = deadline ? MIN(deadline, instance->idle.next_change_ns) :
+			   instance->idle.next_change_ns;
+
+	if (deadline) {
+		uint64_t now = at_now_ns();
+		uint64_t wait = deadline > now ? deadline - now : 0;
+
+		timeout.tv_sec = wait / 1000000000;
+		timeout.tv_nsec = wait % 1000000000;
+		ptimeout = &timeout;
+	}
+
+	ret = ppoll(pfds, 4, ptimeout, NULL);
+
+	if (instance->idle.enabled) {
+		instance->idle.wakeups++;
+		if (instance->idle.since_ns)
+			instance->idle.idle_wakeups++;
+	}
+
+	if (ret < 0)
+		return errno == EINTR ? 0 : ret;
+
+	if (pfds[0].revents & POLLIN) {
+		ret = drmHandleEvent(instance->device.fd, &evctx);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (pfds[1].revents & POLLIN)
+		at_instance_libinput_handle_events(instance);
+
+	if (pfds[2].revents & POLLIN)
+		at_instance_udev_handle_event(instance);
+
+	if (pfds[3].revents & POLLIN) {
+		uint64_t count;
+
+		if (read(instance->idle.wake_fd, &count, sizeof(count)) < 0)
+			at_debug("on demand: %s\n", strerror(errno));
+	}
+
+	at_instance_pace_check(instance);
+	at_instance_idle_check(instance);
+
+	return 0;
+}
+
+int
+at_instance_stop(struct at_instance *instance)
+{
+	instance->run = false;
+	instance->next_submit_ns = 0;
+	while (instance->flip_pending || instance->cadence.queued) {
+		if (at_instance_process_events(instance) < 0)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * The video either replaces the primary plane content, stretched over the
+ * whole CRTC, or sits centered at its native size on the first overlay past
+ * the ones at_instance_set_num_overlays_use() hands out.
+ */
+static void
+at_instance_video_set_plane(struct at_instance *instance, drmModeAtomicReq *req)
+{
+	struct at_device *device = &instance->device;
+	struct at_video *video = instance->video;
+	struct at_dumb_fb *fb = video->fbs[video->cur_fb];
+
+	if (!instance->config.video_overlay) {
+		at_drm_plane_set_properties(req, device->primary_plane,
+					    device->crtc->crtc_id, fb->fb_id,
+					    0, 0,
+					    device->width, device->height,
+					    0, 0,
+					    video->width << 16, video->height << 16);
+		return;
+	}
+
+	at_drm_plane_set_properties(req, instance->video_plane,
+				    device->crtc->crtc_id, fb->fb_id,
+				    ((int32_t)device->width - (int32_t)video->width) / 2,
+				    ((int32_t)device->height - (int32_t)video->height) / 2,
+				    video->width, video->height,
+				    0, 0,
+				    video->width << 16, video->height << 16);
+}
+
+static inline uint32_t
+at_instance_overlays_active(struct at_instance *instance)
+{
+	if (instance->overlays_shed >= instance->num_overlays_use)
+		return 0;
+
+	return instance->num_overlays_use - instance->overlays_shed;
+}
+
+static struct at_drm_plane *
+at_scene_drm_plane(struct at_instance *instance,
+		   const struct at_scene_plane *plane)
+{
+	switch (plane->role) {
+	case AT_SCENE_PRIMARY:
+		return instance->device.primary_plane;
+	case AT_SCENE_CURSOR:
+		return at_instance_cursor_plane(instance);
+	default:
+		if (plane->index >= at_instance_overlays_active(instance))
+			return NULL;
+		return instance->device.overlay_planes[plane->index];
+	}
+}
+
+/*
+ * Adds the scene's zpos and alpha to an atomic request. Planes without the
+ * property, or with an immutable zpos, keep the driver's stacking.
+ */
+static void
+at_scene_set_properties(struct at_instance *instance, drmModeAtomicReq *req)
+{
+	uint32_t i;
+
+	for (i = 0; i < instance->scene.count; i++) {
+		const struct at_scene_plane *plane = &instance->scene.planes[i];
+		struct at_drm_plane *drm_plane = at_scene_drm_plane(instance, plane);
+
+		if (!drm_plane)
+			continue;
+
+		/* the cursor may have moved to a plane with another range */
+		if (plane->has_zpos &&
+		    plane->zpos >= drm_plane->zpos_min &&
+		    plane->zpos <= drm_plane->zpos_max &&
+		    at_drm_properties_writable(&drm_plane->properties, "zpos"))
+			at_drm_properties_add_property(req, drm_plane->plane_id,
+						       &drm_plane->properties,
+						       "zpos", plane->zpos);
+
+		if (plane->has_alpha &&
+		    at_drm_properties_writable(&drm_plane->properties, "alpha"))
+			at_drm_properties_add_property(req, drm_plane->plane_id,
+						       &drm_plane->properties,
+						       "alpha", drm_plane->alpha_max *
+						       plane->alpha / 0xFFFF);
+	}
+}
+
+/*
+ * The reference is only exact when every enabled plane is an unscaled,
+ * opaque XRGB8888 layer in the default stacking order (plus the ARGB
+ * cursor on top); anything else is captured but not verified.
+ */
+static bool
+at_writeback_verifiable(struct at_instance *instance)
+{
+	uint32_t i;
+
+	if (instance->video || instance->async ||
+	    instance->primary_width != instance->device.width ||
+	    instance->primary_height != instance->device.height ||
+	    (at_instance_overlays_active(instance) && instance->overlay_scale != 100))
+		return false;
+
+	for (i = 0; i < instance->scene.count; i++) {
+		if (instance->scene.planes[i].has_alpha ||
+		    instance->scene.planes[i].has_zpos)
+			return false;
+	}
+
+	for (i = 0; i < at_instance_overlays_active(instance); i++) {
+		const struct at_plane_state *state = &instance->overlay_state[i];
+
+		if (instance->overlay_fbs[i]->dumb->format != DRM_FORMAT_XRGB8888 ||
+		    state->set_zpos || state->alpha >= 0 || state->blend >= 0 ||
+		    (state->rotation & ~DRM_MODE_ROTATE_0))
+			return false;
+	}
+
+	return true;
+}
+
+/* Composes what the captured commit put on the planes, see at_writeback_attach(). */
+static void
+at_writeback_render_reference(struct at_instance *instance)
+{
+	struct at_writeback *writeback = instance->writeback;
+	struct at_surface *reference = &writeback->reference;
+	struct at_dumb_buffer *primary =
+		instance->fbs[writeback->committed.fb_idx]->dumb;
+	uint32_t i;
+
+	at_surface_compose(reference, primary, 0, 0, false);
+
+	for (i = 0; i < writeback->committed.overlays; i++) {
+		struct at_dumb_buffer *dumb = instance->overlay_fbs[i]->dumb;
+
+		at_surface_compose(reference, dumb,
+				   instance->device.width / 2 +
+				   writeback->committed.overlay_pos[i].x -
+				   dumb->width / 2,
+				   instance->device.height / 2 +
+				   writeback->committed.overlay_pos[i].y -
+				   dumb->height / 2,
+				   false);
+	}
+
+	if (instance->cursor_mode != AT_CURSOR_SOFTWARE)
+		at_surface_compose(reference, instance->cursor_fb->dumb,
+				   writeback->committed.cursor_x,
+				   writeback->committed.cursor_y, true);
+}
+
+/* FNV-1a over the visible pixels, ignoring the X byte. */
+static uint32_t
+at_surface_checksum(const struct at_surface *surface)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t x, y;
+
+	for (y = 0; y < surface->height; y++) {
+		const uint32_t *row = (const uint32_t *)(surface->data + y * surface->pitch);
+
+		for (x = 0; x < surface->width; x++)
+			hash = (hash ^ (row[x] & 0x00FFFFFF)) * 16777619u;
+	}
+
+	return hash;
+}
+
+static void
+at_writeback_sink(struct at_writeback *writeback, const struct at_surface *frame)
+{
+	uint32_t row_bytes = frame->width * 4;
+	uint32_t y;
+
+	for (y = 0; y < frame->height; y++) {
+		if (write(writeback->sink_fd, frame->data + y * frame->pitch,
+			  row_bytes) != row_bytes) {
+			perror("Writeback sink");
+			close(writeback->sink_fd);
+			writeback->sink_fd = -1;
+			return;
+		}
+	}
+
+	writeback->sink_bytes += (uint64_t)row_bytes * frame->height;
+}
+
+/*
+ * Waits for the outstanding capture and consumes it. It must run before the
+ * next frame touches the planes when verify is set, the reference is built
+ * from the buffers that were committed.
+ */
+static void
+at_writeback_collect(struct at_instance *instance, bool verify)
+{
+	struct at_writeback *writeback = instance->writeback;
+	struct at_surface frame;
+	struct pollfd pfd;
+	uint64_t start, waited, checked;
+
+	if (!writeback || writeback->pending < 0)
+		return;
+
+	start = at_now_ns();
+
+	if (writeback->fence_fd >= 0) {
+		pfd.fd = writeback->fence_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) <= 0)
+			fprintf(stderr, "Writeback fence didn't signal in time.\n");
+		close(writeback->fence_fd);
+		writeback->fence_fd = -1;
+	}
+
+	waited = at_now_ns();
+
+	at_dumb_buffer_surface(writeback->fbs[writeback->pending]->dumb, &frame);
+	writeback->pending = -1;
+	writeback->captured++;
+
+	if (verify && at_writeback_verifiable(instance)) {
+		at_writeback_render_reference(instance);
+
+		if (at_surface_checksum(&frame) == at_surface_checksum(&writeback->reference))
+			writeback->verified++;
+		else
+			writeback->mismatches++;
+	} else {
+		writeback->unverified++;
+	}
+
+	checked = at_now_ns();
+
+	if (writeback->sink_fd >= 0)
+		at_writeback_sink(writeback, &frame);
+
+	writeback->wait_ns += waited - start;
+	writeback->checksum_ns += checked - waited;
+	writeback->write_ns += at_now_ns() - checked;
+}
+
+/*
+ * Routes the writeback connector to the CRTC and asks for this commit to
+ * be written into the next pool buffer. A capture nobody collected (the
+ * blocking modeset commits have no flip event) is consumed unverified.
+ */
+static void
+at_writeback_attach(struct at_instance *instance, drmModeAtomicReq *req,
+		    uint32_t fb_idx, uint32_t flags)
+{
+	struct at_writeback *writeback = instance->writeback;
+	struct at_drm_connector *connector = &writeback->connector;
+	uint32_t i, overlays = at_instance_overlays_active(instance);
+	struct at_dumb_fb *fb;
+
+	at_drm_properties_add_property(req, connector->connector_id,
+				       &connector->properties, "CRTC_ID",
+				       instance->device.crtc->crtc_id);
+
+	writeback->staged = -1;
+
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return;
+
+	at_writeback_collect(instance, false);
+
+	if (at_writeback_alloc_fbs(&instance->device, writeback) < 0) {
+		writeback->skipped++;
+		return;
+	}
+
+	if (!writeback->committed.overlay_pos && instance->device.overlays_count) {
+		writeback->committed.overlay_pos =
+			calloc(instance->device.overlays_count,
+			       sizeof(*writeback->committed.overlay_pos));
+		if (!writeback->committed.overlay_pos) {
+			writeback->skipped++;
+			return;
+		}
+	}
+
+	writeback->committed.fb_idx = fb_idx;
+	writeback->committed.cursor_x = instance->cursor_x;
+	writeback->committed.cursor_y = instance->cursor_y;
+	writeback->committed.overlays = overlays;
+	for (i = 0; i < overlays; i++) {
+		writeback->committed.overlay_pos[i].x = instance->overlay_pos[i].x;
+		writeback->committed.overlay_pos[i].y = instance->overlay_pos[i].y;
+	}
+
+	fb = writeback->fbs[writeback->next];
+	writeback->fence_fd = -1;
+
+	at_drm_properties_add_property(req, connector->connector_id,
+				       &connector->properties, "WRITEBACK_FB_ID",
+				       fb->fb_id);
+	at_drm_properties_add_property(req, connector->connector_id,
+				       &connector->properties,
+				       "WRITEBACK_OUT_FENCE_PTR",
+				       (uint64_t)(uintptr_t)&writeback->fence_fd);
+
+	writeback->staged = writeback->next;
+}
+
+static void
+at_writeback_committed(struct at_writeback *writeback, int ret)
+{
+	if (writeback->staged < 0)
+		return;
+
+	if (!ret) {
+		writeback->pending = writeback->staged;
+		writeback->next = (writeback->next + 1) % ATOMICTEST_WRITEBACK_FBS;
+	}
+
+	writeback->staged = -1;
+}
+
+static void
+at_writeback_reset_stats(struct at_writeback *writeback)
+{
+	writeback->captured = 0;
+	writeback->verified = 0;
+	writeback->mismatches = 0;
+	writeback->unverified = 0;
+	writeback->skipped = 0;
+	writeback->sink_bytes = 0;
+	writeback->wait_ns = 0;
+	writeback->checksum_ns = 0;
+	writeback->write_ns = 0;
+}
+
+static void
+at_writeback_report(struct at_writeback *writeback, double seconds)
+{
+	uint64_t captured = MAX(writeback->captured, 1);
+
+	printf("Writeback: %" PRIu64 " frames captured (%.1f fps), %" PRIu64
+	       " skipped\n",
+	       writeback->captured, writeback->captured / seconds,
+	       writeback->skipped);
+	printf("  %" PRIu64 " verified, %" PRIu64 " mismatches, %" PRIu64
+	       " not verifiable\n",
+	       writeback->verified, writeback->mismatches, writeback->unverified);
+	printf("  per frame: %.1f us fence wait, %.1f us checksum, %.1f us write\n",
+	       writeback->wait_ns / 1000.0 / captured,
+	       writeback->checksum_ns / 1000.0 / captured,
+	       writeback->write_ns / 1000.0 / captured);
+	if (writeback->sink_bytes)
+		printf("  sink: %.1f MB, %.1f MB/s\n",
+		       writeback->sink_bytes / 1e6,
+		       writeback->sink_bytes / 1e6 / seconds);
+}
+
+/* Adds the cursor to an atomic request wherever the strategy puts it. */
+static void
+at_instance_cursor_set_properties(struct at_instance *instance,
+				  drmModeAtomicReq *req)
+{
+	struct at_device *device = &instance->device;
+	struct at_drm_plane *plane = at_instance_cursor_plane(instance);
+	struct at_dumb_fb *fb = instance->cursor_fb;
+	uint32_t width = fb->dumb->width;
+	uint32_t height = fb->dumb->height;
+
+	if (device->cursor_plane && plane != device->cursor_plane)
+		at_drm_plane_set_properties(req, device->cursor_plane,
+					    0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	if (!plane)
+		return;
+
+	if (instance->cursor_hidden) {
+		at_drm_plane_set_properties(req, plane, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		return;
+	}
+
+	at_drm_plane_set_properties(req, plane,
+				    device->crtc->crtc_id, fb->fb_id,
+				    instance->cursor_x, instance->cursor_y,
+				    width, height,
+				    0, 0,
+				    width << 16, height << 16);
+
+	/* an overlay cursor has to stay above the other overlays */
+	if (plane == instance->cursor_overlay && plane->zpos_mutable) {
+		struct at_plane_state top;
+
+		at_plane_state_reset(&top);
+		top.set_zpos = true;
+		top.zpos = plane->zpos_max;
+		at_drm_plane_set_state(req, plane, &top);
+	}
+}
+
+static int
+at_instance_atomic_commit(struct at_instance *instance, uint32_t fb_idx,
+			  uint32_t flags, void *data)
+{
+	int ret, i;
+	drmModeAtomicReq *req;
+	struct at_device *device = &instance->device;
+	struct at_dumb_fb *cur_fb = instance->fbs[fb_idx];
+	uint64_t start;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+
+		if (at_drm_properties_add_property(req, device->connector->connector_id,
+						   &device->connector->properties,
+						   "CRTC_ID", device->crtc->crtc_id) < 0)
+			goto err_free_req;
+
+		if (at_drm_properties_add_property(req, device->crtc->crtc_id,
+						   &device->crtc->properties,
+						   "MODE_ID", device->blob_id) < 0)
+			goto err_free_req;
+
+		if (at_drm_properties_add_property(req, device->crtc->crtc_id,
+						   &device->crtc->properties,
+						   "ACTIVE", 1) < 0)
+			goto err_free_req;
+	}
+
+	if (instance->vrr_capable &&
+	    (instance->vrr_dirty || (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)))
+		at_drm_properties_add_property(req, device->crtc->crtc_id,
+					       &device->crtc->properties,
+					       "VRR_ENABLED", instance->vrr_enabled);
+
+
+	if (!instance->video || instance->config.video_overlay)
+		at_drm_plane_set_properties(req, device->primary_plane,
+					    device->crtc->crtc_id, cur_fb->fb_id,
+					    0, 0,
+					    device->width, device->height,
+					    0, 0,
+					    cur_fb->dumb->width << 16, cur_fb->dumb->height << 16);
+
+	at_instance_cursor_set_properties(instance, req);
+
+	for (i = 0; i < at_instance_overlays_active(instance); i++) {
+		struct at_drm_plane *overlay = instance->device.overlay_planes[i];
+		struct at_dumb_fb *overlay_fb = instance->overlay_fbs[i];
+		uint32_t width = at_scale(overlay_fb->dumb->width, instance->overlay_scale);
+		uint32_t height = at_scale(overlay_fb->dumb->height, instance->overlay_scale);
+		int32_t x = instance->device.width / 2 + instance->overlay_pos[i].x - width / 2;
+		int32_t y = instance->device.height / 2 + instance->overlay_pos[i].y - height / 2;
+
+		at_drm_plane_set_properties(req, overlay,
+					    device->crtc->crtc_id, overlay_fb->fb_id,
+					    x, y,
+					    width, height,
+					    0, 0,
+					    width << 16, height << 16);
+		at_drm_plane_set_state(req, overlay, &instance->overlay_state[i]);
+	}
+
+	for (; i < instance->overlays_avail; i++) {
+		struct at_drm_plane *overlay = instance->device.overlay_planes[i];
+
+		at_drm_plane_set_properties(req, overlay,
+					    0, 0,
+					    0, 0,
+					    0, 0,
+					    0, 0,
+					    0, 0);
+	}
+
+	if (instance->video)
+		at_instance_video_set_plane(instance, req);
+
+	if (instance->scene.count)
+		at_scene_set_properties(instance, req);
+
+	if (instance->writeback)
+		at_writeback_attach(instance, req, fb_idx, flags);
+
+	instance->last_commit_props = drmModeAtomicGetCursor(req);
+	start = at_now_ns();
+	ret = drmModeAtomicCommit(device->fd, req, flags, data);
+	instance->last_commit_ns = at_now_ns() - start;
+	if (instance->writeback)
+		at_writeback_committed(instance->writeback, ret);
+	if (!ret && !(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		instance->vrr_dirty = false;
+
+	drmModeAtomicFree(req);
+
+	return ret;
+
+err_free_req:
+	drmModeAtomicFree(req);
+
+	return -1;
+}
+
+/*
+ * Reallocates the primary swapchain at percent of the mode size and lets the
+ * plane scale it back up to the full CRTC. The new configuration is checked
+ * with TEST_ONLY first; if the display engine has no scaler for it the old
+ * buffers stay in place and -EINVAL (or whatever the kernel said) is returned.
+ * Must be called with no flip pending.
+ */
+static int
+at_instance_set_primary_scale(struct at_instance *instance, uint32_t percent)
+{
+	int i, ret;
+	struct at_dumb_fb *old_fbs[ATOMICTEST_NUM_FBS];
+	uint32_t old_width = instance->primary_width;
+	uint32_t old_height = instance->primary_height;
+
+	memcpy(old_fbs, instance->fbs, sizeof(old_fbs));
+
+	if (at_instance_create_primary_fbs(instance, percent) < 0) {
+		ret = -ENOMEM;
+		goto err_restore;
+	}
+
+	ret = at_instance_atomic_commit(instance, 0, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (!ret)
+		ret = at_instance_atomic_commit(instance, 0, 0, NULL);
+	if (ret) {
+		at_instance_free_primary_fbs(instance);
+		goto err_restore;
+	}
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+		at_dumb_fb_free(&instance->device, old_fbs[i]);
+
+	instance->shadow.width = instance->primary_width;
+	instance->shadow.height = instance->primary_height;
+	instance->cur_fb = 0;
+	at_instance_reset_damage(instance);
+
+	return 0;
+
+err_restore:
+	memcpy(instance->fbs, old_fbs, sizeof(old_fbs));
+	instance->primary_width = old_width;
+	instance->primary_height = old_height;
+
+	return ret;
+}
+
+/*
+ * Presents the same scene as at_instance_atomic_commit() through the pre-atomic
+ * interface: one SetPlane per overlay, MoveCursor for the cursor and a
+ * PageFlip on the primary that carries the completion event. The first
+ * failing call fails the frame like a rejected atomic commit would, though
+ * the planes updated before it stay updated.
+ */
+static int
+at_instance_legacy_commit(struct at_instance *instance, uint32_t fb_idx,
+			  void *data)
+{
+	int ret, i;
+	struct at_device *device = &instance->device;
+	struct at_present_stats *stats = &instance->stats;
+	uint32_t crtc_id = device->crtc->crtc_id;
+	uint32_t active = at_instance_overlays_active(instance);
+
+	if (instance->cursor_mode == AT_CURSOR_PLANE) {
+		ret = drmModeMoveCursor(device->fd, crtc_id, instance->cursor_x,
+					instance->cursor_y);
+		stats->ioctls++;
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < active; i++) {
+		struct at_dumb_fb *overlay_fb = instance->overlay_fbs[i];
+		uint32_t width = at_scale(overlay_fb->dumb->width, instance->overlay_scale);
+		uint32_t height = at_scale(overlay_fb->dumb->height, instance->overlay_scale);
+		int32_t x = device->width / 2 + instance->overlay_pos[i].x - width / 2;
+		int32_t y = device->height / 2 + instance->overlay_pos[i].y - height / 2;
+
+		ret = drmModeSetPlane(device->fd, device->overlay_planes[i]->plane_id,
+				      crtc_id, overlay_fb->fb_id, 0,
+				      x, y, width, height,
+				      0, 0, width << 16, height << 16);
+		stats->ioctls++;
+		if (ret) {
+			/* the ones before are on now, whatever the count was */
+			instance->legacy_overlays_on =
+				MAX(instance->legacy_overlays_on, i);
+			return ret;
+		}
+	}
+
+	/* a failure leaves the count alone, the next frame disables them all */
+	for (; i < instance->legacy_overlays_on; i++) {
+		ret = drmModeSetPlane(device->fd, device->overlay_planes[i]->plane_id,
+				      crtc_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		stats->ioctls++;
+		if (ret)
+			return ret;
+	}
+	instance->legacy_overlays_on = active;
+
+	if (instance->cursor_overlay) {
+		struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+
+		ret = drmModeSetPlane(device->fd, instance->cursor_overlay->plane_id,
+				      crtc_id, instance->cursor_fb->fb_id, 0,
+				      instance->cursor_x, instance->cursor_y,
+				      cursor->width, cursor->height,
+				      0, 0, cursor->width << 16, cursor->height << 16);
+		stats->ioctls++;
+		if (ret)
+			return ret;
+	}
+
+	ret = drmModePageFlip(device->fd, crtc_id, instance->fbs[fb_idx]->fb_id,
+			      DRM_MODE_PAGE_FLIP_EVENT, data);
+	stats->ioctls++;
+
+	return ret;
+}
+
+static int
+at_instance_legacy_modeset(struct at_instance *instance)
+{
+	int ret;
+	struct at_device *device = &instance->device;
+	struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+
+	ret = drmModeSetCrtc(device->fd, device->crtc->crtc_id,
+			     instance->fbs[instance->cur_fb]->fb_id, 0, 0,
+			     &device->connector->connector_id, 1, &device->mode);
+	if (ret < 0)
+		return ret;
+
+	instance->legacy_overlays_on = device->overlays_count;
+
+	if (instance->cursor_mode != AT_CURSOR_PLANE)
+		return 0;
+
+	return drmModeSetCursor(device->fd, device->crtc->crtc_id,
+				cursor->handle, cursor->width, cursor->height);
+}
+
+/*
+ * Switches the presentation path. Must be called with no flip pending. Only
+ * the primary, cursor and overlays are driven by the legacy backend; a video
+ * plane keeps whatever it showed last.
+ */
+static int
+at_instance_set_backend(struct at_instance *instance, enum at_backend backend)
+{
+	int ret = 0;
+
+	if (backend == AT_BACKEND_LEGACY && instance->backend != backend)
+		ret = at_instance_legacy_modeset(instance);
+	else if (backend == AT_BACKEND_ATOMIC && instance->backend != backend)
+		ret = at_instance_atomic_commit(instance, instance->cur_fb,
+						DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+
+	if (!ret)
+		instance->backend = backend;
+
+	return ret;
+}
+
+/*
+ * Tearing flip of the primary plane. Atomic async flips may only change
+ * FB_ID, so nothing else goes into the request.
+ */
+static int
+at_instance_async_commit(struct at_instance *instance, uint32_t fb_idx,
+			 uint32_t flags, void *data)
+{
+	int ret;
+	drmModeAtomicReq *req;
+	struct at_device *device = &instance->device;
+	uint32_t fb_id = instance->fbs[fb_idx]->fb_id;
+
+	if (instance->async == AT_ASYNC_LEGACY)
+		return drmModePageFlip(device->fd, device->crtc->crtc_id, fb_id,
+				       DRM_MODE_PAGE_FLIP_EVENT |
+				       DRM_MODE_PAGE_FLIP_ASYNC, data);
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	ret = at_drm_properties_add_property(req, device->primary_plane->plane_id,
+					     &device->primary_plane->properties,
+					     "FB_ID", fb_id);
+	if (ret >= 0)
+		ret = drmModeAtomicCommit(device->fd, req,
+					  flags | DRM_MODE_PAGE_FLIP_ASYNC, data);
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/*
+ * Switches between vblank synchronized and tearing flips. Prefers atomic
+ * async flips (DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, checked with TEST_ONLY) and
+ * falls back to the legacy async page flip. The cursor moves into the
+ * primary plane while tearing since async commits can't move the cursor
+ * plane. Must be called with no flip pending.
+ */
+static int
+at_instance_set_async(struct at_instance *instance, bool enable)
+{
+	int ret;
+	uint64_t cap = 0;
+	int fd = instance->device.fd;
+
+	if (!enable) {
+		if (instance->async)
+			at_instance_cursor_prepare(instance, instance->async_cursor_mode);
+		instance->async = AT_ASYNC_NONE;
+		return at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+	}
+
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+	if (drmGetCap(fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) < 0)
+		cap = 0;
+#endif
+
+	if (!instance->async)
+		instance->async_cursor_mode = instance->cursor_mode;
+	ret = at_instance_cursor_prepare(instance, AT_CURSOR_SOFTWARE);
+	if (ret < 0)
+		return ret;
+
+	ret = at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+	if (ret < 0)
+		goto err_sw_cursor;
+
+	if (cap) {
+		instance->async = AT_ASYNC_ATOMIC;
+		if (!at_instance_async_commit(instance, instance->cur_fb,
+					      DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			return 0;
+	}
+
+	if (drmGetCap(fd, DRM_CAP_ASYNC_PAGE_FLIP, &cap) == 0 && cap) {
+		instance->async = AT_ASYNC_LEGACY;
+		return 0;
+	}
+
+	ret = -EOPNOTSUPP;
+
+err_sw_cursor:
+	instance->async = AT_ASYNC_NONE;
+	at_instance_cursor_prepare(instance, instance->async_cursor_mode);
+	at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+
+	return ret;
+}
+
+/*
+ * Moves the cursor to the cursor plane, a spare overlay or into the primary
+ * plane. Atomic configurations are checked with TEST_ONLY and the old
+ * strategy is kept if the kernel refuses. Must be called with no flip
+ * pending.
+ */
+static int
+at_instance_set_cursor_mode(struct at_instance *instance,
+			    enum at_cursor_mode mode)
+{
+	struct at_device *device = &instance->device;
+	struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+	enum at_cursor_mode old = instance->cursor_mode;
+	struct at_drm_plane *old_overlay = instance->cursor_overlay;
+	uint32_t overlays_use = instance->num_overlays_use;
+	int ret;
+
+	ret = at_instance_cursor_prepare(instance, mode);
+	if (ret < 0 || mode == old)
+		return ret;
+
+	if (instance->backend == AT_BACKEND_LEGACY) {
+		if (mode == AT_CURSOR_PLANE)
+			ret = drmModeSetCursor(device->fd, device->crtc->crtc_id,
+					       cursor->handle, cursor->width,
+					       cursor->height);
+		else if (old == AT_CURSOR_PLANE)
+			ret = drmModeSetCursor(device->fd, device->crtc->crtc_id,
+					       0, 0, 0);
+		if (!ret && old_overlay) {
+			ret = drmModeSetPlane(device->fd, old_overlay->plane_id,
+					      device->crtc->crtc_id, 0, 0, 0, 0, 0,
+					      0, 0, 0, 0, 0);
+			/* the old overlay still shows it, hide the new one */
+			if (ret && mode == AT_CURSOR_PLANE)
+				drmModeSetCursor(device->fd, device->crtc->crtc_id,
+						 0, 0, 0);
+		}
+	} else {
+		ret = at_instance_atomic_commit(instance, instance->cur_fb,
+						DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+		if (!ret)
+			ret = at_instance_atomic_commit(instance, instance->cur_fb,
+							0, NULL);
+	}
+
+	if (ret) {
+		at_instance_cursor_prepare(instance, old);
+		instance->num_overlays_use = overlays_use;
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Every stress iteration draws its configuration from its own seed, derived
+ * from the run's seed and the iteration number, so any single one can be
+ * regenerated without replaying the ones before it.
+ */
+static uint32_t
+at_stress_seed(uint32_t seed, uint64_t iteration)
+{
+	uint32_t x = seed + (uint32_t)iteration * 0x9E3779B9u;
+
+	x ^= x >> 16;
+	x *= 0x85EBCA6Bu;
+	x ^= x >> 13;
+	x *= 0xC2B2AE35u;
+	x ^= x >> 16;
+
+	return x;
+}
+
+static int32_t
+at_stress_offset(uint32_t *state, uint32_t span, uint32_t size)
+{
+	int32_t range = span > size ? (span - size) / 2 : 0;
+
+	return range ? (int32_t)(rand_r(state) % (2 * range + 1)) - range : 0;
+}
+
+/*
+ * Randomizes what at_instance_atomic_commit() puts in the request: which
+ * primary buffer, how many overlays, their size, position and alpha, and
+ * whether and where the cursor shows. Everything stays on screen, but KMS
+ * doesn't expose scaling limits, so a rejection may be the driver refusing
+ * an overlay scale as much as a plane combination. Returns the number of
+ * planes enabled.
+ */
+static uint32_t
+at_stress_generate(struct at_instance *instance, uint32_t seed,
+		   uint32_t *fb_idx)
+{
+	static const uint32_t scales[] = { 100, 75, 50, 25 };
+	struct at_device *device = &instance->device;
+	struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+	uint32_t state = seed;
+	uint32_t i, planes = 1;
+
+	*fb_idx = rand_r(&state) % ATOMICTEST_NUM_FBS;
+
+	instance->num_overlays_use = rand_r(&state) % (instance->overlays_avail + 1);
+	instance->overlays_shed = 0;
+	instance->overlay_scale = scales[rand_r(&state) % (sizeof(scales) / sizeof(scales[0]))];
+
+	for (i = 0; i < instance->num_overlays_use; i++) {
+		struct at_dumb_buffer *dumb = instance->overlay_fbs[i]->dumb;
+
+		instance->overlay_pos[i].x =
+			at_stress_offset(&state, device->width,
+					 at_scale(dumb->width, instance->overlay_scale));
+		instance->overlay_pos[i].y =
+			at_stress_offset(&state, device->height,
+					 at_scale(dumb->height, instance->overlay_scale));
+		instance->overlay_state[i].alpha =
+			device->overlay_planes[i]->has_alpha && rand_r(&state) % 2 ?
+			(int32_t)(rand_r(&state) % 101) : -1;
+	}
+	planes += instance->num_overlays_use;
+
+	instance->cursor_hidden = rand_r(&state) % 4 == 0;
+	instance->cursor_x = rand_r(&state) % MAX(1, (int)device->width - (int)cursor->width);
+	instance->cursor_y = rand_r(&state) % MAX(1, (int)device->height - (int)cursor->height);
+	if (!instance->cursor_hidden && at_instance_cursor_plane(instance))
+		planes++;
+
+	return planes;
+}
+
+static void
+at_stress_describe(struct at_instance *instance, uint32_t fb_idx)
+{
+	uint32_t i;
+
+	printf("  primary fb %u, cursor %s at %d,%d, %u overlays at %u%%\n",
+	       fb_idx, instance->cursor_hidden ? "off" : "on",
+	       instance->cursor_x, instance->cursor_y,
+	       instance->num_overlays_use, instance->overlay_scale);
+
+	for (i = 0; i < instance->num_overlays_use; i++)
+		printf("  overlay %u: plane %u, offset %d,%d, alpha %d%%\n", i,
+		       instance->device.overlay_planes[i]->plane_id,
+		       instance->overlay_pos[i].x, instance->overlay_pos[i].y,
+		       instance->overlay_state[i].alpha);
+}
+
+struct at_stress_group {
+	struct at_histogram latency;
+	uint64_t commits;
+	uint64_t rejected;
+	uint64_t props;
+};
+
+/*
+ * TEST_ONLY commits of random valid configurations, back to back, grouped
+ * by how many planes they enable. Latency is the ioctl alone; the rate also
+ * includes building the request. With options.stress_replay set only that
+ * iteration is regenerated, described and timed.
+ */
+static void
+at_instance_bench_commit(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+	const struct at_options *options = &instance->options;
+	uint32_t seed = options->seed_set ? config->seed :
+			(uint32_t)at_now_ns() ^ (uint32_t)getpid();
+	uint32_t ngroups = instance->overlays_avail + 3;
+	struct at_stress_group *groups;
+	struct at_plane_state *states;
+	uint32_t overlays_use = instance->num_overlays_use;
+	uint32_t overlays_shed = instance->overlays_shed;
+	uint32_t overlay_scale = instance->overlay_scale;
+	int cursor_x = instance->cursor_x, cursor_y = instance->cursor_y;
+	uint64_t iteration, commits = 0, rejected = 0, failures = 0;
+	uint64_t slowest = 0, slowest_ns = 0, start, end, elapsed;
+	uint32_t i, fb_idx, planes;
+	int ret;
+
+	if (options->stress_replay >= 0 && !options->seed_set) {
+		fprintf(stderr, "--stress-replay needs the --seed of the run.\n");
+		return;
+	}
+
+	states = calloc(MAX(instance->device.overlays_count, 1), sizeof(*states));
+	if (!states)
+		return;
+	memcpy(states, instance->overlay_state,
+	       instance->device.overlays_count * sizeof(*states));
+
+	printf("\nStress seed %u (--seed=%u --stress-replay=N regenerates iteration N)\n",
+	       seed, seed);
+
+	if (options->stress_replay >= 0) {
+		struct at_histogram latency;
+
+		memset(&latency, 0, sizeof(latency));
+		at_stress_generate(instance,
+				   at_stress_seed(seed, options->stress_replay),
+				   &fb_idx);
+		printf("Iteration %" PRId64 ":\n", options->stress_replay);
+		at_stress_describe(instance, fb_idx);
+
+		for (i = 0; i < 100; i++) {
+			ret = at_instance_atomic_commit(instance, fb_idx,
+							DRM_MODE_ATOMIC_TEST_ONLY,
+							NULL);
+			at_histogram_add(&latency, instance->last_commit_ns);
+		}
+		printf("  %s, %u properties, p50 %.1f us, max %.1f us over 100 tries\n",
+		       ret ? strerror(-ret) : "accepted",
+		       instance->last_commit_props,
+		       at_histogram_percentile(&latency, 50) / 1000.0,
+		       latency.max / 1000.0);
+		goto out_restore;
+	}
+
+	groups = calloc(ngroups, sizeof(*groups));
+	if (!groups)
+		goto out_restore;
+
+	start = at_now_ns();
+	end = start + options->bench_seconds * 1000000000.0;
+
+	for (iteration = 0; !at_instance_interrupted(instance); iteration++) {
+		struct at_stress_group *group;
+
+		if (!(iteration & 63) && at_now_ns() >= end)
+			break;
+
+		planes = at_stress_generate(instance, at_stress_seed(seed, iteration),
+					    &fb_idx);
+		group = &groups[MIN(planes, ngroups - 1)];
+
+		ret = at_instance_atomic_commit(instance, fb_idx,
+						DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+
+		at_histogram_add(&group->latency, instance->last_commit_ns);
+		group->commits++;
+		group->props += instance->last_commit_props;
+		commits++;
+
+		if (instance->last_commit_ns > slowest_ns) {
+			slowest_ns = instance->last_commit_ns;
+			slowest = iteration;
+		}
+
+		if (ret) {
+			group->rejected++;
+			rejected++;
+			if (failures++ < 8)
+				printf("  iteration %" PRIu64 " rejected: %s\n",
+				       iteration, strerror(-ret));
+		}
+	}
+
+	elapsed = at_now_ns() - start;
+
+	printf("\n%6s %7s %10s %9s %9s %9s %9s\n", "planes", "props",
+	       "commits", "rejected", "p50 us", "p99 us", "max us");
+
+	for (i = 0; i < ngroups; i++) {
+		struct at_stress_group *group = &groups[i];
+
+		if (!group->commits)
+			continue;
+
+		printf("%6u %7.1f %10" PRIu64 " %8.2f%% %9.1f %9.1f %9.1f\n", i,
+		       (double)group->props / group->commits, group->commits,
+		       100.0 * group->rejected / group->commits,
+		       at_histogram_percentile(&group->latency, 50) / 1000.0,
+		       at_histogram_percentile(&group->latency, 99) / 1000.0,
+		       group->latency.max / 1000.0);
+	}
+
+	printf("\n%" PRIu64 " commits, %.0f/s, %.2f%% rejected; slowest: iteration %"
+	       PRIu64 ", %.1f us\n", commits,
+	       elapsed ? commits * 1000000000.0 / elapsed : 0.0,
+	       commits ? 100.0 * rejected / commits : 0.0,
+	       slowest, slowest_ns / 1000.0);
+
+	free(groups);
+
+out_restore:
+	memcpy(instance->overlay_state, states,
+	       instance->device.overlays_count * sizeof(*states));
+	free(states);
+	instance->num_overlays_use = overlays_use;
+	instance->overlays_shed = overlays_shed;
+	instance->overlay_scale = overlay_scale;
+	instance->cursor_x = cursor_x;
+	instance->cursor_y = cursor_y;
+	instance->cursor_hidden = false;
+}
+
+/*
+ * Stands in for a 1000 Hz mouse moving in fast circles: motion is published
+ * through the input slot exactly like libinput motion, so cursor latency
+ * can be measured without anybody at the desk.
+ */
+struct at_motion {
+	struct at_instance *instance;
+	pthread_t thread;
+	int stop_fd;
+};
+
+static void *
+at_motion_thread(void *data)
+{
+	struct at_motion *motion = data;
+	struct at_input_slot *slot = &motion->instance->input;
+	struct pollfd pfd = { .fd = motion->stop_fd, .events = POLLIN };
+	/* two turns a second on a 300 pixel radius, close to 4000 pixels/s */
+	double step = 2 * M_PI * 2 / 1000, angle = 0;
+	int ret;
+
+	for (;;) {
+		ret = poll(&pfd, 1, 1);
+		if (ret > 0 || (ret < 0 && errno != EINTR))
+			break;
+
+		angle += step;
+
+		at_input_write_begin(slot);
+		if (slot->events == __atomic_load_n(&slot->taken, __ATOMIC_RELAXED))
+			slot->pending_ns = at_now_ns();
+		slot->total_dx += -sin(angle) * 300 * step;
+		slot->total_dy += cos(angle) * 300 * step;
+		slot->events++;
+		at_input_write_end(slot);
+	}
+
+	return NULL;
+}
+
+/*
+ * Flips with synthetic fast motion under each cursor strategy and reports
+ * the main thread's CPU time per frame, the bytes the cursor costs in
+ * scanout memory per frame and motion to flip latency. libinput is kept
+ * out of the way meanwhile, the slot only takes one writer.
+ */
+static void
+at_instance_bench_cursor(struct at_instance *instance)
+{
+	enum at_cursor_mode saved = instance->cursor_mode;
+	bool threaded = instance->input_threaded;
+	struct at_motion motion = { .instance = instance };
+	uint64_t one = 1;
+	int mode;
+
+	at_instance_set_input_threaded(instance, false);
+	instance->input_synthetic = true;
+
+	printf("\n%-9s %9s %12s %12s %10s %10s\n", "cursor", "fps", "cpu us/fr",
+	       "bytes/fr", "lat p50", "lat p99");
+
+	for (mode = 0; mode < AT_CURSOR_COUNT &&
+	     !at_instance_interrupted(instance); mode++) {
+		struct at_present_stats *stats = &instance->stats;
+		uint64_t frames, cpu_ns, bytes;
+		double elapsed;
+		int ret;
+
+		ret = at_instance_set_cursor_mode(instance, mode);
+		if (ret < 0) {
+			printf("%-9s   (%s)\n", at_cursor_mode_names[mode],
+			       strerror(-ret));
+			continue;
+		}
+
+		motion.stop_fd = eventfd(0, EFD_CLOEXEC);
+		if (motion.stop_fd < 0 ||
+		    pthread_create(&motion.thread, NULL, at_motion_thread, &motion)) {
+			printf("%-9s   (couldn't start the motion thread)\n",
+			       at_cursor_mode_names[mode]);
+			if (motion.stop_fd >= 0)
+				close(motion.stop_fd);
+			continue;
+		}
+
+		at_instance_reset_stats(instance);
+		bytes = instance->cursor_bytes;
+		cpu_ns = at_thread_cpu_ns();
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+		cpu_ns = at_thread_cpu_ns() - cpu_ns;
+		bytes = instance->cursor_bytes - bytes;
+
+		if (write(motion.stop_fd, &one, sizeof(one)) == sizeof(one))
+			pthread_join(motion.thread, NULL);
+		close(motion.stop_fd);
+
+		printf("%-9s %9.2f %12.1f %12" PRIu64 " %8.3fms %8.3fms\n",
+		       at_cursor_mode_names[mode], frames / elapsed,
+		       frames ? cpu_ns / 1000.0 / frames : 0.0,
+		       frames ? bytes / frames : 0,
+		       at_samples_percentile(&stats->input_latency, 50) / 1000000.0,
+		       at_samples_percentile(&stats->input_latency, 99) / 1000000.0);
+	}
+
+	instance->input_synthetic = false;
+	at_instance_set_cursor_mode(instance, saved);
+	at_instance_set_input_threaded(instance, threaded);
+}
+
+static int
+at_instance_present(struct at_instance *instance, uint32_t fb_idx)
+{
+	int ret;
+	uint64_t start = at_thread_cpu_ns();
+	uint64_t wall = at_now_ns();
+
+	if (instance->async) {
+		ret = at_instance_async_commit(instance, fb_idx,
+					       DRM_MODE_ATOMIC_NONBLOCK |
+					       DRM_MODE_PAGE_FLIP_EVENT,
+					       instance);
+		instance->stats.ioctls++;
+	} else if (instance->backend == AT_BACKEND_LEGACY) {
+		ret = at_instance_legacy_commit(instance, fb_idx, instance);
+	} else {
+		ret = at_instance_atomic_commit(instance, fb_idx,
+						DRM_MODE_ATOMIC_NONBLOCK |
+						DRM_MODE_PAGE_FLIP_EVENT,
+						instance);
+		instance->stats.ioctls++;
+	}
+
+	wall = at_now_ns() - wall;
+	instance->stats.cpu_ns += at_thread_cpu_ns() - start;
+	instance->stats.presents++;
+	at_samples_add(&instance->stats.commit_latency, wall);
+
+	if (instance->soak)
+		at_histogram_add(&instance->soak->commit, wall);
+
+	return ret;
+}
+
+/* The next flip starts the cadence afresh. */
+static void
+at_instance_cadence_reset(struct at_instance *instance)
+{
+	struct at_cadence *cadence = &instance->cadence;
+
+	cadence->frame = 0;
+	cadence->last_seq = 0;
+	cadence->target_seq = 0;
+	cadence->frames = 0;
+	cadence->on_cadence = 0;
+	cadence->late = 0;
+	memset(cadence->intervals, 0, sizeof(cadence->intervals));
+	at_samples_reset(&cadence->error);
+	at_samples_reset(&cadence->judder);
+}
+
+/* A stop in progress is booked from now on. */
+static void
+at_instance_idle_reset(struct at_instance *instance)
+{
+	struct at_idle *idle = &instance->idle;
+
+	idle->stops = 0;
+	idle->idle_ns = 0;
+	idle->idle_cpu_ns = 0;
+	idle->scene_frames = 0;
+	idle->cursor_frames = 0;
+	idle->wakeups = 0;
+	idle->idle_wakeups = 0;
+	idle->switches = at_process_switches();
+	idle->change_ns = 0;
+	at_samples_reset(&idle->wake_latency);
+
+	if (idle->since_ns) {
+		idle->since_ns = at_now_ns();
+		idle->since_cpu_ns = at_process_cpu_ns();
+	}
+}
+
+void
+at_instance_reset_stats(struct at_instance *instance)
+{
+	struct at_present_stats *stats = &instance->stats;
+
+	stats->presents = 0;
+	stats->ioctls = 0;
+	stats->cpu_ns = 0;
+	stats->last_flip_ns = 0;
+	at_samples_reset(&stats->flip_intervals);
+	at_samples_reset(&stats->input_latency);
+	at_samples_reset(&stats->tear_lines);
+	at_samples_reset(&stats->submit_to_flip);
+	at_samples_reset(&stats->pace_error);
+	at_samples_reset(&stats->commit_latency);
+	stats->submit_ns = 0;
+	stats->last_submit_ns = 0;
+	stats->input_events = 0;
+	stats->input_frames = 0;
+	stats->input_max_per_frame = 0;
+	instance->missed_vblanks = 0;
+	at_instance_cadence_reset(instance);
+	at_perf_reset(&instance->perf);
+	at_instance_idle_reset(instance);
+
+	if (instance->writeback)
+		at_writeback_reset_stats(instance->writeback);
+
+	drmCrtcGetSequence(instance->device.fd, instance->device.crtc->crtc_id,
+			   NULL, &stats->vblank_ref_ns);
+}
+
+/*
+ * Adaptive sync needs both the connector to advertise vrr_capable and the
+ * CRTC to expose VRR_ENABLED. The change goes out with the next commit, or
+ * right away if no flip is in flight.
+ */
+static int
+at_instance_set_vrr(struct at_instance *instance, bool enable)
+{
+	if (enable && !instance->vrr_capable)
+		return -EOPNOTSUPP;
+
+	instance->vrr_enabled = enable;
+	instance->vrr_dirty = true;
+
+	if (instance->flip_pending || !instance->crtc_changed)
+		return 0;
+
+	return at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+}
+
+/*
+ * Time between the previous submission and the next one for the scripted
+ * pattern: a sine between the two rates, or a bounded random walk that moves
+ * by up to 5% of the range per frame.
+ */
+static uint64_t
+at_instance_pace_interval(struct at_instance *instance, uint64_t now)
+{
+	const struct at_config *config = &instance->config;
+	double mid = (config->pace_min_fps + config->pace_max_fps) / 2;
+	double amp = (config->pace_max_fps - config->pace_min_fps) / 2;
+
+	if (config->pace == AT_PACE_SINE) {
+		instance->pace_fps = mid + amp *
+			sin(2 * M_PI * (now / 1000000000.0) / config->pace_period);
+	} else {
+		double step = (rand_r(&instance->pace_rand) / (double)RAND_MAX - 0.5) *
+			      amp * 0.2;
+
+		instance->pace_fps = instance->pace_fps + step;
+		if (instance->pace_fps < config->pace_min_fps)
+			instance->pace_fps = config->pace_min_fps;
+		if (instance->pace_fps > config->pace_max_fps)
+			instance->pace_fps = config->pace_max_fps;
+	}
+
+	return 1000000000.0 / instance->pace_fps;
+}
+
+/*
+ * Called when a flip completes: instead of rendering the next frame right
+ * away, hold it back as if rendering took as long as the pattern says.
+ */
+static void
+at_instance_pace_schedule(struct at_instance *instance)
+{
+	uint64_t now = at_now_ns();
+	uint64_t last = instance->stats.submit_ns ? instance->stats.submit_ns : now;
+
+	instance->next_submit_ns = MAX(now, last + at_instance_pace_interval(instance, now));
+}
+
+/*
+ * Switches the CRTC to mode with a full modeset. The primary swapchain (and
+ * shadow) is only reallocated when the size changes, and the old buffers stay
+ * on screen until the new configuration has been committed. Must be called
+ * with no flip pending.
+ */
+static int
+at_instance_apply_mode(struct at_instance *instance, const drmModeModeInfo *mode)
+{
+	int i, ret;
+	uint64_t start;
+	struct at_device *device = &instance->device;
+	struct at_dumb_fb *old_fbs[ATOMICTEST_NUM_FBS] = { NULL };
+	drmModeModeInfo old_mode = device->mode;
+	uint32_t old_width = instance->primary_width;
+	uint32_t old_height = instance->primary_height;
+	bool resize = mode->hdisplay != device->width ||
+		      mode->vdisplay != device->height;
+
+	if (at_device_set_mode(device, mode) < 0)
+		return -ENOMEM;
+
+	if (resize) {
+		memcpy(old_fbs, instance->fbs, sizeof(old_fbs));
+
+		if (at_instance_create_primary_fbs(instance, instance->config.scale) < 0) {
+			ret = -ENOMEM;
+			goto err_restore;
+		}
+
+		instance->cur_fb = 0;
+	}
+
+	at_instance_reset_damage(instance);
+
+	start = at_now_ns();
+	if (instance->backend == AT_BACKEND_LEGACY)
+		ret = at_instance_legacy_modeset(instance);
+	else
+		ret = at_instance_atomic_commit(instance, instance->cur_fb,
+						DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	instance->modeset_ns = at_now_ns() - start;
+	if (ret < 0) {
+		if (resize)
+			at_instance_free_primary_fbs(instance);
+		goto err_restore;
+	}
+
+	if (!resize)
+		return 0;
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+		at_dumb_fb_free(device, old_fbs[i]);
+
+	if (instance->arena.base) {
+		size_t size = (size_t)ALIGN(device->width * 4, ATOMICTEST_CACHELINE) *
+			      device->height;
+
+		if (size > instance->arena.size) {
+			at_arena_free(&instance->arena);
+			if (at_shadow_init(&instance->arena, &instance->shadow,
+					   device->width, device->height) < 0) {
+				fprintf(stderr, "Couldn't resize the shadow buffer.\n");
+				instance->config.shadow = false;
+			}
+		}
+
+		instance->shadow.width = instance->primary_width;
+		instance->shadow.height = instance->primary_height;
+	}
+
+	instance->cursor_x = MIN(instance->cursor_x, device->width - 1);
+	instance->cursor_y = MIN(instance->cursor_y, device->height - 1);
+
+	return 0;
+
+err_restore:
+	at_device_set_mode(device, &old_mode);
+	if (resize) {
+		memcpy(instance->fbs, old_fbs, sizeof(old_fbs));
+		instance->primary_width = old_width;
+		instance->primary_height = old_height;
+	}
+	at_instance_reset_damage(instance);
+
+	return ret;
+}
+
+/*
+ * Brings the output in line with the connector after a hotplug: stops
+ * presenting when it went away, and modesets (reusing the swapchain when the
+ * size didn't change) when it's back or its mode changed. Must be called with
+ * no flip pending.
+ */
+static int
+at_instance_handle_hotplug(struct at_instance *instance)
+{
+	int ret;
+	bool connected;
+	drmModeModeInfo mode;
+	struct at_device *device = &instance->device;
+
+	instance->hotplug_pending = false;
+
+	ret = at_device_probe_connector(device, &connected, &mode);
+	if (ret < 0)
+		return ret;
+
+	if (!connected) {
+		if (!instance->output_lost)
+			printf("Hotplug: connector %u disconnected, pausing\n",
+			       device->connector->connector_id);
+		instance->output_lost = true;
+		instance->hotplug_ns = 0;
+		return 0;
+	}
+
+	if (!instance->output_lost &&
+	    !memcmp(&mode, &device->mode, sizeof(mode))) {
+		instance->hotplug_ns = 0;
+		return 0;
+	}
+
+	printf("Hotplug: connector %u %s, mode %s (%ux%u@%u)\n",
+	       device->connector->connector_id,
+	       instance->output_lost ? "reconnected" : "changed",
+	       mode.name, mode.hdisplay, mode.vdisplay, mode.vrefresh);
+
+	ret = at_instance_apply_mode(instance, &mode);
+	if (ret < 0) {
+		fprintf(stderr, "Hotplug: modeset failed: %s\n", strerror(-ret));
+		instance->output_lost = true;
+		return ret;
+	}
+
+	instance->output_lost = false;
+
+	/* restart the flip chain, the first flip closes the hotplug timing */
+	if (instance->run && !instance->flip_pending)
+		at_instance_draw_frame(instance);
+
+	return 0;
+}
+
+int
+at_instance_modeset_apply(struct at_instance *instance)
+{
+	uint64_t start = at_now_ns();
+	int ret;
+
+	if (instance->config.scale != 100 &&
+	    at_instance_atomic_commit(instance, 0, DRM_MODE_ATOMIC_TEST_ONLY |
+				      DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) < 0) {
+		fprintf(stderr, "Primary plane scaling from %ux%u is not supported.\n",
+			instance->primary_width, instance->primary_height);
+		return -EINVAL;
+	}
+
+	if (instance->backend == AT_BACKEND_LEGACY)
+		ret = at_instance_legacy_modeset(instance);
+	else
+		ret = at_instance_atomic_commit(instance, 0,
+						DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (ret < 0) {
+		fprintf(stderr, "Error setting CRTC.\n");
+		return ret;
+	}
+
+	instance->crtc_changed = true;
+
+	if (!instance->first_flip_seen) {
+		instance->setup_done_ns = at_now_ns();
+		instance->setup_modeset_ns = instance->setup_done_ns - start;
+	}
+
+	if (instance->config.vrr && !instance->vrr_capable)
+		printf("Variable refresh is not available, running at fixed refresh.\n");
+
+	return ret;
+}
+
+int
+at_instance_modeset_save(struct at_instance *instance)
+{
+	return at_device_modeset_save(&instance->device);
+}
+
+int
+at_instance_modeset_restore(struct at_instance *instance)
+{
+	return at_device_modeset_restore(&instance->device, instance->crtc_changed);
+}
+
+static const uint32_t at_adaptive_overlay_scales[] = { 100, 75, 50 };
+#define AT_ADAPTIVE_SCALE_STEPS \
+	(sizeof(at_adaptive_overlay_scales) / sizeof(at_adaptive_overlay_scales[0]))
+
+static uint32_t
+at_adaptive_max_level(struct at_instance *instance)
+{
+	return AT_ADAPTIVE_SCALE_STEPS - 1 + instance->num_overlays_use;
+}
+
+static void
+at_adaptive_set_level(struct at_instance *instance, uint32_t level)
+{
+	level = MIN(level, at_adaptive_max_level(instance));
+
+	if (level < AT_ADAPTIVE_SCALE_STEPS) {
+		instance->overlay_scale = at_adaptive_overlay_scales[level];
+		instance->overlays_shed = 0;
+	} else {
+		instance->overlay_scale =
+			at_adaptive_overlay_scales[AT_ADAPTIVE_SCALE_STEPS - 1];
+		instance->overlays_shed = level - (AT_ADAPTIVE_SCALE_STEPS - 1);
+	}
+
+	instance->adaptive.level = level;
+}
+
+static void
+at_adaptive_change(struct at_instance *instance, int delta, const char *why)
+{
+	struct at_adaptive *adaptive = &instance->adaptive;
+	uint32_t old_active = at_instance_overlays_active(instance);
+	uint32_t old_scale = instance->overlay_scale;
+	uint32_t level = adaptive->level;
+
+	if (delta < 0 && level == 0)
+		return;
+	if (delta > 0 && level >= at_adaptive_max_level(instance))
+		return;
+
+	at_adaptive_set_level(instance, level + delta);
+
+	if (delta > 0)
+		adaptive->degrades++;
+	else
+		adaptive->restores++;
+
+	printf("[adaptive frame %8" PRIu64 "] %s: %s, level %u -> %u, "
+	       "overlays %u -> %u, area %u%% -> %u%%\n",
+	       instance->frames, delta > 0 ? "degrade" : "restore", why, level, adaptive->level,
+	       old_active, at_instance_overlays_active(instance),
+	       old_scale * old_scale / 100,
+	       instance->overlay_scale * instance->overlay_scale / 100);
+}
+
+/*
+ * Feeds one presented frame (or one rejected commit) to the controller.
+ *
+ * Decisions are taken once per window of ATOMICTEST_ADAPTIVE_WINDOW frames:
+ * more than ATOMICTEST_ADAPTIVE_MAX_MISSES missed vblanks degrade by one
+ * level, and restore_after clean windows in a row bring one level back. If a
+ * restore is immediately followed by misses we're flapping at the edge of
+ * what the hardware sustains, so the next restore has to wait twice as long.
+ * A rejected commit degrades straight away.
+ */
+static void
+at_adaptive_frame(struct at_instance *instance, uint32_t missed, bool failed)
+{
+	char why[64];
+	struct at_adaptive *adaptive = &instance->adaptive;
+
+	if (failed) {
+		adaptive->window_failures++;
+		at_adaptive_change(instance, 1, "commit rejected");
+		adaptive->good_windows = 0;
+		return;
+	}
+
+	adaptive->window_frames++;
+	adaptive->window_misses += missed;
+
+	if (adaptive->window_frames < ATOMICTEST_ADAPTIVE_WINDOW)
+		return;
+
+	if (adaptive->window_misses > ATOMICTEST_ADAPTIVE_MAX_MISSES) {
+		snprintf(why, sizeof(why), "%u missed vblanks in %u frames",
+			 adaptive->window_misses, adaptive->window_frames);
+
+		if (adaptive->probing)
+			adaptive->restore_after = MIN(adaptive->restore_after * 2,
+						      ATOMICTEST_ADAPTIVE_MAX_RESTORE_WINDOWS);
+
+		at_adaptive_change(instance, 1, why);
+		adaptive->good_windows = 0;
+	} else if (adaptive->window_misses == 0 && adaptive->level > 0 &&
+		   ++adaptive->good_windows >= adaptive->restore_after) {
+		snprintf(why, sizeof(why), "%u clean windows",
+			 adaptive->good_windows);
+
+		at_adaptive_change(instance, -1, why);
+		adaptive->good_windows = 0;
+		adaptive->probing = true;
+
+		adaptive->window_frames = 0;
+		adaptive->window_misses = 0;
+		adaptive->window_failures = 0;
+		return;
+	} else if (adaptive->window_misses) {
+		adaptive->good_windows = 0;
+	}
+
+	adaptive->probing = false;
+	adaptive->window_frames = 0;
+	adaptive->window_misses = 0;
+	adaptive->window_failures = 0;
+}
+
+static void
+at_adaptive_report(struct at_instance *instance)
+{
+	struct at_adaptive *adaptive = &instance->adaptive;
+
+	printf("Adaptive: %" PRIu64 " degrades, %" PRIu64 " restores, "
+	       "settled at level %u: %u overlays at %u%% area\n",
+	       adaptive->degrades, adaptive->restores, adaptive->level,
+	       at_instance_overlays_active(instance),
+	       instance->overlay_scale * instance->overlay_scale / 100);
+}
+
+/*
+ * Evaluates the scene at the current time: moves every plane along its
+ * path and redraws the pulsing ones. Positions are top-left in CRTC
+ * coordinates, overlay_pos stays relative to the screen center.
+ */
+static void
+at_scene_update(struct at_instance *instance)
+{
+	struct at_scene *scene = &instance->scene;
+	double t;
+	uint32_t i;
+
+	if (!scene->start_ns)
+		scene->start_ns = at_now_ns();
+	t = (at_now_ns() - scene->start_ns) / 1e9;
+
+	for (i = 0; i < scene->count; i++) {
+		struct at_scene_plane *plane = &scene->planes[i];
+		struct at_dumb_buffer *dumb = NULL;
+		double x, y, span;
+
+		if (plane->role == AT_SCENE_PRIMARY)
+			continue;
+
+		switch (plane->motion) {
+		case AT_MOTION_CIRCLE:
+			x = plane->x + cos(plane->omega * t + plane->phase) * plane->radius -
+			    plane->width / 2.0;
+			y = plane->y + sin(plane->omega * t + plane->phase) * plane->radius -
+			    plane->height / 2.0;
+			break;
+		case AT_MOTION_BOUNCE:
+			/* triangle wave between the screen edges */
+			span = MAX(1, (int)instance->device.width - (int)plane->width);
+			x = fabs(fmod(plane->x + plane->vx * t + 2 * span, 2 * span) - span);
+			span = MAX(1, (int)instance->device.height - (int)plane->height);
+			y = fabs(fmod(plane->y + plane->vy * t + 2 * span, 2 * span) - span);
+			break;
+		case AT_MOTION_INPUT:
+			x = instance->cursor_x;
+			y = instance->cursor_y;
+			break;
+		default:
+			x = plane->x;
+			y = plane->y;
+			break;
+		}
+
+		plane->cur_x = x;
+		plane->cur_y = y;
+
+		if (plane->role == AT_SCENE_CURSOR) {
+			instance->cursor_x = plane->cur_x;
+			instance->cursor_y = plane->cur_y;
+			dumb = instance->cursor_fb->dumb;
+		} else if (plane->index < instance->device.overlays_count) {
+			instance->overlay_pos[plane->index].x =
+				plane->cur_x + (int32_t)plane->width / 2 -
+				instance->device.width / 2;
+			instance->overlay_pos[plane->index].y =
+				plane->cur_y + (int32_t)plane->height / 2 -
+				instance->device.height / 2;
+			dumb = instance->overlay_fbs[plane->index]->dumb;
+		}
+
+		if (dumb && plane->content == AT_SCENE_PULSE)
+			at_scene_render(plane, dumb, instance->content_frame);
+	}
+}
+
+static void
+at_instance_update_overlays(struct at_instance *instance)
+{
+	float angle = instance->overlay_angle;
+	int i, ret;
+
+	if (instance->scene.count) {
+		at_scene_update(instance);
+		return;
+	}
+
+	for (i = 0; i <  instance->device.overlays_count; i++) {
+		struct at_dumb_buffer *dumb = instance->overlay_fbs[i]->dumb;
+		uint32_t width = dumb->width;
+		uint32_t height = dumb->height;
+		float angle_offset = ((M_PI * 2) / instance->device.overlays_count) * i;
+
+		instance->overlay_pos[i].x = cosf(angle + angle_offset) * 256.0f;
+		instance->overlay_pos[i].y = sinf(angle + angle_offset) * 256.0f;
+
+		/* ARGB overlays carry prerendered translucent content */
+		if (dumb->format != DRM_FORMAT_ARGB8888)
+			at_dumb_buffer_fill(dumb, 0xFF000000 | (0xFF0000 >> (i % 3) * 8));
+	}
+
+	instance->overlay_angle += 0.1f;
+}
+
+/*
+ * Brings fbs[fb_idx] up to date with the next content frame. Every buffer
+ * accumulates the damage it missed while it wasn't being drawn to, so only
+ * that region is rendered (direct) or streamed from the shadow (shadow).
+ * Returns the number of bytes written to scanout memory.
+ */
+static uint64_t
+at_instance_render_primary(struct at_instance *instance, uint32_t fb_idx)
+{
+	int i;
+	uint64_t written;
+	struct at_rect damage;
+	struct at_rect *fb_damage = &instance->fb_damage[fb_idx];
+	struct at_surface target;
+	enum at_content content = instance->config.content;
+
+	at_content_damage(content, instance->content_frame,
+			  instance->primary_width, instance->primary_height,
+			  &damage);
+
+	for (i = 0; i < ATOMICTEST_NUM_FBS; i++)
+		at_rect_union(&instance->fb_damage[i], &damage);
+
+	at_dumb_buffer_surface(instance->fbs[fb_idx]->dumb, &target);
+
+	if (instance->config.shadow) {
+		at_rect_union(&instance->shadow_damage, &damage);
+		at_content_render(&instance->shadow, content,
+				  instance->content_frame,
+				  &instance->shadow_damage);
+		at_surface_copy_rect(&target, &instance->shadow, fb_damage);
+		memset(&instance->shadow_damage, 0, sizeof(instance->shadow_damage));
+	} else {
+		at_content_render(&target, content, instance->content_frame,
+				  fb_damage);
+	}
+
+	written = at_rect_area(fb_damage) * 4;
+	memset(fb_damage, 0, sizeof(*fb_damage));
+	instance->content_frame++;
+
+	return written;
+}
+
+static void
+at_instance_buffer(struct at_instance *instance, uint32_t fb_idx,
+		   struct at_buffer *buffer)
+{
+	struct at_dumb_buffer *dumb = instance->fbs[fb_idx]->dumb;
+	uint64_t presented = instance->fb_presented[fb_idx];
+
+	buffer->data = dumb->data;
+	buffer->width = instance->primary_width;
+	buffer->height = instance->primary_height;
+	buffer->stride = dumb->pitch;
+	buffer->format = dumb->format;
+	buffer->age = presented ? instance->fb_presents - presented + 1 : 0;
+	buffer->index = fb_idx;
+}
+
+/* Everything a frame needs besides the primary plane content, then the commit. */
+static int
+at_instance_submit(struct at_instance *instance, uint32_t next_fb)
+{
+	int ret;
+	uint32_t component;
+	uint32_t cursor_rgb;
+
+	component = (0xFFlu - abs(instance->content_frame % (2 * 0xFFlu) - 0xFFlu));
+	cursor_rgb = ~component;
+
+	/* a frame that only moves the cursor leaves the animation alone */
+	if (!instance->idle.cursor_only) {
+		if (!instance->scene.has_cursor) {
+			struct at_dumb_buffer *cursor = instance->cursor_fb->dumb;
+
+			at_dumb_buffer_fill(cursor, 0xFF000000 | cursor_rgb);
+			instance->cursor_bytes += cursor->width * cursor->height * 4;
+		}
+
+		at_instance_update_overlays(instance);
+	}
+
+	ret = at_instance_present(instance, next_fb);
+
+	/* keep shedding load until the kernel accepts the configuration */
+	while (ret && instance->config.adaptive &&
+	       instance->adaptive.level < at_adaptive_max_level(instance)) {
+		at_adaptive_frame(instance, 0, true);
+		ret = at_instance_present(instance, next_fb);
+	}
+
+	if (!ret) {
+		instance->stats.submit_ns = at_now_ns();
+		instance->input_inflight_ns = instance->input_pending_ns;
+		instance->input_pending_ns = 0;
+		instance->cur_fb = next_fb;
+		instance->flip_pending = true;
+		instance->fb_presented[next_fb] = ++instance->fb_presents;
+	}
+
+	return ret;
+}
+
+void
+at_instance_draw_frame(struct at_instance *instance)
+{
+	uint32_t next_fb = (instance->cur_fb + 1) % ATOMICTEST_NUM_FBS;
+
+	if (instance->output_lost)
+		return;
+
+	at_instance_input_take(instance);
+
+	/* on a cadence every frame shows the next source frame */
+	if (instance->video)
+		at_video_update(instance->video, instance->cadence.active ? 0 :
+				instance->config.video_fps);
+
+	if (!instance->video || instance->config.video_overlay) {
+		uint64_t start = at_now_ns();
+
+		if (instance->cursor_mode == AT_CURSOR_SOFTWARE)
+			at_instance_sw_cursor_restore(instance, next_fb);
+
+		if (instance->render_func) {
+			struct at_buffer buffer;
+
+			at_instance_buffer(instance, next_fb, &buffer);
+			instance->render_func(instance, &buffer,
+					      instance->content_frame++,
+					      instance->render_data);
+		} else {
+			instance->render_bytes +=
+				at_instance_render_primary(instance, next_fb);
+		}
+
+		if (instance->cursor_mode == AT_CURSOR_SOFTWARE)
+			at_instance_sw_cursor_draw(instance, next_fb);
+		instance->render_ns += at_now_ns() - start;
+	} else {
+		instance->content_frame++;
+	}
+
+	at_instance_submit(instance, next_fb);
+}
+
+void
+at_instance_set_render_func(struct at_instance *instance, at_render_func func,
+			    void *data)
+{
+	instance->render_func = func;
+	instance->render_data = data;
+}
+
+/*
+ * The client side of a frame: the back buffer to draw into and how many
+ * presents ago its content was shown, so only what changed since needs
+ * redrawing. Pending input is taken here, as draw_frame would.
+ */
+int
+at_instance_acquire_buffer(struct at_instance *instance,
+			   struct at_buffer *buffer)
+{
+	uint32_t next_fb = (instance->cur_fb + 1) % ATOMICTEST_NUM_FBS;
+
+	if (instance->output_lost)
+		return -ENODEV;
+
+	if (instance->flip_pending)
+		return -EBUSY;
+
+	at_instance_input_take(instance);
+
+	/* on a cadence every frame shows the next source frame */
+	if (instance->video)
+		at_video_update(instance->video, instance->cadence.active ? 0 :
+				instance->config.video_fps);
+
+	if (instance->cursor_mode == AT_CURSOR_SOFTWARE)
+		at_instance_sw_cursor_restore(instance, next_fb);
+
+	at_instance_buffer(instance, next_fb, buffer);
+	instance->acquire_ns = at_now_ns();
+
+	return 0;
+}
+
+int
+at_instance_present_buffer(struct at_instance *instance,
+			   struct at_buffer *buffer)
+{
+	if (instance->flip_pending)
+		return -EBUSY;
+
+	if (buffer->index != (instance->cur_fb + 1) % ATOMICTEST_NUM_FBS)
+		return -EINVAL;
+
+	/* the client rendered between acquire and present */
+	if (instance->acquire_ns) {
+		instance->render_ns += at_now_ns() - instance->acquire_ns;
+		instance->acquire_ns = 0;
+	}
+
+	instance->content_frame++;
+
+	if (instance->cursor_mode == AT_CURSOR_SOFTWARE)
+		at_instance_sw_cursor_draw(instance, buffer->index);
+
+	return at_instance_submit(instance, buffer->index);
+}
+
+static uint64_t
+at_mode_period_ns(const drmModeModeInfo *mode)
+{
+	if (!mode->clock)
+		return 1000000000 / (mode->vrefresh ? mode->vrefresh : 60);
+
+	return (uint64_t)mode->htotal * mode->vtotal * 1000000 / mode->clock;
+}
+
+/*
+ * Places an async flip on the vblank grid anchored at stats.vblank_ref_ns and
+ * converts its phase into a scanline; lines past vdisplay fell into vblank and
+ * didn't tear visibly. Drivers that stamp async flips with the last vblank
+ * time would put every flip on line 0: a stamp within a scanline of the
+ * vblank is taken as that, and the time we got the event used instead.
+ */
+static void
+at_instance_record_tear(struct at_instance *instance, uint64_t flip_ns)
+{
+	const drmModeModeInfo *mode = &instance->device.mode;
+	uint64_t period = at_mode_period_ns(mode);
+	uint64_t ref = instance->stats.vblank_ref_ns;
+	uint64_t line = mode->vtotal ? period / mode->vtotal : 0;
+	uint64_t phase;
+
+	if (!ref || flip_ns < ref)
+		return;
+
+	phase = (flip_ns - ref) % period;
+	if (phase < line)
+		phase = (at_now_ns() - ref) % period;
+
+	at_samples_add(&instance->stats.tear_lines,
+		       phase * mode->vtotal / period);
+}
+
+/*
+ * Where the time to the first flip went: opening and probing the device,
+ * allocating and mapping buffers, the modeset and then the first frame
+ * until it flipped. Whatever is left (argument parsing, input and hotplug
+ * setup) is "other".
+ */
+static void
+at_instance_report_startup(struct at_instance *instance, uint64_t flip_ns)
+{
+	struct at_mem_stats *mem = &instance->device.mem;
+	uint64_t total = flip_ns - instance->options.start_ns;
+	uint64_t first = flip_ns - instance->setup_done_ns;
+	uint64_t known = instance->probe_ns + mem->alloc_ns + mem->map_ns +
+			 instance->setup_modeset_ns + first;
+
+	printf("Startup: first flip %.1f ms after exec, %.1f ms after main()\n",
+	       at_since_exec_ns() / 1000000.0, total / 1000000.0);
+	printf("  probe %.1f ms, allocate %.1f ms, map %.1f ms, modeset %.1f ms, "
+	       "first commit %.1f ms, other %.1f ms\n",
+	       instance->probe_ns / 1000000.0, mem->alloc_ns / 1000000.0,
+	       mem->map_ns / 1000000.0, instance->setup_modeset_ns / 1000000.0,
+	       first / 1000000.0,
+	       (total > known ? total - known : 0) / 1000000.0);
+}
+
+/* Vblanks the given frame of the cadence should follow the previous one by. */
+static uint32_t
+at_cadence_requested(struct at_instance *instance, uint64_t frame)
+{
+	const struct at_config *config = &instance->config;
+	double vblanks;
+
+	if (config->cadence_count)
+		return config->cadence[frame % config->cadence_count];
+
+	vblanks = 1000000000.0 / at_mode_period_ns(&instance->device.mode) /
+		  config->target_fps;
+
+	return MAX(1, (uint64_t)((frame + 1) * vblanks) -
+		      (uint64_t)(frame * vblanks));
+}
+
+/*
+ * Books a flip against the cadence and returns how many vblanks late it
+ * was. A late flip starts the cadence over from itself, as a player would
+ * rather hold a frame once than rush the ones after it.
+ */
+static uint32_t
+at_instance_cadence_flip(struct at_instance *instance, unsigned int sequence,
+			 uint64_t flip_ns)
+{
+	const struct at_config *config = &instance->config;
+	struct at_cadence *cadence = &instance->cadence;
+	struct at_device *device = &instance->device;
+	uint64_t period = at_mode_period_ns(&device->mode);
+	uint64_t seq, ideal;
+	uint32_t i, sum = 0, late = 0;
+
+	if (!cadence->last_seq) {
+		/* the event only has the low 32 bits of the CRTC's count */
+		if (drmCrtcGetSequence(device->fd, device->crtc->crtc_id, &seq,
+				       NULL) < 0)
+			seq = sequence;
+		cadence->last_seq = seq - (uint32_t)((uint32_t)seq - sequence);
+		cadence->last_ns = flip_ns;
+		cadence->base_ns = flip_ns;
+		cadence->frame = 0;
+
+		for (i = 0; i < config->cadence_count; i++)
+			sum += config->cadence[i];
+		cadence->frame_ns = config->cadence_count ?
+				    (double)period * sum / config->cadence_count :
+				    1000000000.0 / config->target_fps;
+		return 0;
+	}
+
+	seq = cadence->last_seq + (int32_t)(sequence - (uint32_t)cadence->last_seq);
+
+	cadence->frames++;
+	cadence->intervals[MIN(seq - cadence->last_seq,
+			       ATOMICTEST_CADENCE_MAX_VBLANKS)]++;
+	at_samples_add(&cadence->error,
+		       llabs((int64_t)(flip_ns - cadence->last_ns) -
+			     (int64_t)(cadence->requested * period)));
+
+	if (seq > cadence->target_seq) {
+		late = seq - cadence->target_seq;
+		cadence->late++;
+		cadence->frame = 0;
+		cadence->base_ns = flip_ns;
+	} else {
+		cadence->on_cadence += seq == cadence->target_seq;
+		cadence->frame++;
+		ideal = cadence->base_ns + cadence->frame * cadence->frame_ns;
+		at_samples_add(&cadence->judder, llabs((int64_t)(flip_ns - ideal)));
+	}
+
+	cadence->last_seq = seq;
+	cadence->last_ns = flip_ns;
+
+	return late;
+}
+
+/*
+ * Called when a flip completes: queues an event for the vblank before the
+ * one the next frame should flip on, and draws the frame when it arrives so
+ * the commit latches on the right vblank. Frames due on the very next
+ * vblank are drawn right away. Without CRTC_QUEUE_SEQUENCE (before Linux
+ * 4.15) the cadence gives up and frames go out at the full refresh rate.
+ */
+static void
+at_instance_cadence_schedule(struct at_instance *instance)
+{
+	struct at_cadence *cadence = &instance->cadence;
+	struct at_device *device = &instance->device;
+
+	cadence->requested = at_cadence_requested(instance, cadence->frame);
+	cadence->target_seq = cadence->last_seq + cadence->requested;
+
+	if (cadence->requested > 1) {
+		if (!drmCrtcQueueSequence(device->fd, device->crtc->crtc_id,
+					  DRM_CRTC_SEQUENCE_NEXT_ON_MISS,
+					  cadence->target_seq - 1, NULL,
+					  (uintptr_t)instance)) {
+			cadence->queued = true;
+			return;
+		}
+
+		fprintf(stderr, "Can't queue vblank events (%s), presenting at "
+			"full rate.\n", strerror(errno));
+		cadence->active = false;
+	}
+
+	at_instance_draw_frame(instance);
+}
+
+static void
+at_sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data)
+{
+	struct at_instance *instance = (struct at_instance *)(uintptr_t)user_data;
+
+	instance->cadence.queued = false;
+
+	if (instance->run && !instance->flip_pending)
+		at_instance_draw_frame(instance);
+}
+
+static void
+at_instance_print_cadence(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+	struct at_cadence *cadence = &instance->cadence;
+	uint32_t i;
+
+	if (config->cadence_count) {
+		printf("Cadence ");
+		for (i = 0; i < config->cadence_count; i++)
+			printf("%s%u", i ? ":" : "", config->cadence[i]);
+	} else {
+		printf("Cadence for %.3f fps", config->target_fps);
+	}
+	printf(" at %.3f Hz: %" PRIu64 " frames, %.2f%% on their vblank, %"
+	       PRIu64 " late\n",
+	       1000000000.0 / at_mode_period_ns(&instance->device.mode),
+	       cadence->frames,
+	       cadence->frames ? 100.0 * cadence->on_cadence / cadence->frames : 0.0,
+	       cadence->late);
+
+	printf("  achieved intervals:");
+	for (i = 1; i <= ATOMICTEST_CADENCE_MAX_VBLANKS; i++) {
+		if (cadence->intervals[i])
+			printf(" %u%s vblanks %.1f%%", i,
+			       i == ATOMICTEST_CADENCE_MAX_VBLANKS ? "+" : "",
+			       100.0 * cadence->intervals[i] / cadence->frames);
+	}
+	printf("\n");
+
+	at_samples_print_ms("  cadence error", &cadence->error);
+	at_samples_print_ms("  judder", &cadence->judder);
+}
+
+/*
+ * A change the on-demand loop has to draw for: a scene update that came
+ * due, or input the last frame didn't take. Returns the CLOCK_MONOTONIC
+ * time of the oldest one and sets *scene unless only the cursor moved; 0
+ * while the scene is static.
+ */
+static uint64_t
+at_instance_idle_change(struct at_instance *instance, bool *scene)
+{
+	struct at_idle *idle = &instance->idle;
+	struct at_input_slot snapshot;
+	uint64_t now = at_now_ns();
+	uint64_t change = 0;
+
+	*scene = false;
+
+	if (idle->next_change_ns && now >= idle->next_change_ns) {
+		*scene = true;
+		change = idle->next_change_ns;
+	}
+
+	at_input_read(&instance->input, &snapshot);
+
+	/* a new overlay count needs the overlays laid out again */
+	if (snapshot.overlay_requests != instance->overlay_requests_taken) {
+		*scene = true;
+		if (!change)
+			change = now;
+	}
+
+	if (snapshot.events != instance->input.taken) {
+		uint64_t pending = snapshot.pending_ns ? snapshot.pending_ns : now;
+
+		change = change ? MIN(change, pending) : pending;
+	}
+
+	return change;
+}
+
+/*
+ * Draws for a change. A scene update renders the next frame; cursor motion
+ * alone commits the buffer on screen again with the cursor plane moved,
+ * unless the cursor is blended into the primary plane.
+ */
+static void
+at_instance_idle_draw(struct at_instance *instance, bool scene)
+{
+	struct at_idle *idle = &instance->idle;
+	uint64_t now = at_now_ns();
+
+	if (instance->output_lost)
+		return;
+
+	if (idle->next_change_ns && now >= idle->next_change_ns) {
+		while (idle->next_change_ns <= now)
+			idle->next_change_ns += idle->change_interval_ns;
+	}
+
+	if (scene || instance->cursor_mode == AT_CURSOR_SOFTWARE) {
+		idle->scene_frames++;
+		at_instance_draw_frame(instance);
+		return;
+	}
+
+	idle->cursor_frames++;
+	at_instance_input_take(instance);
+	idle->cursor_only = true;
+	at_instance_submit(instance, instance->cur_fb);
+	idle->cursor_only = false;
+}
+
+/* Books the stop that ends now, if there is one. */
+static void
+at_instance_idle_end(struct at_instance *instance)
+{
+	struct at_idle *idle = &instance->idle;
+
+	if (!idle->since_ns)
+		return;
+
+	__atomic_store_n(&idle->sleeping, false, __ATOMIC_RELAXED);
+	idle->idle_ns += at_now_ns() - idle->since_ns;
+	idle->idle_cpu_ns += at_process_cpu_ns() - idle->since_cpu_ns;
+	idle->since_ns = 0;
+}
+
+/*
+ * On-demand flip: draws the next frame if anything changed, otherwise lets
+ * the flip chain stop. sleeping is raised before looking, so input the
+ * input thread publishes meanwhile is either seen here or wakes the loop.
+ */
+static void
+at_instance_idle_flip(struct at_instance *instance)
+{
+	struct at_idle *idle = &instance->idle;
+	bool scene;
+
+	__atomic_store_n(&idle->sleeping, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (at_instance_idle_change(instance, &scene)) {
+		__atomic_store_n(&idle->sleeping, false, __ATOMIC_RELAXED);
+		at_instance_idle_draw(instance, scene);
+		return;
+	}
+
+	idle->stops++;
+	idle->since_ns = at_now_ns();
+	idle->since_cpu_ns = at_process_cpu_ns();
+}
+
+/*
+ * Restarts a stopped flip chain once something changed. The first flip
+ * after a stop is no frame interval, and the vblanks in between weren't
+ * missed.
+ */
+static void
+at_instance_idle_check(struct at_instance *instance)
+{
+	struct at_idle *idle = &instance->idle;
+	uint64_t change;
+	bool scene;
+
+	if (!idle->since_ns || !instance->run || instance->flip_pending)
+		return;
+
+	change = at_instance_idle_change(instance, &scene);
+	if (!change)
+		return;
+
+	at_instance_idle_end(instance);
+	idle->change_ns = change;
+	idle->resumed = true;
+	instance->stats.last_flip_ns = 0;
+	instance->stats.last_submit_ns = 0;
+
+	at_instance_idle_draw(instance, scene);
+}
+
+int
+at_instance_set_on_demand(struct at_instance *instance, bool enable)
+{
+	struct at_idle *idle = &instance->idle;
+	double interval = instance->config.change_interval;
+
+	if (!enable) {
+		if (!idle->enabled)
+			return 0;
+
+		at_instance_idle_end(instance);
+		close(idle->wake_fd);
+		idle->enabled = false;
+		return 0;
+	}
+
+	if (idle->enabled)
+		return 0;
+
+	idle->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (idle->wake_fd < 0)
+		return -errno;
+
+	idle->change_interval_ns = interval * 1000000000.0;
+	idle->next_change_ns = idle->change_interval_ns ?
+			       at_now_ns() + idle->change_interval_ns : 0;
+	idle->enabled = true;
+
+	return 0;
+}
+
+static void
+at_instance_print_idle(struct at_instance *instance, double seconds)
+{
+	struct at_idle *idle = &instance->idle;
+	double idle_seconds;
+
+	at_instance_idle_end(instance);
+	idle_seconds = idle->idle_ns / 1000000000.0;
+
+	printf("On demand: %" PRIu64 " scene and %" PRIu64 " cursor frames, "
+	       "%" PRIu64 " stops, idle %.1f%% of the time\n",
+	       idle->scene_frames, idle->cursor_frames, idle->stops,
+	       seconds > 0 ? 100.0 * idle_seconds / seconds : 0.0);
+	printf("  wakeups: %.1f/s event loop, %.1f/s while idle, "
+	       "%.1f/s process context switches\n",
+	       seconds > 0 ? idle->wakeups / seconds : 0.0,
+	       idle_seconds > 0 ? idle->idle_wakeups / idle_seconds : 0.0,
+	       seconds > 0 ? (at_process_switches() - idle->switches) / seconds : 0.0);
+	if (idle_seconds > 0)
+		printf("  CPU while idle: %.3f ms/s\n",
+		       idle->idle_cpu_ns / 1000000.0 / idle_seconds);
+	if (idle->wake_latency.count)
+		at_samples_print_ms("  change to first flip", &idle->wake_latency);
+}
+
+static void
+at_page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+		     unsigned int tv_usec, void *user_data)
+{
+	struct at_instance *instance = user_data;
+	uint32_t missed = 0;
+	uint64_t flip_ns;
+
+	flip_ns = (uint64_t)tv_sec * 1000000000 + (uint64_t)tv_usec * 1000;
+
+	if (instance->cadence.active)
+		missed = at_instance_cadence_flip(instance, sequence, flip_ns);
+	else if (instance->frames && !instance->idle.resumed &&
+		 sequence - instance->last_sequence > 1)
+		missed = sequence - instance->last_sequence - 1;
+	instance->missed_vblanks += missed;
+	instance->last_sequence = sequence;
+	if (instance->options.perf)
+		at_instance_perf_flip(instance, instance->stats.last_flip_ns ?
+				      flip_ns - instance->stats.last_flip_ns : 0,
+				      missed);
+
+	if (instance->stats.last_flip_ns) {
+		at_samples_add(&instance->stats.flip_intervals,
+			       flip_ns - instance->stats.last_flip_ns);
+		if (instance->soak)
+			at_histogram_add(&instance->soak->frame,
+					 flip_ns - instance->stats.last_flip_ns);
+	}
+	instance->stats.last_flip_ns = flip_ns;
+
+	if (instance->stats.submit_ns) {
+		struct at_present_stats *stats = &instance->stats;
+
+		at_samples_add(&stats->submit_to_flip, flip_ns - stats->submit_ns);
+
+		if (stats->last_submit_ns && stats->flip_intervals.count) {
+			int64_t flip_interval =
+				stats->flip_intervals.values[stats->flip_intervals.count - 1];
+			int64_t submit_interval = stats->submit_ns - stats->last_submit_ns;
+
+			at_samples_add(&stats->pace_error,
+				       llabs(flip_interval - submit_interval));
+		}
+		stats->last_submit_ns = stats->submit_ns;
+	}
+
+	if (instance->input_inflight_ns) {
+		at_samples_add(&instance->stats.input_latency,
+			       flip_ns - instance->input_inflight_ns);
+		instance->input_inflight_ns = 0;
+	}
+
+	if (instance->idle.change_ns) {
+		at_samples_add(&instance->idle.wake_latency,
+			       flip_ns - instance->idle.change_ns);
+		instance->idle.change_ns = 0;
+	}
+	instance->idle.resumed = false;
+
+	if (instance->async)
+		at_instance_record_tear(instance, flip_ns);
+
+	if (instance->config.adaptive)
+		at_adaptive_frame(instance, missed, false);
+
+	instance->flip_pending = false;
+	instance->frames++;
+
+	if (!instance->first_flip_seen) {
+		instance->first_flip_seen = true;
+		/* only the tool knows when the process started */
+		if (instance->options.start_ns)
+			at_instance_report_startup(instance, flip_ns);
+	}
+
+	if (instance->hotplug_ns && !instance->hotplug_pending &&
+	    !instance->output_lost) {
+		at_samples_add(&instance->hotplug_latency, flip_ns - instance->hotplug_ns);
+		printf("Hotplug: first frame %.3f ms after the event\n",
+		       (flip_ns - instance->hotplug_ns) / 1000000.0);
+		instance->hotplug_ns = 0;
+	}
+
+	/* the planes still hold what was captured, verify before redrawing */
+	at_writeback_collect(instance, true);
+
+	if (instance->hotplug_pending)
+		at_instance_handle_hotplug(instance);
+
+	if (!instance->run || instance->flip_pending ||
+	    instance->config.manual_present)
+		return;
+
+	if (instance->cadence.active)
+		at_instance_cadence_schedule(instance);
+	else if (instance->config.pace)
+		at_instance_pace_schedule(instance);
+	else if (instance->idle.enabled)
+		at_instance_idle_flip(instance);
+	else
+		at_instance_draw_frame(instance);
+}
+
+/*
+ * Runs the flip loop for the given time and leaves the instance with no flip
+ * pending, so the caller can reconfigure it. Returns the frames shown. The
+ * benchmarks step through this, an interrupt ends the whole sequence.
+ */
+static uint64_t
+at_instance_flip_for(struct at_instance *instance, double seconds,
+		     double *elapsed)
+{
+	uint64_t start = at_now_ns();
+	uint64_t end = isinf(seconds) ? UINT64_MAX :
+		       start + seconds * 1000000000.0;
+	uint64_t frames = instance->frames;
+
+	instance->run = true;
+	at_instance_draw_frame(instance);
+
+	while (!at_instance_interrupted(instance) &&
+	       (instance->flip_pending || instance->next_submit_ns ||
+		instance->cadence.queued) &&
+	       at_now_ns() < end) {
+		if (at_instance_process_events(instance) < 0)
+			break;
+	}
+
+	at_instance_stop(instance);
+
+	*elapsed = (at_now_ns() - start) / 1000000000.0;
+
+	return instance->frames - frames;
+}
+
+uint64_t
+at_instance_run_for(struct at_instance *instance, double seconds,
+		    double *elapsed)
+{
+	*instance->stop = false;
+
+	return at_instance_flip_for(instance, seconds, elapsed);
+}
+
+/*
+ * Flips at every requested primary plane scale and reports what rendering at
+ * that resolution costs and buys.
+ */
+static void
+at_instance_bench_scale(struct at_instance *instance)
+{
+	int i, j;
+	const struct at_options *options = &instance->options;
+
+	printf("\n%6s %11s %6s %12s %10s %10s\n", "scale", "size", "test",
+	       "fill ms", "mem KiB", "fps");
+
+	for (i = 0; i < options->bench_scale_count &&
+		    !at_instance_interrupted(instance); i++) {
+		uint32_t percent = options->bench_scales[i];
+		uint64_t render_ns, frames, mem = 0;
+		double elapsed;
+		int ret;
+
+		ret = at_instance_set_primary_scale(instance, percent);
+		if (ret < 0) {
+			printf("%5u%% %5ux%-5u %6s   (%s)\n", percent,
+			       at_scale(instance->device.width, percent),
+			       at_scale(instance->device.height, percent),
+			       "fail", strerror(-ret));
+			continue;
+		}
+
+		for (j = 0; j < ATOMICTEST_NUM_FBS; j++)
+			mem += instance->fbs[j]->dumb->size;
+
+		render_ns = instance->render_ns;
+		frames = at_instance_flip_for(instance, options->bench_seconds,
+					     &elapsed);
+		render_ns = instance->render_ns - render_ns;
+
+		printf("%5u%% %5ux%-5u %6s %12.3f %10" PRIu64 " %10.2f\n",
+		       percent, instance->primary_width, instance->primary_height,
+		       "pass", frames ? render_ns / 1000000.0 / frames : 0.0,
+		       mem / 1024, frames / elapsed);
+	}
+
+	at_instance_set_primary_scale(instance, instance->config.scale);
+}
+
+/*
+ * Drives the same scene through the atomic and the legacy backend back to
+ * back and compares what each costs per frame.
+ */
+static void
+at_instance_bench_backends(struct at_instance *instance)
+{
+	int backend;
+	enum at_backend saved = instance->backend;
+
+	for (backend = 0; backend < AT_BACKEND_COUNT &&
+	     !at_instance_interrupted(instance); backend++) {
+		struct at_present_stats *stats = &instance->stats;
+		uint64_t frames, cpu_ns;
+		double elapsed;
+
+		if (at_instance_set_backend(instance, backend) < 0) {
+			printf("\n%s: couldn't switch backend\n",
+			       at_backend_names[backend]);
+			continue;
+		}
+
+		at_instance_reset_stats(instance);
+		cpu_ns = at_process_cpu_ns();
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+		cpu_ns = at_process_cpu_ns() - cpu_ns;
+
+		printf("\n%s: %" PRIu64 " frames in %.3f s = %.2f FPS\n",
+		       at_backend_names[backend], frames, elapsed, frames / elapsed);
+		if (!stats->presents || !frames)
+			continue;
+
+		printf("  ioctls/frame:          %.2f\n",
+		       (double)stats->ioctls / stats->presents);
+		printf("  present CPU/frame:     %.1f us\n",
+		       stats->cpu_ns / 1000.0 / stats->presents);
+		printf("  process CPU/frame:     %.1f us\n",
+		       cpu_ns / 1000.0 / frames);
+		at_samples_print_ms("  flip interval", &stats->flip_intervals);
+	}
+
+	at_instance_set_backend(instance, saved);
+}
+
+static void
+at_instance_print_tears(struct at_instance *instance)
+{
+	int i;
+	uint64_t bands[4] = { 0 };
+	uint64_t in_vblank = 0;
+	struct at_samples *tears = &instance->stats.tear_lines;
+	uint32_t vdisplay = instance->device.mode.vdisplay;
+
+	if (!tears->count || !vdisplay)
+		return;
+
+	for (i = 0; i < tears->count; i++) {
+		if (tears->values[i] >= vdisplay)
+			in_vblank++;
+		else
+			bands[tears->values[i] * 4 / vdisplay]++;
+	}
+
+	printf("  tear line:             p50 %" PRIu64 ", p10-p90 %" PRIu64 "-%" PRIu64
+	       " of %u lines\n",
+	       at_samples_percentile(tears, 50), at_samples_percentile(tears, 10),
+	       at_samples_percentile(tears, 90), vdisplay);
+	printf("  tear bands:            top %.1f%%, %.1f%%, %.1f%%, bottom %.1f%%, "
+	       "in vblank %.1f%%\n",
+	       bands[0] * 100.0 / tears->count, bands[1] * 100.0 / tears->count,
+	       bands[2] * 100.0 / tears->count, bands[3] * 100.0 / tears->count,
+	       in_vblank * 100.0 / tears->count);
+}
+
+/*
+ * Runs vblank synchronized and then tearing flips for the same time, so the
+ * latency floor can be compared with what vsync costs.
+ */
+static void
+at_instance_bench_async(struct at_instance *instance)
+{
+	int async;
+
+	for (async = 0; async < 2 && !at_instance_interrupted(instance);
+	     async++) {
+		struct at_present_stats *stats = &instance->stats;
+		uint64_t frames;
+		double elapsed;
+		int ret;
+
+		ret = at_instance_set_async(instance, async);
+		if (ret < 0) {
+			printf("\n%s: not supported (%s)\n",
+			       async ? "async" : "vsync", strerror(-ret));
+			continue;
+		}
+
+		at_instance_reset_stats(instance);
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+
+		printf("\n%s%s: %" PRIu64 " flips in %.3f s = %.2f flips/s\n",
+		       async ? "async" : "vsync",
+		       instance->async == AT_ASYNC_ATOMIC ? " (atomic)" :
+		       instance->async == AT_ASYNC_LEGACY ? " (legacy)" : "",
+		       frames, elapsed, frames / elapsed);
+		at_samples_print_ms("  flip interval", &stats->flip_intervals);
+		if (stats->input_latency.count)
+			at_samples_print_ms("  input to flip", &stats->input_latency);
+		else
+			printf("  input to flip:         no pointer motion during the run\n");
+		at_instance_print_tears(instance);
+	}
+
+	at_instance_set_async(instance, instance->config.async);
+}
+
+static void
+at_instance_print_pacing(struct at_instance *instance)
+{
+	at_samples_print_ms("  flip interval", &instance->stats.flip_intervals);
+	at_samples_print_ms("  submit to flip", &instance->stats.submit_to_flip);
+	at_samples_print_ms("  pacing error", &instance->stats.pace_error);
+}
+
+/*
+ * Replays the same pacing pattern at fixed refresh and with adaptive sync,
+ * to show how much closer flips follow submissions with VRR on.
+ */
+static void
+at_instance_bench_vrr(struct at_instance *instance)
+{
+	int vrr;
+
+	for (vrr = 0; vrr < 2 && !at_instance_interrupted(instance); vrr++) {
+		uint64_t frames;
+		double elapsed;
+
+		if (at_instance_set_vrr(instance, vrr) < 0) {
+			printf("\nvrr: not supported by this connector/CRTC\n");
+			continue;
+		}
+
+		at_instance_pace_reset(instance);
+		at_instance_reset_stats(instance);
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+
+		printf("\n%s: %" PRIu64 " frames in %.3f s = %.2f FPS, "
+		       "%" PRIu64 " missed vblanks\n",
+		       vrr ? "vrr" : "fixed", frames, elapsed, frames / elapsed,
+		       instance->missed_vblanks);
+		at_instance_print_pacing(instance);
+	}
+
+	at_instance_set_vrr(instance, instance->config.vrr && instance->vrr_capable);
+}
+
+static bool
+at_mode_matches(const drmModeModeInfo *mode, const char *filter)
+{
+	char desc[64];
+
+	if (!filter)
+		return true;
+
+	snprintf(desc, sizeof(desc), "%ux%u@%u%s", mode->hdisplay, mode->vdisplay,
+		 mode->vrefresh, mode->flags & DRM_MODE_FLAG_INTERLACE ? "i" : "");
+
+	return strstr(desc, filter) != NULL;
+}
+
+/*
+ * Modesets into every mode the connector offers (or the ones whose
+ * "WxH@R" description contains the filter) and flips in each for the
+ * benchmark duration, one result row per mode.
+ */
+static void
+at_instance_bench_modes(struct at_instance *instance, const char *filter)
+{
+	int i, n;
+	struct at_device *device = &instance->device;
+	drmModeModeInfo saved = device->mode;
+	drmModeModeInfo *modes;
+	uint32_t count = device->mode_count;
+
+	/* apply_mode doesn't touch the list, but a hotplug could */
+	modes = malloc(count * sizeof(*modes));
+	if (!modes)
+		return;
+	memcpy(modes, device->modes, count * sizeof(*modes));
+
+	printf("\n%-4s %-20s %8s %10s %9s %9s %9s %9s %10s\n",
+	       "idx", "mode", "refresh", "modeset", "fps", "p50", "p90", "p99",
+	       "fill MB/s");
+
+	for (i = 0, n = 0; i < count && !at_instance_interrupted(instance);
+	     i++) {
+		struct at_samples *intervals = &instance->stats.flip_intervals;
+		drmModeModeInfo *mode = &modes[i];
+		uint64_t frames, bytes;
+		double elapsed;
+		char name[32];
+		int ret;
+
+		if (!at_mode_matches(mode, filter))
+			continue;
+
+		snprintf(name, sizeof(name), "%ux%u%s", mode->hdisplay,
+			 mode->vdisplay,
+			 mode->flags & DRM_MODE_FLAG_INTERLACE ? "i" : "");
+
+		ret = at_instance_apply_mode(instance, mode);
+		if (ret < 0) {
+			printf("%-4d %-20s %8u %10s   (%s)\n", i, name,
+			       mode->vrefresh, "failed", strerror(-ret));
+			continue;
+		}
+
+		at_instance_reset_stats(instance);
+		bytes = instance->render_bytes;
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+		bytes = instance->render_bytes - bytes;
+
+		printf("%-4d %-20s %8u %8.2fms %9.2f %7.3fms %7.3fms %7.3fms %10.1f\n",
+		       i, name, mode->vrefresh,
+		       instance->modeset_ns / 1000000.0,
+		       frames / elapsed,
+		       at_samples_percentile(intervals, 50) / 1000000.0,
+		       at_samples_percentile(intervals, 90) / 1000000.0,
+		       at_samples_percentile(intervals, 99) / 1000000.0,
+		       bytes / elapsed / (1024.0 * 1024.0));
+		n++;
+	}
+
+	if (!n)
+		printf("No mode matched '%s'.\n", filter ? filter : "");
+
+	at_instance_apply_mode(instance, &saved);
+	free(modes);
+}
+
+/* Advances idx to the next lexicographic permutation, false after the last. */
+static bool
+at_next_permutation(uint32_t *idx, uint32_t n)
+{
+	uint32_t i, j, tmp;
+
+	if (n < 2)
+		return false;
+
+	for (i = n - 1; i > 0 && idx[i - 1] >= idx[i]; i--)
+		;
+	if (!i)
+		return false;
+
+	for (j = n - 1; idx[j] <= idx[i - 1]; j--)
+		;
+	tmp = idx[i - 1];
+	idx[i - 1] = idx[j];
+	idx[j] = tmp;
+
+	for (j = n - 1; i < j; i++, j--) {
+		tmp = idx[i];
+		idx[i] = idx[j];
+		idx[j] = tmp;
+	}
+
+	return true;
+}
+
+/* Horizontal alpha ramp over a solid color, premultiplied as KMS expects. */
+static void
+at_dumb_buffer_fill_premultiplied(struct at_dumb_buffer *dumb, uint32_t rgb)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < dumb->height; y++) {
+		uint32_t *pixel = (uint32_t *)(dumb->data + y * dumb->pitch);
+
+		for (x = 0; x < dumb->width; x++) {
+			uint32_t a = 0x20 + x * 0xDF / MAX(dumb->width - 1, 1);
+			uint32_t r = ((rgb >> 16) & 0xFF) * a / 0xFF;
+			uint32_t g = ((rgb >> 8) & 0xFF) * a / 0xFF;
+			uint32_t b = (rgb & 0xFF) * a / 0xFF;
+
+			pixel[x] = a << 24 | r << 16 | g << 8 | b;
+		}
+	}
+}
+
+/*
+ * Checks the current overlay_state with TEST_ONLY and, if the driver takes
+ * it, flips with it for the benchmark duration. One row per configuration.
+ */
+static void
+at_instance_bench_plane_config(struct at_instance *instance, const char *name)
+{
+	struct at_samples *intervals = &instance->stats.flip_intervals;
+	uint32_t i, n = at_instance_overlays_active(instance);
+	uint64_t frames;
+	double elapsed;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		if (at_drm_plane_set_state(NULL, instance->device.overlay_planes[i],
+					   &instance->overlay_state[i]) < 0) {
+			printf("%-32s %6s\n", name, "n/a");
+			return;
+		}
+	}
+
+	ret = at_instance_atomic_commit(instance, instance->cur_fb,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (ret < 0) {
+		printf("%-32s %6s   (%s)\n", name, "fail", strerror(-ret));
+		return;
+	}
+
+	at_instance_reset_stats(instance);
+	frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+				     &elapsed);
+
+	printf("%-32s %6s %9.2f %9" PRIu64 " %7.3fms\n", name, "pass",
+	       frames / elapsed, instance->missed_vblanks,
+	       at_samples_percentile(intervals, 99) / 1000000.0);
+}
+
+/*
+ * Starts the next group of rows from the properties the overlays came up
+ * with, so no row inherits what the previous group committed.
+ */
+static void
+at_instance_bench_plane_defaults(struct at_instance *instance, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		at_plane_state_defaults(&instance->overlay_state[i],
+					instance->device.overlay_planes[i]);
+}
+
+/*
+ * Walks the optional plane properties drivers like to reject or fall back
+ * on: every stacking order of the first overlays, per-plane alpha over
+ * premultiplied ARGB content in each blend mode, and 90/180/270 rotation.
+ */
+static void
+at_instance_bench_planes(struct at_instance *instance)
+{
+	static const int32_t alphas[] = { 100, 50, 25, -1 };
+	static const struct {
+		const char *name;
+		uint32_t rotation;
+	} rotations[] = {
+		{ "rotate-90", DRM_MODE_ROTATE_90 },
+		{ "rotate-180", DRM_MODE_ROTATE_180 },
+		{ "rotate-270", DRM_MODE_ROTATE_270 },
+	};
+	struct at_device *device = &instance->device;
+	uint32_t n = at_instance_overlays_active(instance);
+	uint32_t perm_n = MIN(n, 4);
+	struct at_dumb_fb **saved_fbs = NULL;
+	uint32_t idx[4];
+	int64_t base;
+	char name[64];
+	uint32_t i, j, k;
+
+	if (!n) {
+		printf("No overlay planes in use, nothing to benchmark.\n");
+		return;
+	}
+
+	printf("\n%-32s %6s %9s %9s %9s\n", "config", "test", "fps", "missed",
+	       "p99");
+
+	at_instance_bench_plane_defaults(instance, n);
+	at_instance_bench_plane_config(instance, "default");
+
+	/* z-order: stack above the primary, every order of the first four */
+	if (device->primary_plane && device->primary_plane->has_zpos)
+		base = device->primary_plane->zpos + 1;
+	else
+		base = device->overlay_planes[0]->zpos_min;
+
+	for (i = 0; i < perm_n; i++)
+		idx[i] = i;
+
+	do {
+		int len = snprintf(name, sizeof(name), "zpos");
+
+		for (i = 0; i < perm_n; i++) {
+			instance->overlay_state[i].set_zpos = true;
+			instance->overlay_state[i].zpos = base + idx[i];
+			len += snprintf(name + len, sizeof(name) - len, "%s%" PRId64,
+					i ? "," : " ", base + idx[i]);
+		}
+
+		at_instance_bench_plane_config(instance, name);
+	} while (!at_instance_interrupted(instance) &&
+		 at_next_permutation(idx, perm_n));
+
+	at_instance_bench_plane_defaults(instance, n);
+
+	/* alpha: swap in premultiplied ARGB overlays of the same size */
+	saved_fbs = malloc(n * sizeof(*saved_fbs));
+	if (!saved_fbs)
+		return;
+	memcpy(saved_fbs, instance->overlay_fbs, n * sizeof(*saved_fbs));
+
+	for (i = 0; i < n; i++) {
+		instance->overlay_fbs[i] = at_dumb_fb_create(device,
+							     saved_fbs[i]->dumb->width,
+							     saved_fbs[i]->dumb->height,
+							     DRM_FORMAT_ARGB8888,
+							     AT_MEM_OVERLAY);
+		if (!instance->overlay_fbs[i]) {
+			fprintf(stderr, "Couldn't create the ARGB overlays.\n");
+			goto restore_fbs;
+		}
+
+		at_dumb_buffer_fill_premultiplied(instance->overlay_fbs[i]->dumb,
+						  0xFF0000 >> (i % 3) * 8);
+	}
+
+	for (j = 0; j < AT_BLEND_COUNT && !at_instance_interrupted(instance);
+	     j++) {
+		for (k = 0; k < sizeof(alphas) / sizeof(alphas[0]) &&
+			    !at_instance_interrupted(instance); k++) {
+			at_instance_bench_plane_defaults(instance, n);
+			for (i = 0; i < n; i++) {
+				instance->overlay_state[i].blend = j;
+				/* -1 staggers the planes from translucent to opaque */
+				instance->overlay_state[i].alpha = alphas[k] >= 0 ?
+					alphas[k] : 100 * (i + 1) / n;
+			}
+
+			if (alphas[k] >= 0)
+				snprintf(name, sizeof(name), "alpha %d%% %s",
+					 alphas[k], at_blend_names[j]);
+			else
+				snprintf(name, sizeof(name), "alpha staggered %s",
+					 at_blend_names[j]);
+
+			at_instance_bench_plane_config(instance, name);
+		}
+	}
+
+restore_fbs:
+	/* the ARGB overlays may still be scanned out until this commit lands */
+	for (i = 0; i < n; i++) {
+		struct at_dumb_fb *argb = instance->overlay_fbs[i];
+
+		instance->overlay_fbs[i] = saved_fbs[i];
+		saved_fbs[i] = argb != instance->overlay_fbs[i] ? argb : NULL;
+	}
+	at_instance_bench_plane_defaults(instance, n);
+	at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+
+	for (i = 0; i < n; i++) {
+		if (saved_fbs[i])
+			at_dumb_fb_free(device, saved_fbs[i]);
+	}
+	free(saved_fbs);
+
+	/* rotation of the opaque overlays, square by default so 90/270 fit */
+	for (j = 0; j < sizeof(rotations) / sizeof(rotations[0]) &&
+		    !at_instance_interrupted(instance); j++) {
+		at_instance_bench_plane_defaults(instance, n);
+		for (i = 0; i < n; i++)
+			instance->overlay_state[i].rotation = rotations[j].rotation;
+
+		at_instance_bench_plane_config(instance, rotations[j].name);
+	}
+
+	/* put the probed values back on screen, then leave them alone */
+	at_instance_bench_plane_defaults(instance, n);
+	at_instance_atomic_commit(instance, instance->cur_fb, 0, NULL);
+
+	for (i = 0; i < n; i++)
+		at_plane_state_reset(&instance->overlay_state[i]);
+}
+
+static void
+at_instance_print_input(struct at_instance *instance)
+{
+	struct at_present_stats *stats = &instance->stats;
+
+	printf("Input: %" PRIu64 " motion events in %" PRIu64 " frames, "
+	       "%.1f per frame (max %" PRIu64 "), %.1f%% coalesced\n",
+	       stats->input_events, stats->input_frames,
+	       stats->input_frames ? (double)stats->input_events / stats->input_frames : 0.0,
+	       stats->input_max_per_frame,
+	       stats->input_events ?
+	       100.0 * (stats->input_events - stats->input_frames) / stats->input_events : 0.0);
+}
+
+/*
+ * Dispatches libinput on the main loop and then on its own thread, and
+ * compares what each costs the frame loop and the whole process. Only
+ * meaningful with a pointer moving, ideally a high polling rate mouse.
+ */
+static void
+at_instance_bench_input(struct at_instance *instance)
+{
+	static const char *const names[] = { "main loop", "thread" };
+	bool threaded = instance->input_threaded;
+	int i;
+
+	printf("\nMove the pointer continuously during the benchmark.\n");
+	printf("%-10s %9s %10s %10s %12s %12s %10s %10s\n", "input", "fps",
+	       "events/s", "coalesced", "main ms/s", "total ms/s", "lat p50",
+	       "lat p99");
+
+	for (i = 0; i < 2 && !at_instance_interrupted(instance); i++) {
+		struct at_present_stats *stats = &instance->stats;
+		uint64_t main_ns, total_ns, frames;
+		double elapsed;
+
+		if (at_instance_set_input_threaded(instance, i) < 0) {
+			printf("%-10s   (couldn't start the input thread)\n", names[i]);
+			continue;
+		}
+
+		at_instance_reset_stats(instance);
+		main_ns = at_thread_cpu_ns();
+		total_ns = at_process_cpu_ns();
+		frames = at_instance_flip_for(instance, instance->options.bench_seconds,
+					     &elapsed);
+		main_ns = at_thread_cpu_ns() - main_ns;
+		total_ns = at_process_cpu_ns() - total_ns;
+
+		printf("%-10s %9.2f %10.0f %9.1f%% %12.2f %12.2f %8.3fms %8.3fms\n",
+		       names[i], frames / elapsed, stats->input_events / elapsed,
+		       stats->input_events ?
+		       100.0 * (stats->input_events - stats->input_frames) /
+		       stats->input_events : 0.0,
+		       main_ns / 1000000.0 / elapsed,
+		       total_ns / 1000000.0 / elapsed,
+		       at_samples_percentile(&stats->input_latency, 50) / 1000000.0,
+		       at_samples_percentile(&stats->input_latency, 99) / 1000000.0);
+	}
+
+	at_instance_set_input_threaded(instance, threaded);
+}
+
+/*
+ * Renders every content type straight into the scanout mappings and through
+ * the shadow buffer, without committing anything, and reports the CPU cost.
+ */
+void
+at_instance_bench_shadow(struct at_instance *instance, uint32_t frames)
+{
+	int content, shadow;
+	uint32_t i;
+	struct at_config saved = instance->config;
+
+	printf("\n%-8s %-8s %12s %12s %12s\n", "content", "path",
+	       "ms/frame", "fps", "MB/s out");
+
+	for (content = 0; content < AT_CONTENT_COUNT; content++) {
+		for (shadow = 0; shadow < 2; shadow++) {
+			struct timespec start, end;
+			uint64_t written = 0;
+			double sec;
+
+			instance->config.content = content;
+			instance->config.shadow = shadow;
+			at_instance_reset_damage(instance);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < frames &&
+				    !at_instance_interrupted(instance); i++)
+				written += at_instance_render_primary(instance,
+								      i % ATOMICTEST_NUM_FBS);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			/* interrupted before the first frame, nothing to average */
+			if (!i)
+				break;
+
+			sec = (TIMESPEC_NSEC(end) - TIMESPEC_NSEC(start)) / 1000000000.0;
+			printf("%-8s %-8s %12.3f %12.1f %12.1f\n",
+			       at_content_names[content],
+			       shadow ? "shadow" : "direct",
+			       sec * 1000.0 / i, i / sec,
+			       written / sec / (1024.0 * 1024.0));
+		}
+	}
+
+	instance->config = saved;
+	at_instance_reset_damage(instance);
+}
+
+static const char *const at_sched_names[] = {
+	[AT_SCHED_OTHER] = "other",
+	[AT_SCHED_FIFO] = "fifo",
+	[AT_SCHED_DEADLINE] = "deadline",
+};
+
+/*
+ * mlockall() is per process, and with --devices every card's instance asks
+ * for it: only the last one to let go unlocks.
+ */
+static pthread_mutex_t at_mlock_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t at_mlock_users;
+
+static void
+at_instance_mlock(struct at_instance *instance)
+{
+	pthread_mutex_lock(&at_mlock_lock);
+	if (at_mlock_users || mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+		at_mlock_users++;
+		instance->rt_mlocked = true;
+	} else {
+		fprintf(stderr, "mlockall failed: %s\n", strerror(errno));
+	}
+	pthread_mutex_unlock(&at_mlock_lock);
+}
+
+static void
+at_instance_munlock(struct at_instance *instance)
+{
+	if (!instance->rt_mlocked)
+		return;
+
+	pthread_mutex_lock(&at_mlock_lock);
+	if (--at_mlock_users == 0)
+		munlockall();
+	instance->rt_mlocked = false;
+	pthread_mutex_unlock(&at_mlock_lock);
+}
+
+/*
+ * SCHED_DEADLINE gets the mode's frame period, so the runtime budget is
+ * per frame. Failing to lock memory is only a warning, the rest fails the
+ * call and leaves the threads as they were.
+ */
+int
+at_instance_set_realtime(struct at_instance *instance, bool enable)
+{
+	const struct at_config *config = &instance->config;
+	int ret;
+
+	if (enable == instance->rt_enabled)
+		return 0;
+
+	if (!enable) {
+		at_thread_state_restore(instance->rt_thread, &instance->rt_saved);
+		if (instance->rt_input)
+			at_thread_state_restore(instance->input_thread,
+						&instance->rt_input_saved);
+		at_instance_munlock(instance);
+		instance->rt_enabled = false;
+		instance->rt_input = false;
+		return 0;
+	}
+
+	instance->rt_thread = pthread_self();
+	at_thread_state_save(instance->rt_thread, &instance->rt_saved);
+
+	ret = at_thread_set_realtime(instance->rt_thread, config, config->cpus,
+				     at_mode_period_ns(&instance->device.mode));
+	if (ret < 0) {
+		fprintf(stderr, "Couldn't run the event thread %s%s%s: %s\n",
+			at_sched_names[config->sched],
+			config->cpus ? " on CPUs " : "",
+			config->cpus ? config->cpus : "", strerror(-ret));
+		if (ret == -EPERM)
+			fprintf(stderr, "Real-time policies need CAP_SYS_NICE or an "
+				"RLIMIT_RTPRIO; SCHED_DEADLINE can't be pinned "
+				"to fewer CPUs than its root domain.\n");
+		at_thread_state_restore(instance->rt_thread, &instance->rt_saved);
+		return ret;
+	}
+
+	instance->rt_enabled = true;
+
+	if (instance->input_threaded)
+		at_instance_rt_input(instance);
+
+	if (config->mlock)
+		at_instance_mlock(instance);
+
+	return 0;
+}
+
+/* Background load: threads sweeping a buffer each, at normal priority. */
+struct at_load {
+	pthread_t *threads;
+	uint32_t count;
+	int stop;
+};
+
+#define ATOMICTEST_LOAD_BUFFER_SIZE (16 << 20)
+
+static void *
+at_load_thread(void *data)
+{
+	struct at_load *load = data;
+	volatile uint8_t sink;
+	cpu_set_t cpus;
+	uint32_t x = 1, i;
+	uint8_t *buf;
+	long n;
+
+	/* not wherever the thread that started the load was pinned */
+	CPU_ZERO(&cpus);
+	for (n = 0; n < sysconf(_SC_NPROCESSORS_CONF) && n < CPU_SETSIZE; n++)
+		CPU_SET(n, &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	/* may fail under mlockall(MCL_FUTURE), then it's CPU load alone */
+	buf = malloc(ATOMICTEST_LOAD_BUFFER_SIZE);
+
+	while (!__atomic_load_n(&load->stop, __ATOMIC_RELAXED)) {
+		/* memory bandwidth, then some dependent arithmetic */
+		if (buf)
+			memset(buf, x, ATOMICTEST_LOAD_BUFFER_SIZE);
+		for (i = 0; i < (1 << 20); i++)
+			x = x * 1664525u + 1013904223u;
+		sink = buf ? buf[x % ATOMICTEST_LOAD_BUFFER_SIZE] : x;
+	}
+
+	(void)sink;
+	free(buf);
+
+	return NULL;
+}
+
+struct at_load *
+at_load_start(uint32_t threads)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	struct at_load *load;
+	pthread_attr_t attr;
+	uint32_t i;
+
+	if (!threads)
+		threads = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+	load = calloc(1, sizeof(*load));
+	if (!load)
+		return NULL;
+
+	load->threads = calloc(threads, sizeof(*load->threads));
+	if (!load->threads) {
+		free(load);
+		return NULL;
+	}
+
+	/* not whatever policy the thread starting the load runs */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&load->threads[load->count], &attr,
+				   at_load_thread, load))
+			break;
+		load->count++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return load;
+}
+
+void
+at_load_stop(struct at_load *load)
+{
+	uint32_t i;
+
+	if (!load)
+		return;
+
+	__atomic_store_n(&load->stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < load->count; i++)
+		pthread_join(load->threads[i], NULL);
+
+	free(load->threads);
+	free(load);
+}
+
+/*
+ * Flips with the default scheduling and with the real-time controls, each
+ * on a quiet machine and under the background load, and compares the flip
+ * interval and commit latency distributions.
+ */
+static void
+at_instance_bench_rt(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+	const struct at_options *options = &instance->options;
+	struct at_present_stats *stats = &instance->stats;
+	struct at_load *load;
+	int rt, loaded;
+
+	printf("\nReal-time controls: %s", at_sched_names[config->sched]);
+	if (config->sched == AT_SCHED_FIFO)
+		printf(" priority %d", config->sched_priority);
+	if (config->cpus)
+		printf(", event thread on CPUs %s", config->cpus);
+	if (config->input_cpus)
+		printf(", input thread on CPUs %s", config->input_cpus);
+	if (config->mlock)
+		printf(", mlockall");
+	printf("\n\n%-8s %-5s %8s %7s %27s %27s\n", "", "", "", "",
+	       "flip interval ms", "commit us");
+	printf("%-8s %-5s %8s %7s %9s %8s %8s %9s %8s %8s\n", "sched", "load",
+	       "fps", "missed", "p50", "p99", "max", "p50", "p99", "max");
+
+	for (rt = 0; rt < 2 && !at_instance_interrupted(instance); rt++) {
+		if (rt && at_instance_set_realtime(instance, true) < 0)
+			break;
+
+		for (loaded = 0; loaded < 2 && !at_instance_interrupted(instance);
+		     loaded++) {
+			uint64_t frames;
+			double elapsed;
+
+			load = loaded ? at_load_start(options->load_threads) : NULL;
+
+			at_instance_reset_stats(instance);
+			frames = at_instance_flip_for(instance, options->bench_seconds,
+						     &elapsed);
+
+			at_load_stop(load);
+
+			printf("%-8s %-5s %8.2f %7" PRIu64 " %9.3f %8.3f %8.3f "
+			       "%9.1f %8.1f %8.1f\n",
+			       rt ? at_sched_names[config->sched] : "default",
+			       loaded ? "on" : "off", frames / elapsed,
+			       instance->missed_vblanks,
+			       at_samples_percentile(&stats->flip_intervals, 50) / 1000000.0,
+			       at_samples_percentile(&stats->flip_intervals, 99) / 1000000.0,
+			       at_samples_percentile(&stats->flip_intervals, 100) / 1000000.0,
+			       at_samples_percentile(&stats->commit_latency, 50) / 1000.0,
+			       at_samples_percentile(&stats->commit_latency, 99) / 1000.0,
+			       at_samples_percentile(&stats->commit_latency, 100) / 1000.0);
+		}
+	}
+
+	at_instance_set_realtime(instance, false);
+}
+
+/* One card of a multi-device run, with its own thread and event loop. */
+struct at_device_thread {
+	struct at_config config;
+	struct at_instance *instance;
+	pthread_t thread;
+	bool started;
+	double seconds;
+
+	uint64_t frames;
+	double elapsed;
+	uint64_t cpu_ns;
+};
+
+static void *
+at_device_thread_run(void *data)
+{
+	struct at_device_thread *t = data;
+	uint64_t cpu_ns = at_thread_cpu_ns();
+
+	at_instance_set_realtime(t->instance, true);
+
+	at_instance_reset_stats(t->instance);
+	t->frames = at_instance_flip_for(t->instance, t->seconds, &t->elapsed);
+	t->cpu_ns = at_thread_cpu_ns() - cpu_ns;
+
+	at_instance_set_realtime(t->instance, false);
+
+	return NULL;
+}
+
+/*
+ * Flips every device at once, one thread each, for the given time (or until
+ * interrupted) and prints a row per device and one for all of them.
+ */
+static void
+at_device_threads_run(struct at_device_thread *threads, int count,
+		      double seconds, const char *phase)
+{
+	uint64_t cpu_ns = at_process_cpu_ns();
+	uint64_t missed = 0;
+	double fps = 0.0, elapsed = 0.0;
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		threads[i].seconds = seconds;
+		threads[i].frames = 0;
+		threads[i].elapsed = 0.0;
+		threads[i].cpu_ns = 0;
+
+		ret = pthread_create(&threads[i].thread, NULL,
+				     at_device_thread_run, &threads[i]);
+		threads[i].started = !ret;
+		if (ret)
+			fprintf(stderr, "Couldn't start a thread for %s: %s\n",
+				threads[i].config.node, strerror(ret));
+	}
+
+	for (i = 0; i < count; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+	}
+
+	cpu_ns = at_process_cpu_ns() - cpu_ns;
+
+	for (i = 0; i < count; i++) {
+		struct at_device_thread *t = &threads[i];
+		struct at_samples *intervals = &t->instance->stats.flip_intervals;
+
+		if (!t->started || t->elapsed <= 0.0)
+			continue;
+
+		printf("%-16s %-9s %8.2f %8" PRIu64 " %8.3f %8.3f %9.2f\n",
+		       t->config.node, phase, t->frames / t->elapsed,
+		       t->instance->missed_vblanks,
+		       at_samples_percentile(intervals, 50) / 1000000.0,
+		       at_samples_percentile(intervals, 99) / 1000000.0,
+		       t->cpu_ns / 1000000.0 / t->elapsed);
+
+		fps += t->frames / t->elapsed;
+		missed += t->instance->missed_vblanks;
+		elapsed = MAX(elapsed, t->elapsed);
+	}
+
+	if (count > 1 && elapsed > 0.0)
+		printf("%-16s %-9s %8.2f %8" PRIu64 " %8s %8s %9.2f\n", "all",
+		       phase, fps, missed, "", "", cpu_ns / 1000000.0 / elapsed);
+}
+
+/* Every /dev/dri/cardN that exists, in order. */
+static int
+at_find_cards(char ***nodes)
+{
+	char path[32];
+	char **grown, *node;
+	int i, count = 0;
+
+	*nodes = NULL;
+
+	for (i = 0; i < ATOMICTEST_MAX_DEVICES; i++) {
+		snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+		if (access(path, F_OK) < 0)
+			continue;
+
+		grown = realloc(*nodes, (count + 1) * sizeof(**nodes));
+		if (!grown)
+			break;
+		*nodes = grown;
+		node = strdup(path);
+		if (!node)
+			break;
+		(*nodes)[count++] = node;
+	}
+
+	return count;
+}
+
+static int
+at_split_nodes(const char *list, char ***nodes)
+{
+	char *copy = strdup(list);
+	char *node, *save;
+	char **grown;
+	int count = 0;
+
+	*nodes = NULL;
+
+	if (!copy)
+		return 0;
+
+	for (node = strtok_r(copy, ",", &save); node;
+	     node = strtok_r(NULL, ",", &save)) {
+		grown = realloc(*nodes, (count + 1) * sizeof(**nodes));
+		if (!grown)
+			break;
+		*nodes = grown;
+		node = strdup(node);
+		if (!node)
+			break;
+		(*nodes)[count++] = node;
+	}
+
+	free(copy);
+
+	return count;
+}
+
+/*
+ * Multi-device mode: an independent instance per card, each flipping from
+ * its own thread. Cards that can't be brought up (render-only GPUs, nothing
+ * connected) are skipped. With --bench-devices each card first runs alone
+ * and then all of them together, so the difference shows whether they
+ * interfere through memory bandwidth or CPU time.
+ */
+int
+at_run_devices(const struct at_config *caller_config,
+	       const struct at_options *options)
+{
+	struct at_device_thread *threads;
+	struct at_load *load = NULL;
+	struct at_config copy, *config = &copy;
+	/* the card taking input stops every one of them with Q */
+	volatile sig_atomic_t stop = false;
+	char **nodes;
+	int i, count, used = 0;
+
+	if (at_config_copy(config, caller_config) < 0)
+		return -1;
+
+	if (!strcmp(options->devices, "all"))
+		count = at_find_cards(&nodes);
+	else
+		count = at_split_nodes(options->devices, &nodes);
+
+	threads = calloc(count ? count : 1, sizeof(*threads));
+	if (!threads)
+		goto out_free_nodes;
+
+	for (i = 0; i < count; i++) {
+		struct at_device_thread *t = &threads[used];
+
+		t->config = *config;
+		t->config.node = nodes[i];
+		/* the cache describes a single card */
+		t->config.topology_cache = NULL;
+		/* one libinput context is enough, the first card takes it */
+		t->config.no_input = used > 0;
+
+		printf("\n%s:\n", nodes[i]);
+
+		t->instance = at_instance_create_options(&t->config, options);
+		if (!t->instance) {
+			fprintf(stderr, "Skipping %s.\n", nodes[i]);
+			continue;
+		}
+		t->instance->stop = &stop;
+
+		if (at_instance_modeset_save(t->instance) < 0) {
+			at_instance_destroy(t->instance);
+			fprintf(stderr, "Skipping %s.\n", nodes[i]);
+			continue;
+		}
+
+		if (at_instance_modeset_apply(t->instance) < 0) {
+			at_instance_modeset_restore(t->instance);
+			at_instance_destroy(t->instance);
+			fprintf(stderr, "Skipping %s.\n", nodes[i]);
+			continue;
+		}
+
+		if (!config->scene_path)
+			at_instance_set_num_overlays_use(t->instance,
+							 config->num_overlays);
+		used++;
+	}
+
+	if (!used) {
+		fprintf(stderr, "No usable KMS device.\n");
+		goto out_free_threads;
+	}
+
+	printf("\n%-16s %-9s %8s %8s %8s %8s %9s\n", "device", "run", "fps",
+	       "missed", "p50 ms", "p99 ms", "cpu ms/s");
+
+	if (options->load)
+		load = at_load_start(options->load_threads);
+
+	if (options->bench_devices) {
+		for (i = 0; i < used && !at_instance_interrupted(threads[0].instance);
+		     i++)
+			at_device_threads_run(&threads[i], 1, options->bench_seconds,
+					      "alone");
+		if (!at_instance_interrupted(threads[0].instance))
+			at_device_threads_run(threads, used, options->bench_seconds,
+					      "together");
+	} else {
+		/* until Ctrl-C */
+		at_device_threads_run(threads, used, INFINITY, "together");
+	}
+
+	at_load_stop(load);
+
+	for (i = 0; i < used; i++) {
+		at_instance_modeset_restore(threads[i].instance);
+		at_instance_destroy(threads[i].instance);
+	}
+
+out_free_threads:
+	free(threads);
+out_free_nodes:
+	for (i = 0; i < count; i++)
+		free(nodes[i]);
+	free(nodes);
+
+	return used ? 0 : -1;
+}
+
+void
+at_instance_get_stats(struct at_instance *instance, struct at_stats *out)
+{
+	struct at_present_stats *present = &instance->stats;
+	struct at_stats summary, *stats = &summary;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->frames = instance->frames;
+	stats->presents = present->presents;
+	stats->ioctls = present->ioctls;
+	stats->missed_vblanks = instance->missed_vblanks;
+	stats->present_cpu_ns = present->cpu_ns;
+	stats->render_ns = instance->render_ns;
+
+	stats->flip_interval_p50_ns =
+		at_samples_percentile(&present->flip_intervals, 50);
+	stats->flip_interval_p99_ns =
+		at_samples_percentile(&present->flip_intervals, 99);
+	stats->submit_to_flip_p50_ns =
+		at_samples_percentile(&present->submit_to_flip, 50);
+	stats->submit_to_flip_p99_ns =
+		at_samples_percentile(&present->submit_to_flip, 99);
+	stats->input_latency_p50_ns =
+		at_samples_percentile(&present->input_latency, 50);
+	stats->input_latency_p99_ns =
+		at_samples_percentile(&present->input_latency, 99);
+	stats->commit_latency_p50_ns =
+		at_samples_percentile(&present->commit_latency, 50);
+	stats->commit_latency_p99_ns =
+		at_samples_percentile(&present->commit_latency, 99);
+
+	/* only what the caller's struct has room for */
+	stats->size = MIN(out->size, sizeof(*stats));
+	memcpy(out, stats, stats->size);
+}
+
+/*
+ * config.async is switched on past the benchmarks that compare it, so the
+ * ones after and the regular loop run with it, as they always have.
+ */
+int
+at_instance_bench(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+	const struct at_options *options = &instance->options;
+
+	*instance->stop = false;
+
+	if (options->bench_modes) {
+		at_instance_bench_modes(instance, options->bench_modes_filter);
+		return 1;
+	}
+
+	if (options->bench_planes) {
+		if (!config->scene_path)
+			at_instance_set_num_overlays_use(instance, config->num_overlays);
+		at_instance_bench_planes(instance);
+		return 1;
+	}
+
+	if (options->bench_input) {
+		at_instance_bench_input(instance);
+		return 1;
+	}
+
+	if (options->bench_vrr) {
+		at_instance_bench_vrr(instance);
+		return 1;
+	}
+
+	if (options->bench_async) {
+		at_instance_bench_async(instance);
+		return 1;
+	}
+
+	if (options->bench_cursor) {
+		at_instance_bench_cursor(instance);
+		return 1;
+	}
+
+	if (options->bench_commit) {
+		at_instance_bench_commit(instance);
+		return 1;
+	}
+
+	if (options->bench_rt) {
+		at_instance_bench_rt(instance);
+		return 1;
+	}
+
+	if (config->async && at_instance_set_async(instance, true) < 0) {
+		fprintf(stderr, "Async page flips are not supported.\n");
+		return -EOPNOTSUPP;
+	}
+
+	if (options->bench_backends) {
+		at_instance_bench_backends(instance);
+		return 1;
+	}
+
+	if (options->bench_scale_count) {
+		at_instance_bench_scale(instance);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+at_instance_print_memory(struct at_instance *instance)
+{
+	at_mem_report(&instance->device);
+}
+
+void
+at_instance_report(struct at_instance *instance, double seconds)
+{
+	const struct at_config *config = &instance->config;
+
+	if (instance->video)
+		at_video_report(instance->video, instance->missed_vblanks,
+				config->video_fps);
+
+	if (config->adaptive)
+		at_adaptive_report(instance);
+
+	if (instance->stats.input_events)
+		at_instance_print_input(instance);
+
+	if (instance->stats.input_latency.count)
+		at_samples_print_ms("Input to flip", &instance->stats.input_latency);
+
+	if (instance->async)
+		at_instance_print_tears(instance);
+
+	if (instance->hotplug_latency.count)
+		at_samples_print_ms("Hotplug to first frame", &instance->hotplug_latency);
+
+	if (config->pace) {
+		printf("Pacing (%s refresh):\n", instance->vrr_enabled ? "variable" : "fixed");
+		at_instance_print_pacing(instance);
+	}
+
+	if (instance->cadence.active)
+		at_instance_print_cadence(instance);
+
+	if (instance->options.perf)
+		at_instance_print_perf(instance);
+
+	if (instance->idle.enabled)
+		at_instance_print_idle(instance, seconds);
+
+	if (instance->writeback)
+		at_writeback_report(instance->writeback, seconds);
+}
+
+static long
+at_rss_kib(void)
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = -1;
+	fclose(f);
+
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int
+at_open_fds(void)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *ent;
+	int count = 0;
+
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)))
+		count += ent->d_name[0] != '.';
+	closedir(dir);
+
+	/* the directory being read */
+	return count - 1;
+}
+
+/*
+ * Resource counters of the soak, sampled at the end of every window. Blobs
+ * and fbs are our own bookkeeping of what we created and haven't released;
+ * the kernel doesn't expose per-client object counts.
+ */
+static void
+at_soak_sample(struct at_instance *instance, struct at_soak_resources *res)
+{
+	res->rss_kib = at_rss_kib();
+	res->fds = at_open_fds();
+	res->blobs = instance->device.live_blobs;
+	res->fbs = instance->device.live_fbs;
+}
+
+static bool
+at_soak_regressed(const struct at_soak *soak, uint64_t base, uint64_t now)
+{
+	/* below a tenth of a millisecond nothing is worth an alert */
+	return base && now > base * (100 + soak->alert_pct) / 100 &&
+	       now - base > 100000;
+}
+
+static void
+at_soak_alert(struct at_soak *soak, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("  ALERT window %u: ", soak->windows);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+
+	soak->alerts++;
+}
+
+/*
+ * Closes a window: prints its row, folds it into the whole-run histograms and
+ * compares it against the first window. Frame time regressions are reported
+ * every window they persist; resource counts only when they reach a new high,
+ * so a slow leak gives one alert per step rather than one per window.
+ */
+static void
+at_soak_window(struct at_instance *instance, uint64_t now)
+{
+	struct at_soak *soak = instance->soak;
+	struct at_soak_resources res;
+	uint64_t period = at_mode_period_ns(&instance->device.mode);
+	uint64_t elapsed = (now - soak->start_ns) / 1000000000;
+	double seconds = (now - soak->window_start_ns) / 1000000000.0;
+	uint64_t p50 = at_histogram_percentile(&soak->frame, 50);
+	uint64_t p99 = at_histogram_percentile(&soak->frame, 99);
+	uint64_t commit_p99 = at_histogram_percentile(&soak->commit, 99);
+	double drift = 0.0;
+
+	soak->windows++;
+	at_soak_sample(instance, &res);
+
+	if (soak->frame.count)
+		drift = ((double)soak->frame.sum / soak->frame.count - period) /
+			period * 1000000.0;
+
+	printf("%3" PRIu64 ":%02" PRIu64 ":%02" PRIu64 " %6u %8" PRIu64
+	       " %6" PRIu64 " %7.2f %7.3f %7.3f %7.3f %8.0f %7.3f %8ld %4d %5u %4u\n",
+	       elapsed / 3600, elapsed / 60 % 60, elapsed % 60, soak->windows,
+	       soak->frame.count, instance->missed_vblanks,
+	       seconds > 0 ? soak->frame.count / seconds : 0.0,
+	       p50 / 1000000.0, p99 / 1000000.0, soak->frame.max / 1000000.0,
+	       drift, commit_p99 / 1000000.0, res.rss_kib, res.fds, res.blobs,
+	       res.fbs);
+
+	soak->missed += instance->missed_vblanks;
+
+	if (soak->windows == 1) {
+		soak->baseline_frame = soak->frame;
+		soak->baseline_commit = soak->commit;
+		soak->baseline = res;
+		soak->peak = res;
+	} else {
+		uint64_t base_p50 = at_histogram_percentile(&soak->baseline_frame, 50);
+		uint64_t base_p99 = at_histogram_percentile(&soak->baseline_frame, 99);
+		uint64_t base_commit =
+			at_histogram_percentile(&soak->baseline_commit, 99);
+
+		if (at_soak_regressed(soak, base_p50, p50))
+			at_soak_alert(soak, "frame p50 %.3f ms, baseline %.3f ms",
+				      p50 / 1000000.0, base_p50 / 1000000.0);
+		if (at_soak_regressed(soak, base_p99, p99))
+			at_soak_alert(soak, "frame p99 %.3f ms, baseline %.3f ms",
+				      p99 / 1000000.0, base_p99 / 1000000.0);
+		if (at_soak_regressed(soak, base_commit, commit_p99))
+			at_soak_alert(soak, "commit p99 %.3f ms, baseline %.3f ms",
+				      commit_p99 / 1000000.0, base_commit / 1000000.0);
+
+		if (res.fds > soak->peak.fds) {
+			at_soak_alert(soak, "%d fds open, %d at the start",
+				      res.fds, soak->baseline.fds);
+			soak->peak.fds = res.fds;
+		}
+		if (res.blobs > soak->peak.blobs) {
+			at_soak_alert(soak, "%u property blobs held, %u at the start",
+				      res.blobs, soak->baseline.blobs);
+			soak->peak.blobs = res.blobs;
+		}
+		if (res.fbs > soak->peak.fbs) {
+			at_soak_alert(soak, "%u framebuffers held, %u at the start",
+				      res.fbs, soak->baseline.fbs);
+			soak->peak.fbs = res.fbs;
+		}
+		if (res.rss_kib > soak->peak.rss_kib &&
+		    res.rss_kib > soak->baseline.rss_kib * (100 + soak->alert_pct) / 100) {
+			at_soak_alert(soak, "RSS %ld KiB, %ld KiB at the start",
+				      res.rss_kib, soak->baseline.rss_kib);
+			soak->peak.rss_kib = res.rss_kib;
+		}
+	}
+
+	at_histogram_merge(&soak->total_frame, &soak->frame);
+	at_histogram_merge(&soak->total_commit, &soak->commit);
+	memset(&soak->frame, 0, sizeof(soak->frame));
+	memset(&soak->commit, 0, sizeof(soak->commit));
+	soak->window_start_ns = now;
+
+	/* the window's slowest frames go with the reset below */
+	if (instance->options.perf)
+		at_instance_print_perf(instance);
+
+	/* keeps the per-frame sample arrays from growing with the run */
+	at_instance_reset_stats(instance);
+
+	fflush(stdout);
+}
+
+/*
+ * Flips for options.soak_seconds (until interrupted if 0) and summarizes
+ * every options.soak_window seconds. Frame intervals and commit times go to
+ * fixed histograms, so memory stays flat over a run of weeks and any growth
+ * the RSS column shows is real.
+ */
+int
+at_instance_soak(struct at_instance *instance)
+{
+	const struct at_config *config = &instance->config;
+	const struct at_options *options = &instance->options;
+	uint64_t window_ns = options->soak_window * 1000000000.0;
+	uint64_t now, end, window_end;
+	struct at_soak *soak;
+
+	*instance->stop = false;
+
+	soak = calloc(1, sizeof(*soak));
+	if (!soak)
+		return -ENOMEM;
+
+	soak->alert_pct = options->soak_alert_pct;
+
+	if (!config->scene_path)
+		at_instance_set_num_overlays_use(instance, config->num_overlays);
+
+	printf("\nSoak: %.0f s windows, alerts past +%u%% of the first window\n"
+	       "ppm is the mean flip interval against the mode's period, commit\n"
+	       "the p99 of the commit ioctl in ms; blobs and fbs count the ones\n"
+	       "atomictest created and still holds, not the kernel's totals\n",
+	       options->soak_window, soak->alert_pct);
+	printf("%9s %6s %8s %6s %7s %7s %7s %7s %8s %7s %8s %4s %5s %4s\n",
+	       "time", "window", "frames", "missed", "fps", "p50 ms", "p99 ms",
+	       "max ms", "ppm", "commit", "rss KiB", "fds", "blobs", "fbs");
+
+	at_instance_reset_stats(instance);
+	instance->soak = soak;
+
+	now = at_now_ns();
+	soak->start_ns = now;
+	soak->window_start_ns = now;
+	end = options->soak_seconds > 0 ?
+	      now + options->soak_seconds * 1000000000.0 : UINT64_MAX;
+	window_end = now + window_ns;
+
+	instance->run = true;
+	at_instance_draw_frame(instance);
+
+	while (!at_instance_interrupted(instance) && now < end) {
+		if (at_instance_process_events(instance) < 0)
+			break;
+
+		now = at_now_ns();
+		if (now >= window_end) {
+			at_soak_window(instance, now);
+			window_end += window_ns;
+		}
+	}
+
+	at_instance_stop(instance);
+
+	now = at_now_ns();
+	if (soak->frame.count)
+		at_soak_window(instance, now);
+
+	printf("\nSoak: %.1f h, %u windows, %" PRIu64 " frames, %" PRIu64
+	       " missed vblanks, %" PRIu64 " alerts\n",
+	       (now - soak->start_ns) / 3600000000000.0, soak->windows,
+	       soak->total_frame.count, soak->missed, soak->alerts);
+	printf("Frame interval: p50=%.3f p99=%.3f p99.9=%.3f max=%.3f ms\n",
+	       at_histogram_percentile(&soak->total_frame, 50) / 1000000.0,
+	       at_histogram_percentile(&soak->total_frame, 99) / 1000000.0,
+	       at_histogram_percentile(&soak->total_frame, 99.9) / 1000000.0,
+	       soak->total_frame.max / 1000000.0);
+	printf("Commit: p50=%.3f p99=%.3f p99.9=%.3f max=%.3f ms\n",
+	       at_histogram_percentile(&soak->total_commit, 50) / 1000000.0,
+	       at_histogram_percentile(&soak->total_commit, 99) / 1000000.0,
+	       at_histogram_percentile(&soak->total_commit, 99.9) / 1000000.0,
+	       soak->total_commit.max / 1000000.0);
+
+	instance->soak = NULL;
+	free(soak);
+
+	return 0;
+}
@@ -0,0 +1,328 @@
+#ifndef ATOMICTEST_H
+#define ATOMICTEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the library is built with hidden visibility, this is what it exports */
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
+#define ATOMICTEST_MAX_CADENCE 16
+
+/* built-in primary plane content, used when no render callback is set */
+enum at_content {
+	AT_CONTENT_FILL,
+	AT_CONTENT_RECT,
+	AT_CONTENT_BLEND,
+	AT_CONTENT_COUNT
+};
+
+enum at_pace {
+	AT_PACE_NONE,
+	AT_PACE_SINE,
+	AT_PACE_RANDOM,
+};
+
+enum at_backend {
+	AT_BACKEND_ATOMIC,
+	AT_BACKEND_LEGACY,
+	AT_BACKEND_COUNT
+};
+
+/* where the cursor is shown */
+enum at_cursor_mode {
+	AT_CURSOR_PLANE,
+	/* a spare overlay plane, for hardware without a usable cursor plane */
+	AT_CURSOR_OVERLAY,
+	/* blended into the primary plane with save-under restore */
+	AT_CURSOR_SOFTWARE,
+	AT_CURSOR_COUNT
+};
+
+enum at_sched {
+	AT_SCHED_OTHER,
+	AT_SCHED_FIFO,
+	AT_SCHED_DEADLINE,
+};
+
+/*
+ * Fill in with at_config_init() before changing anything. The layout only
+ * ever grows at the end: the library reads the first size bytes and keeps
+ * its defaults for anything a caller built against an older header
+ * doesn't know about.
+ */
+struct at_config {
+	/* sizeof(struct at_config) as the caller was built */
+	uint32_t size;
+
+	const char *node;
+	int num_overlays;
+	enum at_content content;
+	/* render into a cached buffer and stream what changed to scanout */
+	bool shadow;
+
+	/* raw video playback, enabled when video_path is set */
+	const char *video_path;
+	uint32_t video_width;
+	uint32_t video_height;
+	uint32_t video_format;
+	double video_fps;
+	bool video_overlay;
+	bool video_read;
+
+	/* primary plane render resolution, in percent of the mode size */
+	uint32_t scale;
+
+	/* drop overlays while frames miss their vblank, restore them after */
+	bool adaptive;
+
+	enum at_backend backend;
+
+	/* tearing flips, presented as soon as they're committed */
+	bool async;
+
+	/* variable refresh and scripted frame pacing */
+	bool vrr;
+	enum at_pace pace;
+	double pace_min_fps;
+	double pace_max_fps;
+	double pace_period;
+	/* for AT_PACE_RANDOM */
+	uint32_t seed;
+
+	/* plane layout, content and motion from a file instead of the default */
+	const char *scene_path;
+
+	/* dispatch input on a thread of its own */
+	bool input_thread;
+	/* leave libinput to another instance */
+	bool no_input;
+
+	/* connector/CRTC/plane choice and property names from an earlier run */
+	const char *topology_cache;
+
+	/* scanout memory the instance may allocate in bytes, 0 for no limit */
+	uint64_t mem_budget;
+
+	/*
+	 * The client renders and submits every frame with
+	 * at_instance_acquire_buffer()/at_instance_present_buffer(); flips
+	 * don't schedule the next frame.
+	 */
+	bool manual_present;
+
+	enum at_cursor_mode cursor;
+
+	/*
+	 * Present on chosen vblanks rather than every one: cadence[] gives
+	 * each frame's vblanks in turn (3:2 pulldown), or target_fps derives
+	 * them from the refresh rate.
+	 */
+	double target_fps;
+	uint32_t cadence[ATOMICTEST_MAX_CADENCE];
+	uint32_t cadence_count;
+
+	/*
+	 * Real-time controls for the thread dispatching events, which renders
+	 * and commits too, and the input thread, see at_instance_set_realtime().
+	 * CPU lists look like "2" or "0,2-3", NULL leaves a thread unpinned.
+	 */
+	enum at_sched sched;
+	int sched_priority;
+	/* SCHED_DEADLINE runtime per frame period, 0 for a quarter of it */
+	uint64_t sched_runtime_ns;
+	const char *cpus;
+	const char *input_cpus;
+	bool mlock;
+
+	/*
+	 * Present only when something changes, see at_instance_set_on_demand();
+	 * the scene updates every change_interval seconds, 0 for input only.
+	 */
+	bool on_demand;
+	double change_interval;
+};
+
+struct at_instance;
+
+/* A primary plane buffer handed to the client, always XRGB8888. */
+struct at_buffer {
+	void *data;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	/*
+	 * Presents since this buffer's content was last shown, as with
+	 * EGL_EXT_buffer_age: 0 means the content is undefined, N means it
+	 * holds the frame presented N frames ago.
+	 */
+	uint32_t age;
+	uint32_t index;
+};
+
+/*
+ * Fills the buffer with the next frame, on the flip schedule (or the pacing
+ * script). The callback runs on the thread that dispatches the instance's
+ * events; frame counts the frames rendered so far.
+ */
+typedef void (*at_render_func)(struct at_instance *instance,
+			       struct at_buffer *buffer, uint64_t frame,
+			       void *data);
+
+/*
+ * Summary of what presenting cost since the last at_instance_reset_stats().
+ * Grows at the end like struct at_config.
+ */
+struct at_stats {
+	/* sizeof(struct at_stats) as the caller was built, set before the call */
+	uint32_t size;
+
+	uint64_t frames;
+	uint64_t presents;
+	uint64_t ioctls;
+	uint64_t missed_vblanks;
+	/* thread CPU time spent building and submitting frames */
+	uint64_t present_cpu_ns;
+	/* time spent in the render callback or the built-in content */
+	uint64_t render_ns;
+
+	uint64_t flip_interval_p50_ns;
+	uint64_t flip_interval_p99_ns;
+	uint64_t submit_to_flip_p50_ns;
+	uint64_t submit_to_flip_p99_ns;
+	uint64_t input_latency_p50_ns;
+	uint64_t input_latency_p99_ns;
+	/* wall time of the commit (or page flip) ioctls of a present */
+	uint64_t commit_latency_p50_ns;
+	uint64_t commit_latency_p99_ns;
+};
+
+void
+at_set_verbose(bool verbose);
+
+/* Sets size and the default of every other field. */
+void
+at_config_init(struct at_config *config);
+
+/*
+ * Makes the loops of every instance return, now and from then on: for a
+ * process that is shutting down. Safe to call from a signal handler.
+ */
+void
+at_interrupt(void);
+
+const char *
+at_content_name(enum at_content content);
+
+int
+at_content_from_name(const char *name, enum at_content *content);
+
+struct at_instance *
+at_instance_create(const struct at_config *config);
+
+int
+at_instance_destroy(struct at_instance *instance);
+
+int
+at_instance_modeset_save(struct at_instance *instance);
+
+int
+at_instance_modeset_apply(struct at_instance *instance);
+
+int
+at_instance_modeset_restore(struct at_instance *instance);
+
+void
+at_instance_set_num_overlays_use(struct at_instance *instance, int num);
+
+void
+at_instance_set_render_func(struct at_instance *instance, at_render_func func,
+			    void *data);
+
+/* Renders (built-in content or the render callback) and submits a frame. */
+void
+at_instance_draw_frame(struct at_instance *instance);
+
+/*
+ * Waits for and dispatches DRM, input and hotplug events; flips draw the
+ * next frame unless the instance is stopped or presents manually.
+ */
+int
+at_instance_process_events(struct at_instance *instance);
+
+/* Stops drawing and waits for the flip in flight. */
+int
+at_instance_stop(struct at_instance *instance);
+
+/*
+ * Flips for the given time (INFINITY until interrupted), returns the frames.
+ * Clears an earlier at_instance_interrupt() of the instance first.
+ */
+uint64_t
+at_instance_run_for(struct at_instance *instance, double seconds,
+		    double *elapsed);
+
+/*
+ * Makes the instance's loop return, safe to call from a signal handler or
+ * another thread. Other instances keep running.
+ */
+void
+at_instance_interrupt(struct at_instance *instance);
+
+/*
+ * Whether at_interrupt() or at_instance_interrupt() (or the Q key) asked
+ * the instance to stop, for clients running their own loop.
+ */
+bool
+at_instance_interrupted(struct at_instance *instance);
+
+/* -EBUSY while the previous present hasn't flipped yet. */
+int
+at_instance_acquire_buffer(struct at_instance *instance,
+			   struct at_buffer *buffer);
+
+int
+at_instance_present_buffer(struct at_instance *instance,
+			   struct at_buffer *buffer);
+
+uint64_t
+at_instance_get_frames(struct at_instance *instance);
+
+void
+at_instance_reset_stats(struct at_instance *instance);
+
+void
+at_instance_get_stats(struct at_instance *instance, struct at_stats *stats);
+
+/*
+ * Applies the configured scheduling policy, CPU pinning and memory locking
+ * to the calling thread, which must be the one dispatching the instance's
+ * events, and to the input thread; or puts back what they had before.
+ */
+int
+at_instance_set_realtime(struct at_instance *instance, bool enable);
+
+/*
+ * Draws a frame after a flip only for a scene update or input, otherwise
+ * leaves the flip chain stopped until at_instance_process_events() sees a
+ * change. Cursor motion alone re-commits the buffer on screen.
+ */
+int
+at_instance_set_on_demand(struct at_instance *instance, bool enable);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * A minimal libatomictest client: a bar sweeping across the primary plane,
+ * drawn either from the render callback on the flip schedule or by the
+ * client itself through acquire/present. Both redraw only what changed
+ * since the buffer was last shown, going by its age.
+ *
+ *   atomictest-client [callback|manual] [SECONDS] [NODE]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "atomictest.h"
+
+#define BAR_WIDTH 64
+#define BAR_STEP 8
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void
+sigint_handler(int sig)
+{
+	at_interrupt();
+}
+
+static uint32_t
+bar_x(const struct at_buffer *buffer, uint64_t frame)
+{
+	return frame * BAR_STEP % (buffer->width - BAR_WIDTH);
+}
+
+static void
+fill_columns(struct at_buffer *buffer, uint32_t x1, uint32_t x2,
+	     uint32_t color)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < buffer->height; y++) {
+		uint32_t *row = (uint32_t *)((uint8_t *)buffer->data +
+					     y * buffer->stride);
+
+		for (x = x1; x < x2; x++)
+			row[x] = color;
+	}
+}
+
+/*
+ * The buffer holds the frame from age presents ago: the background only
+ * needs repainting where the bar was since then, unless the bar wrapped.
+ */
+static void
+draw_bar(struct at_buffer *buffer, uint64_t frame)
+{
+	uint32_t x = bar_x(buffer, frame);
+	uint32_t old_x = buffer->age && frame >= buffer->age ?
+			 bar_x(buffer, frame - buffer->age) : 0;
+
+	if (!buffer->age || frame < buffer->age || old_x > x)
+		fill_columns(buffer, 0, buffer->width, 0xFF202020);
+	else
+		fill_columns(buffer, old_x, x, 0xFF202020);
+
+	fill_columns(buffer, x, x + BAR_WIDTH, 0xFFE0E0E0);
+}
+
+static void
+render(struct at_instance *instance, struct at_buffer *buffer,
+       uint64_t frame, void *data)
+{
+	draw_bar(buffer, frame);
+}
+
+/* The client paces itself: a buffer whenever the previous frame flipped. */
+static uint64_t
+run_manual(struct at_instance *instance, double seconds)
+{
+	struct at_buffer buffer;
+	double end = now_seconds() + seconds;
+	uint64_t frame = 0;
+	int ret;
+
+	while (!at_instance_interrupted(instance) && now_seconds() < end) {
+		ret = at_instance_acquire_buffer(instance, &buffer);
+		if (ret == -EBUSY) {
+			if (at_instance_process_events(instance) < 0)
+				break;
+			continue;
+		}
+		if (ret < 0)
+			break;
+
+		draw_bar(&buffer, frame++);
+
+		if (at_instance_present_buffer(instance, &buffer) < 0)
+			break;
+	}
+
+	at_instance_stop(instance);
+
+	return frame;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct at_config config;
+	struct at_instance *instance;
+	struct at_stats stats;
+	double seconds = argc > 2 ? strtod(argv[2], NULL) : 5.0;
+	double elapsed = 0;
+	bool manual = argc > 1 && !strcmp(argv[1], "manual");
+	uint64_t frames;
+	int ret = -1;
+
+	if (argc > 1 && !manual && strcmp(argv[1], "callback")) {
+		fprintf(stderr, "Usage: %s [callback|manual] [SECONDS] [NODE]\n",
+			argv[0]);
+		return -1;
+	}
+
+	signal(SIGINT, sigint_handler);
+
+	at_config_init(&config);
+	config.num_overlays = 0;
+	config.manual_present = manual;
+	if (argc > 3)
+		config.node = argv[3];
+
+	instance = at_instance_create(&config);
+	if (!instance)
+		return -1;
+
+	if (at_instance_modeset_save(instance) < 0)
+		goto out_destroy;
+
+	if (at_instance_modeset_apply(instance) < 0)
+		goto out_restore;
+
+	at_instance_set_num_overlays_use(instance, 0);
+	at_instance_reset_stats(instance);
+
+	if (manual) {
+		frames = run_manual(instance, seconds);
+	} else {
+		at_instance_set_render_func(instance, render, NULL);
+		frames = at_instance_run_for(instance, seconds, &elapsed);
+	}
+
+	stats.size = sizeof(stats);
+	at_instance_get_stats(instance, &stats);
+
+	printf("%s: %" PRIu64 " frames, %" PRIu64 " missed vblanks, "
+	       "render %.3f ms/frame, flip interval p99 %.3f ms\n",
+	       manual ? "manual" : "callback", frames, stats.missed_vblanks,
+	       frames ? stats.render_ns / 1000000.0 / frames : 0.0,
+	       stats.flip_interval_p99_ns / 1000000.0);
+
+	ret = 0;
+
+out_restore:
+	at_instance_modeset_restore(instance);
+out_destroy:
+	at_instance_destroy(instance);
+
+	return ret;
+}